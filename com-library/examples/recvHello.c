@@ -30,6 +30,7 @@ void usage() {
   COML_DBM(" -hi - ip of the host gateway to connect to");
   COML_DBM(" -hp - port of the host gateway to connect to");
   COML_DBM(" -s - use socket instead of memory sharing");
+  COML_DBM(" -t - use a plain tcp socket instead of zmq");
 }
 
 
@@ -45,7 +46,7 @@ int main(int argc, char * argv[]) {
   const char ** port = &node_port;
 
 
-  while((opt = getopt(argc, argv, "i:p:nhs")) != -1) {
+  while((opt = getopt(argc, argv, "i:p:nhst")) != -1) {
     switch (opt) {
     case 'i':
       if(ip) {
@@ -67,6 +68,9 @@ int main(int argc, char * argv[]) {
     case 's':
       sock = 2;
       break;
+    case 't':
+      sock = VCA_COM_TCP_SOCKET;
+      break;
     case '?':
       COML_DBM("argument %c requires a parameter", opt);
       usage();
@@ -24,12 +24,13 @@
 #include <vca_com.h>
 
 void usage() {
-  COML_DBM("sendHello -ni <node ip> -np <node port> -hi <host ip> -hp <host port> -di <desitnation ip> -dp <destination port> [-s]");
+  COML_DBM("sendHello -ni <node ip> -np <node port> -hi <host ip> -hp <host port> -di <desitnation ip> -dp <destination port> [-s|-t]");
   COML_DBM(" -ni - ip of this node");
   COML_DBM(" -np - port of this node");
   COML_DBM(" -hi - ip of the host gateway to connect to");
   COML_DBM(" -hp - port of the host gateway to connect to");
   COML_DBM(" -s - use socket instead of memory sharing");
+  COML_DBM(" -t - use a plain tcp socket instead of zmq");
 }
 
 
@@ -48,7 +49,7 @@ int main(int argc, char * argv[]) {
   const char ** port = &node_port;
 
 
-  while((opt = getopt(argc, argv, "i:p:nhdsc:")) != -1) {
+  while((opt = getopt(argc, argv, "i:p:nhdstc:")) != -1) {
     switch (opt) {
     case 'i':
       if(ip) {
@@ -74,6 +75,9 @@ int main(int argc, char * argv[]) {
     case 's':
       sock = VCA_COM_ZMQ_SOCKET;
       break;
+    case 't':
+      sock = VCA_COM_TCP_SOCKET;
+      break;
     case 'c':
       destination_socket = optarg;
       break;
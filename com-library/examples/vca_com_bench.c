@@ -0,0 +1,357 @@
+/*
+ * Copyright 2019 Intel(R) Corporation (http://www.intel.com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Message rate and round trip latency of the socket transports of libvcacom over loopback.
+//
+// For each transport a responder thread stands in for the host gateway: it reads the messages of a
+// libvcacom client off its socket the way the gateway does, echoes pings and acknowledges the end of
+// a rate run. The zmq responder is a ZMQ_STREAM socket, the tcp one uses vca_com_tcp_*. The client
+// sends n messages back to back for the rate, then r pings one at a time for the latency. One CSV
+// line per transport goes to stdout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <zmq.h>
+
+#include <vca_com.h>
+
+#define OP_DATA 'd'
+#define OP_PING 'p'
+#define OP_END 'e'
+#define WARMUP_PINGS 100
+
+static struct {
+  unsigned long long size;
+  unsigned long msgs;
+  unsigned long pings;
+  const char * port;
+  int transports[2];
+  unsigned int num_transports;
+} cfg = { 64, 100000, 10000, "5555", { VCA_COM_ZMQ_SOCKET, VCA_COM_TCP_SOCKET }, 2 };
+
+static void usage() {
+  fprintf(stderr, "vca_com_bench [-m zmq|tcp] [-s <bytes>] [-n <msgs>] [-r <pings>] [-p <port>] [-N] [-u <usec>] [-z <bytes>]\n");
+  fprintf(stderr, " -m - only this transport (default both)\n");
+  fprintf(stderr, " -s - payload of each message (default 64)\n");
+  fprintf(stderr, " -n - messages of the rate run (default 100000)\n");
+  fprintf(stderr, " -r - round trips of the latency run (default 10000)\n");
+  fprintf(stderr, " -p - port of the responders, the tcp one takes the next (default 5555)\n");
+  fprintf(stderr, " -N, -u, -z - tcp: no TCP_NODELAY, SO_BUSY_POLL, MSG_ZEROCOPY from this many bytes\n");
+}
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_ull(const void * a, const void * b) {
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+static const char * port_of(int transport) {
+  static char tcp_port[8];
+
+  if(transport == VCA_COM_ZMQ_SOCKET)
+    return cfg.port;
+  snprintf(tcp_port, sizeof(tcp_port), "%lu", strtoul(cfg.port, NULL, 10) + 1);
+  return tcp_port;
+}
+
+// what a responder does with the message msg of len bytes, which has its hdr in front;
+// the answer to send, if any, is in *reply
+static int respond(char * msg, unsigned long long len, char ** reply, unsigned long long * reply_len) {
+  vca_com_msg_hdr * hdr = vca_com_msg_get_hdr(msg);
+  char * payload = vca_com_msg_get_msg(msg);
+
+  *reply = NULL;
+  if(hdr->length == 0)
+    return 0;
+
+  switch(payload[0]) {
+  case OP_PING:
+  case OP_END:
+    // back to where it came from, the hdr of the client names it as src
+    vca_com_cpy_addr(&hdr->src, &hdr->dst);
+    *reply = msg;
+    *reply_len = (payload[0] == OP_PING) ? len : sizeof(vca_com_msg_hdr) + 1;
+    if(payload[0] == OP_END)
+      hdr->length = 1;
+    return 0;
+  case OP_DATA:
+    return 0;
+  default:
+    fprintf(stderr, "responder: unknown msg\n");
+    return -1;
+  }
+}
+
+static void * tcp_responder(void * arg) {
+  int lfd = *(int *) arg;
+  vca_com_tcps * t = NULL;
+  char * msg = NULL;
+  char * reply = NULL;
+  unsigned long long len = 0;
+  unsigned long long reply_len = 0;
+  struct iovec iov;
+  int fd = -1;
+
+  // the listening socket does not block
+  while((fd = accept(lfd, NULL, NULL)) < 0) {
+    usleep(100);
+  }
+  t = vca_com_tcp_wrap(fd, &vca_com_tcp_defaults);
+
+  while(t && vca_com_tcp_recv(t, &msg, &len, 1) == 0) {
+    if(respond(msg, len, &reply, &reply_len))
+      break;
+    if(reply) {
+      iov.iov_base = reply;
+      iov.iov_len = reply_len;
+      if(vca_com_tcp_sendv(t, &iov, 1))
+	break;
+    }
+  }
+
+  vca_com_tcp_free(t);
+  close(lfd);
+  return NULL;
+}
+
+// ZMQ_STREAM hands out what one read of the socket returned, so the messages are put back together
+static void * zmq_responder(void * socket) {
+  char id[VCA_COM_ZMQ_ID_SIZE];
+  int id_size = 0;
+  unsigned long long size = cfg.size + sizeof(vca_com_msg_hdr) + VCA_COM_MAX_BATCH_BYTES;
+  char * buf = malloc(size);
+  unsigned long long used = 0;
+  unsigned long long off = 0;
+  unsigned long long len = 0;
+  unsigned long long reply_len = 0;
+  char * reply = NULL;
+  int frames = 0;
+  int rc = 0;
+
+  while(buf) {
+    id_size = zmq_recv(socket, id, sizeof(id), 0);
+    if(id_size < 0)
+      break;
+    rc = zmq_recv(socket, buf + used, size - used, 0);
+    if(rc < 0 || rc > size - used)
+      break;
+    // the empty frames tell of connect and disconnect
+    if(rc == 0 && ++frames == 2)
+      break;
+    used += rc;
+
+    for(off = 0; used - off >= sizeof(vca_com_msg_hdr); off += len) {
+      len = sizeof(vca_com_msg_hdr) + vca_com_msg_get_hdr(buf + off)->length;
+      if(len > used - off)
+	break;
+      if(respond(buf + off, len, &reply, &reply_len))
+	goto out;
+      if(reply && (zmq_send(socket, id, id_size, ZMQ_SNDMORE) < 0
+		   || zmq_send(socket, reply, reply_len, ZMQ_SNDMORE) < 0))
+	goto out;
+    }
+    memmove(buf, buf + off, used - off);
+    used -= off;
+  }
+
+ out:
+  free(buf);
+  zmq_close(socket);
+  return NULL;
+}
+
+static int start_responder(int transport, pthread_t * thread) {
+  static void * zmq_ctx = NULL;
+  static int lfd = -1;
+  char endpoint[64];
+  void * socket = NULL;
+
+  if(transport == VCA_COM_TCP_SOCKET) {
+    lfd = vca_com_tcp_listen(port_of(transport));
+    if(lfd < 0)
+      return -1;
+    return pthread_create(thread, NULL, tcp_responder, &lfd);
+  }
+
+  if(!zmq_ctx)
+    zmq_ctx = zmq_ctx_new();
+  socket = zmq_socket(zmq_ctx, ZMQ_STREAM);
+  snprintf(endpoint, sizeof(endpoint), "tcp://127.0.0.1:%s", port_of(transport));
+  if(!socket || zmq_bind(socket, endpoint)) {
+    perror("zmq bind failed");
+    return -1;
+  }
+  return pthread_create(thread, NULL, zmq_responder, socket);
+}
+
+static int ping(vca_com_t * com, vca_com_addr * dst, char * payload, char * echo) {
+  vca_com_addr src;
+  unsigned long long len = cfg.size;
+  unsigned int c = 0;
+
+  payload[0] = OP_PING;
+  if(vca_com_send_msg(com, dst, payload, cfg.size, 0))
+    return -1;
+  if(vca_com_recv_msg(com, &src, echo, &len, &c) || len != cfg.size) {
+    fprintf(stderr, "ping came back with %llu bytes instead of %llu\n", len, cfg.size);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int run(int transport) {
+  vca_com_t com;
+  vca_com_addr self;
+  vca_com_addr dst;
+  vca_com_addr src;
+  pthread_t thread;
+  char * payload = calloc(1, cfg.size);
+  char * echo = malloc(cfg.size);
+  unsigned long long * rtt = malloc(cfg.pings * sizeof(unsigned long long));
+  unsigned long long start = 0;
+  unsigned long long rate_ns = 0;
+  unsigned long long len = 0;
+  unsigned long i = 0;
+  unsigned int c = 0;
+  int rc = -1;
+
+  if(!payload || !echo || !rtt || start_responder(transport, &thread))
+    goto out;
+
+  vca_com_init_addr_from_string(&self, "0.0.0.0", "0", "127.0.0.1", "1", "0");
+  vca_com_init_addr_from_string(&dst, "0.0.0.0", "0", "127.0.0.1", "2", "0");
+  if(init_vca_com(&com, "127.0.0.1", port_of(transport), &self, transport)) {
+    fprintf(stderr, "failed to connect\n");
+    goto out;
+  }
+
+  for(i = 0; i < WARMUP_PINGS; i++) {
+    if(ping(&com, &dst, payload, echo))
+      goto deinit;
+  }
+
+  // rate: back to back, the acknowledgement of the end marker waits for all of them
+  start = now_ns();
+  payload[0] = OP_DATA;
+  for(i = 0; i < cfg.msgs; i++) {
+    if(vca_com_send_msg(&com, &dst, payload, cfg.size, 0))
+      goto deinit;
+  }
+  payload[0] = OP_END;
+  len = cfg.size;
+  if(vca_com_send_msg(&com, &dst, payload, 1, 0) || vca_com_recv_msg(&com, &src, echo, &len, &c))
+    goto deinit;
+  rate_ns = now_ns() - start;
+
+  for(i = 0; i < cfg.pings; i++) {
+    start = now_ns();
+    if(ping(&com, &dst, payload, echo))
+      goto deinit;
+    rtt[i] = now_ns() - start;
+  }
+  qsort(rtt, cfg.pings, sizeof(unsigned long long), cmp_ull);
+
+  printf("%s,%llu,%.0f,%.1f,%.2f,%.2f,%.2f,%.2f\n", (transport == VCA_COM_TCP_SOCKET) ? "tcp" : "zmq",
+	 cfg.size, cfg.msgs * 1e9 / rate_ns, cfg.msgs * cfg.size * 1e3 / rate_ns,
+	 rtt[cfg.pings / 2] / 1e3, rtt[cfg.pings * 99 / 100] / 1e3,
+	 rtt[cfg.pings * 999 / 1000] / 1e3, rtt[cfg.pings - 1] / 1e3);
+  rc = 0;
+
+ deinit:
+  // the responder goes once the client hangs up
+  deinit_vca_com(&com);
+  pthread_join(thread, NULL);
+ out:
+  free(payload);
+  free(echo);
+  free(rtt);
+  return rc;
+}
+
+int main(int argc, char * argv[]) {
+  int opt = 0;
+  unsigned int i = 0;
+
+  while((opt = getopt(argc, argv, "m:s:n:r:p:Nu:z:")) != -1) {
+    switch(opt) {
+    case 'm':
+      cfg.num_transports = 1;
+      if(!strcmp(optarg, "tcp")) {
+	cfg.transports[0] = VCA_COM_TCP_SOCKET;
+      } else if(!strcmp(optarg, "zmq")) {
+	cfg.transports[0] = VCA_COM_ZMQ_SOCKET;
+      } else {
+	usage();
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 's':
+      cfg.size = strtoull(optarg, NULL, 10);
+      break;
+    case 'n':
+      cfg.msgs = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      cfg.pings = strtoul(optarg, NULL, 10);
+      break;
+    case 'p':
+      cfg.port = optarg;
+      break;
+    case 'N':
+      vca_com_tcp_defaults.nodelay = 0;
+      break;
+    case 'u':
+      vca_com_tcp_defaults.busy_poll_us = strtol(optarg, NULL, 10);
+      break;
+    case 'z':
+      vca_com_tcp_defaults.zerocopy_min = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if(cfg.size < 1 || cfg.size + sizeof(vca_com_msg_hdr) > VCA_COM_TCP_MAX_MSG || cfg.msgs < 1 || cfg.pings < 1) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  printf("transport,payload,msgs_per_s,MB_per_s,rtt_p50_us,rtt_p99_us,rtt_p999_us,rtt_max_us\n");
+  for(i = 0; i < cfg.num_transports; i++) {
+    if(run(cfg.transports[i])) {
+      fprintf(stderr, "%s run failed\n", (cfg.transports[i] == VCA_COM_TCP_SOCKET) ? "tcp" : "zmq");
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
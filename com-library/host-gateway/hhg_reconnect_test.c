@@ -0,0 +1,163 @@
+/*
+ * Copyright 2019 Intel(R) Corporation (http://www.intel.com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Drops the tcp connection of a host gateway worker to another host and checks that msgs to that
+// host get through again on a new connection: once after the worker saw the close on its poll,
+// once when only a send finds out. The other host is played by this test on a plain tcp socket.
+// Exits with 0 and prints OK on success.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <vca_com.h>
+#include <host-gateway.h>
+#include <host-gateway-connection-store.h>
+#include <host-gateway-msgs.h>
+
+#define MAX_TRIES 1000 // of 1ms each, for the worker to see a close or a send to fail
+
+vca_com_hng_t hng;
+vca_com_gw_worker * gw_workers = NULL;
+unsigned int gw_num_workers = 1;
+
+static vca_com_addr client; // sender of the msgs, a client of the gateway
+static vca_com_addr remote; // the other host
+static int remote_fd = -1; // listening socket of the other host
+static vca_com_tcps * remote_con = NULL; // the connection of the gateway to it
+
+// one round of the worker loop without the nodes
+static void worker_round(vca_com_gw_worker * w) {
+
+  (void) vca_com_hhg_accept_and_deliver(w);
+  (void) vca_com_gate_drain(w);
+  vca_com_gate_reclaim(w);
+  w->passes++;
+}
+
+// route msg i from the client to the other host through worker w
+static int deliver(vca_com_gw_worker * w, unsigned long long i) {
+
+  char msg[sizeof(vca_com_msg_hdr) + sizeof(i)];
+  vca_com_msg_hdr * hdr = (vca_com_msg_hdr *) msg;
+
+  memset(hdr, 0, sizeof(vca_com_msg_hdr));
+  vca_com_cpy_addr(&client, &hdr->src);
+  vca_com_cpy_addr(&remote, &hdr->dst);
+  hdr->length = sizeof(i);
+  hdr->type = VCA_COM_MSG_SEND;
+  memcpy(msg + sizeof(vca_com_msg_hdr), &i, sizeof(i));
+
+  return vca_com_gate_deliver_msg(w, msg, sizeof(msg), &w->hhg.self);
+}
+
+// the other host takes msg i, on the connection it has or a new one
+static int expect(unsigned long long i) {
+
+  unsigned long long len = 0;
+  char * msg = NULL;
+  int fd = -1;
+
+  if(!remote_con) {
+    fd = accept(remote_fd, NULL, NULL);
+    if(fd < 0 || !(remote_con = vca_com_tcp_wrap(fd, &vca_com_tcp_defaults))) {
+      perror("other host got no connection");
+      return -1;
+    }
+  }
+
+  if(vca_com_tcp_recv(remote_con, &msg, &len, 1)
+     || len != sizeof(vca_com_msg_hdr) + sizeof(i)
+     || memcmp(msg + sizeof(vca_com_msg_hdr), &i, sizeof(i))) {
+    fprintf(stderr, "other host did not get msg %llu\n", i);
+    return -1;
+  }
+
+  return 0;
+}
+
+// the other host goes away
+static void drop_remote(void) {
+
+  vca_com_tcp_free(remote_con);
+  remote_con = NULL;
+}
+
+static int connected(void) {
+
+  vca_com_t * com = NULL;
+
+  return vca_com_cons_table_find(connection_store, &remote, &com);
+}
+
+int main(int argc, char * argv[]) {
+
+  const char * port = argc > 1 ? argv[1] : "5560";
+  char self_port[16];
+  vca_com_gw_worker * w = NULL;
+  unsigned long long i = 0;
+  int tries = 0;
+
+  snprintf(self_port, sizeof(self_port), "%d", atoi(port) + 1);
+  vca_com_init_addr_from_string(&client, "127.0.0.1", "0", "127.0.0.1", self_port, "1");
+  vca_com_init_addr_from_string(&remote, "0.0.0.0", "0", "127.0.0.1", port, "0");
+
+  remote_fd = vca_com_tcp_listen(port);
+  if(remote_fd < 0)
+    return EXIT_FAILURE;
+
+  connection_store = vca_com_cons_table_init(0);
+  gw_workers = calloc(gw_num_workers, sizeof(vca_com_gw_worker));
+  w = &gw_workers[0];
+  w->hhg.transport = VCA_COM_TCP_SOCKET;
+  w->hhg.tcp_opts = vca_com_tcp_defaults;
+  if(vca_com_hhg_init(&w->hhg, "127.0.0.1", self_port, 0))
+    return EXIT_FAILURE;
+  w->inbox = calloc(gw_num_workers, sizeof(vca_com_gw_ring));
+
+  // first connection, then the worker polls the close
+  if(deliver(w, i) || expect(i))
+    return EXIT_FAILURE;
+  drop_remote();
+  for(tries = 0; connected() && tries < MAX_TRIES; tries++) {
+    worker_round(w);
+    usleep(1000);
+  }
+  i++;
+  if(deliver(w, i) || expect(i)) {
+    fprintf(stderr, "no new connection after the worker saw the close\n");
+    return EXIT_FAILURE;
+  }
+
+  // the worker does not poll, the first send after the close may still go into the socket
+  drop_remote();
+  for(tries = 0; tries < MAX_TRIES && !deliver(w, ++i); tries++)
+    usleep(1000);
+  i++;
+  if(tries == MAX_TRIES || connected() || deliver(w, i) || expect(i)) {
+    fprintf(stderr, "no new connection after a failed send\n");
+    return EXIT_FAILURE;
+  }
+
+  for(tries = 0; tries < 4; tries++)
+    worker_round(w);
+  printf("OK\n");
+
+  return EXIT_SUCCESS;
+}
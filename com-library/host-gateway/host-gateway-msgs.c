@@ -19,8 +19,11 @@
 #include <host-gateway-connection-store.h>
 #include <host-host-gateway.h>
 #include <host-gateway.h>
+#include <host-gateway-msgs.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 int vca_com_hng_dst_is_node_on_same_host(vca_com_addr * dst, vca_com_addr * src) {
 
@@ -46,7 +49,172 @@ int vca_com_gate_deliver_failure(vca_com_t * com, char * msg, unsigned long long
   return vca_com_send_hdrless_msg(com, msg, len, -1);
 }
 
-int vca_com_gate_deliver_msg(char * msg, unsigned long long len, vca_com_addr * self) {
+unsigned int vca_com_gate_shard(void * opq, unsigned int socket, unsigned int channel) {
+  // channels counted as many per socket as its receive queue has, the same for both directions
+  return (socket * ((task_queue_opaque *) opq)->rx_q_objs[socket]->channels + channel) % gw_num_workers;
+}
+
+unsigned int vca_com_gate_owner(vca_com_t * com) {
+  
+  unsigned int i = 0;
+
+  switch(com->type) {
+  case VCA_COM_MEM_SHARING_HOST:
+    // the channel libvcacom submits on
+    return vca_com_gate_shard(com->com, TASK_ID_SOCKET(VCA_COM_HOST_TASK_ID(com)),
+			      TASK_ID_CHANNEL(VCA_COM_HOST_TASK_ID(com)));
+  case VCA_COM_ZMQ_SOCKET:
+    for(i = 0; i < gw_num_workers; i++) {
+      if(((vca_com_zmqs*) com->com)->socket == gw_workers[i].hhg.zmq_socket) {
+	return i;
+      }
+    }
+    return 0;
+  case VCA_COM_TCP_SOCKET:
+    // polled by the worker that accepted or opened it
+    for(i = 0; i < gw_num_workers; i++) {
+      if(((vca_com_tcps*) com->com)->owner == &gw_workers[i].hhg) {
+	return i;
+      }
+    }
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+static int ring_push(vca_com_gw_ring * r, vca_com_gw_handoff * h) {
+  unsigned long tail = r->tail;
+
+  if(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == GW_HANDOFF_SLOTS) {
+    return -1;
+  }
+  r->slots[tail % GW_HANDOFF_SLOTS] = *h;
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static int ring_pop(vca_com_gw_ring * r, vca_com_gw_handoff * h) {
+  unsigned long head = r->head;
+
+  if(head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+  *h = r->slots[head % GW_HANDOFF_SLOTS];
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int vca_com_gate_send(vca_com_gw_worker * w, vca_com_t * com, char * msg,
+		      unsigned long long len) {
+
+  vca_com_gw_handoff h;
+  unsigned int owner = vca_com_gate_owner(com);
+
+  if(owner == w->index) {
+    return vca_com_send_hdrless_msg(com, msg, len, -1);
+  }
+
+  // msg is a receive buffer of w, so the owner gets its own copy
+  h.com = com;
+  h.len = len;
+  h.msg = malloc(len);
+  if(!h.msg) {
+    return -1;
+  }
+  memcpy(h.msg, msg, len);
+
+  // while the owner is behind, serve the own inbox so two workers never wait on each other
+  while(ring_push(&gw_workers[owner].inbox[w->index], &h)) {
+    vca_com_gate_drain(w);
+  }
+
+  return 0;
+}
+
+int vca_com_gate_drain(vca_com_gw_worker * w) {
+
+  vca_com_gw_handoff h;
+  unsigned int i = 0;
+  int n = 0;
+
+  for(i = 0; i < gw_num_workers; i++) {
+    while(!ring_pop(&w->inbox[i], &h)) {
+      if(vca_com_send_hdrless_msg(h.com, h.msg, h.len, -1)) {
+	vca_com_hhg_send_failed(w, h.com);
+	vca_com_gate_deliver_failure(h.com, h.msg, h.len);
+      }
+      free(h.msg);
+      n++;
+    }
+  }
+
+  return n;
+}
+
+static void gate_snapshot(vca_com_gw_retired * r) {
+  unsigned int i = 0;
+
+  for(i = 0; i < gw_num_workers; i++) {
+    r->passes[i] = __atomic_load_n(&gw_workers[i].passes, __ATOMIC_ACQUIRE);
+  }
+}
+
+// every worker got through rounds rounds since the phase of r began
+static int gate_passed(vca_com_gw_retired * r, unsigned long rounds) {
+  unsigned int i = 0;
+
+  for(i = 0; i < gw_num_workers; i++) {
+    if(__atomic_load_n(&gw_workers[i].passes, __ATOMIC_ACQUIRE) < r->passes[i] + rounds) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void vca_com_gate_retire(vca_com_gw_worker * w, vca_com_t * com) {
+
+  vca_com_gw_retired * r = NULL;
+
+  if(w->num_retired % 64 == 0) {
+    r = realloc(w->retired, (w->num_retired + 64) * sizeof(vca_com_gw_retired));
+    if(!r) {
+      COML_DBM("no room to retire a connection, leaving it");
+      return;
+    }
+    w->retired = r;
+  }
+
+  r = &w->retired[w->num_retired++];
+  r->com = com;
+  r->phase = 0;
+  gate_snapshot(r);
+}
+
+void vca_com_gate_reclaim(vca_com_gw_worker * w) {
+
+  vca_com_gw_retired * r = NULL;
+  unsigned int i = 0;
+
+  while(i < w->num_retired) {
+    r = &w->retired[i];
+
+    // phase 0 ends when nobody can still find com, phase 1 when the owner drained its inbox since
+    if(!gate_passed(r, r->phase + 1)) {
+      i++;
+    } else if(r->phase == 0) {
+      r->phase = 1;
+      gate_snapshot(r);
+      i++;
+    } else {
+      vca_com_hhg_free_com(r->com);
+      *r = w->retired[--w->num_retired];
+    }
+  }
+}
+
+int vca_com_gate_deliver_msg(vca_com_gw_worker * w, char * msg, unsigned long long len,
+			     vca_com_addr * self) {
 
   vca_com_msg_hdr * hdr = (vca_com_msg_hdr*) msg;
   vca_com_t * com = NULL;
@@ -58,7 +226,7 @@ int vca_com_gate_deliver_msg(char * msg, unsigned long long len, vca_com_addr *
   if(vca_com_cons_table_find(connection_store, &hdr->dst, &com)) {
     // destination connection found
     COML_DBM("found host in connection store, send hdrless msg");
-    if(!vca_com_send_hdrless_msg(com, msg, len, -1)) {
+    if(!vca_com_gate_send(w, com, msg, len)) {
       return 0;
     }    
   } else {
@@ -67,11 +235,11 @@ int vca_com_gate_deliver_msg(char * msg, unsigned long long len, vca_com_addr *
     if(!vca_com_hng_dst_is_node_on_same_host(&hdr->dst, self)) {
        COML_DBM("dst is not on same host");
       // try open new connection to remote card/host specified in dst
-      int rc = vca_com_hhg_create_com(&hhg, &hdr->dst, &com);
+      int rc = vca_com_hhg_create_com(&w->hhg, &hdr->dst, &com);
       if(rc == 0 && com) {
         COML_DBM("was able to create socket to dst, send hdrless msg");
 	// send msg to com
-	if(!vca_com_send_hdrless_msg(com, msg, len, -1)) {
+	if(!vca_com_gate_send(w, com, msg, len)) {
 	  return 0;
 	}
       }
@@ -82,8 +250,9 @@ int vca_com_gate_deliver_msg(char * msg, unsigned long long len, vca_com_addr *
   }
 
 
-  // delivery failed
-  if(com) {
+  // delivery failed, only the owner of com may answer through it
+  if(com && vca_com_gate_owner(com) == w->index) {
+    vca_com_hhg_send_failed(w, com);
     return vca_com_gate_deliver_failure(com, msg, len);
   } else {
     return -1;
@@ -28,10 +28,34 @@ extern "C" {
 
   int vca_com_hng_dst_is_node_on_same_host(vca_com_addr * dst, vca_com_addr * src);
 
-  int vca_com_gate_deliver_msg(char * msg, unsigned long long len, vca_com_addr * self);
+  struct vca_com_gw_worker;
+
+  // worker owning the (socket, channel) pair of the task system opq, it alone receives and sends on that ring
+  unsigned int vca_com_gate_shard(void * opq, unsigned int socket, unsigned int channel);
+
+  // worker allowed to send through com
+  unsigned int vca_com_gate_owner(vca_com_t * com);
+
+  int vca_com_gate_deliver_msg(struct vca_com_gw_worker * w, char * msg, unsigned long long len,
+			       vca_com_addr * self);
 
   int vca_com_gate_deliver_failure(vca_com_t * com, char * msg, unsigned long long len);
 
+  // sends msg through com when w owns it, otherwise hands a copy to the owner
+  int vca_com_gate_send(struct vca_com_gw_worker * w, vca_com_t * com, char * msg,
+			unsigned long long len);
+
+  // sends what other workers handed to w, returns the number of messages
+  int vca_com_gate_drain(struct vca_com_gw_worker * w);
+
+  // com was taken out of the connection store by w. Other workers may still hold it, found in
+  // the store before or waiting in an inbox, so vca_com_gate_reclaim frees it once they all got
+  // past the round they could have found it in and then through a whole round more
+  void vca_com_gate_retire(struct vca_com_gw_worker * w, vca_com_t * com);
+
+  // called by w after each round of its loop
+  void vca_com_gate_reclaim(struct vca_com_gw_worker * w);
+
 #ifdef __cplusplus
     }
 #endif
@@ -24,11 +24,21 @@
  * 
  * Program arguments:
  *  1)  n - # of VCA sockets in the system
+ *
+ * The data plane runs on -t worker threads. Each owns the (socket, channel)
+ * pairs vca_com_gate_shard assigns it and a zmq socket of its own, and hands
+ * messages for connections of other workers over through their inbox.
+ * With -b messages to other hosts and clients go out in batches of up to
+ * that many bytes, each held back at most -l microseconds.
+ *
+ * -T tcp replaces the ZMQ_STREAM socket of every worker by plain tcp
+ * sockets on an epoll set, the wire format stays the same.
  */
 
 #include <stdio.h>  
 #include <unistd.h>  
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include <vca_com.h>
@@ -36,9 +46,11 @@
 #include <host-node-gateway.h>
 #include <host-gateway.h>
 #include <host-gateway-connection-store.h>
+#include <host-gateway-msgs.h>
 
 vca_com_hng_t hng;
-vca_com_hhg_t hhg;
+vca_com_gw_worker * gw_workers = NULL;
+unsigned int gw_num_workers = 1;
 
 static void usage() {
   COML_DBM("./host-gateway -v <num> -i <ip> -np <port> -hp <port>");
@@ -46,6 +58,43 @@ static void usage() {
   COML_DBM(" -i - ip of this host gateway");
   COML_DBM(" -np - port of this host gateway accepting new node connections");
   COML_DBM(" -hp - port of this host gateway accepting new host connections");
+  COML_DBM(" -t - number of worker threads routing messages (default 1)");
+  COML_DBM(" -c - pin worker n to the n-th cpu next to the vca cards");
+  COML_DBM(" -b - batch msgs to other hosts into frames of up to this many bytes (default 0, off)");
+  COML_DBM(" -l - longest time in usec a msg waits in a batch (default 100)");
+  COML_DBM(" -T - transport to other hosts and clients, zmq or tcp (default zmq)");
+  COML_DBM(" -N - tcp: leave Nagle's algorithm on (no TCP_NODELAY)");
+  COML_DBM(" -u - tcp: SO_BUSY_POLL in usec");
+  COML_DBM(" -z - tcp: MSG_ZEROCOPY for msgs of at least this many bytes (default 0, off)");
+}
+
+static void * gateway_worker(vca_com_gw_worker * w) {
+
+  if(w->cpu >= 0 && vca_pin_thread(0, w->cpu + w->index)) {
+    COML_DBM("Failed to pin worker %u", w->index);
+  }
+
+  // cycle through the vca cards and incomming sockets of the shard for msgs to be routed
+  do {
+    
+    if(vca_com_hng_spin_and_deliver(&hng, w)) {
+      //COML_DBM("Failed to spin over vca queue");
+    }
+    
+    if(vca_com_hhg_accept_and_deliver(w)) {
+      //COML_DBM("Failed to spint over zmq socket");
+    }
+
+    (void) vca_com_gate_drain(w);
+
+    (void) vca_com_hhg_flush(&w->hhg);
+
+    vca_com_gate_reclaim(w);
+    __atomic_store_n(&w->passes, w->passes + 1, __ATOMIC_RELEASE);
+    
+  } while(1);
+
+  return NULL;
 }
 
 int main(int argc, char * argv[]) {
@@ -58,8 +107,14 @@ int main(int argc, char * argv[]) {
   const char * node_port = NULL;
   const char * host_port = NULL;
   const char ** port = &node_port;
+  int cpu = -1;
+  unsigned long long batch_bytes = 0;
+  unsigned long long batch_delay_us = 100;
+  vca_com_type transport = VCA_COM_ZMQ_SOCKET;
+  vca_com_tcp_opts tcp_opts = vca_com_tcp_defaults;
+  unsigned int i = 0;
 
-  while((opt = getopt(argc, argv, "i:p:v:nh")) != -1) {
+  while((opt = getopt(argc, argv, "i:p:v:nht:c:b:l:T:Nu:z:")) != -1) {
     switch (opt) {
     case 'v':
       num_vcacards = strtoul(optarg, NULL, 10);
@@ -73,6 +128,36 @@ int main(int argc, char * argv[]) {
     case 'h':
       port = &host_port;
       break;
+    case 't':
+      gw_num_workers = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      cpu = strtol(optarg, NULL, 10);
+      break;
+    case 'b':
+      batch_bytes = strtoull(optarg, NULL, 10);
+      break;
+    case 'l':
+      batch_delay_us = strtoull(optarg, NULL, 10);
+      break;
+    case 'T':
+      if(!strcmp(optarg, "tcp")) {
+	transport = VCA_COM_TCP_SOCKET;
+      } else if(strcmp(optarg, "zmq")) {
+	COML_DBM("Unknown transport %s", optarg);
+	usage();
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'N':
+      tcp_opts.nodelay = 0;
+      break;
+    case 'u':
+      tcp_opts.busy_poll_us = strtol(optarg, NULL, 10);
+      break;
+    case 'z':
+      tcp_opts.zerocopy_min = strtoull(optarg, NULL, 10);
+      break;
     case '?':
       COML_DBM("argument %c requires a parameter", opt);
       usage();
@@ -90,7 +175,9 @@ int main(int argc, char * argv[]) {
     }
   }
 
-  if(!(num_vcacards > 0) || !ip || !node_port || !host_port) {
+  if(!(num_vcacards > 0) || !ip || !node_port || !host_port
+     || gw_num_workers < 1 || gw_num_workers > GW_MAX_WORKERS
+     || batch_bytes > MAX_MSG_SIZE) {
     COML_DBM("Missing arguments");
     usage();
     exit(EXIT_FAILURE);
@@ -98,24 +185,30 @@ int main(int argc, char * argv[]) {
 
   assert(!vca_com_hng_init(&hng, num_vcacards * 3, ip, node_port));
   (void) vca_com_hng_set_global_host_port(&hng, host_port);
-  assert(!vca_com_hhg_init(&hhg, ip, host_port));
   connection_store = vca_com_cons_table_init(0);
 
+  // worker 0 listens for other hosts, the others only connect out
+  gw_workers = calloc(gw_num_workers, sizeof(vca_com_gw_worker));
+  for(i = 0; i < gw_num_workers; i++) {
+    gw_workers[i].index = i;
+    gw_workers[i].cpu = cpu;
+    gw_workers[i].hhg.batch_bytes = batch_bytes;
+    gw_workers[i].hhg.batch_delay_us = batch_delay_us;
+    gw_workers[i].hhg.transport = transport;
+    gw_workers[i].hhg.tcp_opts = tcp_opts;
+    assert(!vca_com_hhg_init(&gw_workers[i].hhg, ip, host_port, i == 0));
+    assert(!posix_memalign((void **) &gw_workers[i].inbox, 64, gw_num_workers * sizeof(vca_com_gw_ring)));
+    memset(gw_workers[i].inbox, 0, gw_num_workers * sizeof(vca_com_gw_ring));
+  }
+
   // start new thread accepting vcacards
   pthread_create(&node_control, NULL, (void * (*) (void *)) vca_com_hng_accept_new_nodes, &hng);
 
-  // cycle through vca cards and incomming sockets for msgs to be routed
-  do {
-    
-    if(vca_com_hng_spin_and_deliver(&hng)) {
-      //COML_DBM("Failed to spin over vca queue");
-    }
-    
-    if(vca_com_hhg_accept_and_deliver(&hhg)) {
-      //COML_DBM("Failed to spint over zmq socket");
-    }
-    
-  } while(1);
+  for(i = 1; i < gw_num_workers; i++) {
+    pthread_create(&gw_workers[i].thread, NULL, (void * (*) (void *)) gateway_worker, &gw_workers[i]);
+  }
+  gw_workers[0].thread = pthread_self();
+  (void) gateway_worker(&gw_workers[0]);
 
   if(!pthread_join(node_control, &tret)) {
     COML_DBM("finished accepting node connections");
@@ -124,5 +217,7 @@ int main(int argc, char * argv[]) {
   }
 
   assert(!vca_com_hng_deinit(&hng));
-  assert(!vca_com_hhg_deinit(&hhg));
+  for(i = 0; i < gw_num_workers; i++) {
+    assert(!vca_com_hhg_deinit(&gw_workers[i].hhg));
+  }
 }
@@ -24,9 +24,55 @@ extern "C" {
 
   #include <host-node-gateway.h>
   #include <host-host-gateway.h>
+  #include <pthread.h>
+
+  #define GW_MAX_WORKERS 32
+  #define GW_HANDOFF_SLOTS 1024
+
+  // a message on its way to the worker owning the connection to its destination
+  typedef struct {
+    vca_com_t * com;
+    char * msg;
+    unsigned long long len;
+  } vca_com_gw_handoff;
+
+  // single producer single consumer ring from one worker to another
+  typedef struct {
+    unsigned long head __attribute__((aligned(64))); // next slot to take, written by the consumer
+    unsigned long tail __attribute__((aligned(64))); // next slot to fill, written by the producer
+    vca_com_gw_handoff slots[GW_HANDOFF_SLOTS];
+  } vca_com_gw_ring;
+
+  // a connection taken out of the connection store, see vca_com_gate_retire
+  typedef struct {
+    vca_com_t * com;
+    int phase;
+    unsigned long passes[GW_MAX_WORKERS]; // of every worker when the phase began
+  } vca_com_gw_retired;
+
+  // one thread of the data plane: receives on the (socket, channel) pairs of its shard
+  // and on its own zmq socket, sends only through connections it owns
+  typedef struct vca_com_gw_worker {
+    unsigned int index;
+    int cpu; // n-th cpu next to the cards to pin to, -1 to not pin
+    pthread_t thread;
+
+    vca_com_hhg_t hhg;
+    char * msg_buffer;
+
+    // inbox[i] holds the messages worker i handed to this one
+    vca_com_gw_ring * inbox;
+
+    // rounds of the worker loop done, and the connections it retired waiting for the others to
+    // get through enough of them
+    unsigned long passes;
+    vca_com_gw_retired * retired;
+    unsigned int num_retired;
+  } vca_com_gw_worker;
 
   extern vca_com_hng_t hng;
-  extern vca_com_hhg_t hhg;
+  extern vca_com_gw_worker * gw_workers;
+  extern unsigned int gw_num_workers;
 
 #ifdef __cplusplus
 }
@@ -18,6 +18,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
 #include <host-host-gateway.h>
 #include <host-gateway-connection-store.h>
@@ -28,15 +33,59 @@
 
 int vca_com_hhg_init(vca_com_hhg_t * hhg,
 		     const char * ip,
-		     const char * port) {
+		     const char * port,
+		     int listen) {
 
   char ipname[256];
   int rc = -1;
+  struct epoll_event ev;
+
+  (void) vca_com_init_addr_from_string(&hhg->self, "0.0.0.0", "0", ip, port, "0");
+  hhg->msg_buf = malloc(MAX_MSG_SIZE);
+  hhg->batched = calloc(HHG_MAX_CONCURRENT_CONNECTIONS, sizeof(vca_com_t*));
+  hhg->num_batched = 0;
+  hhg->partial = calloc(HHG_MAX_CONCURRENT_CONNECTIONS, sizeof(vca_com_hhg_partial));
+  hhg->num_partial = 0;
+  hhg->epfd = -1;
+  hhg->listen_fd = -1;
+
+  if(hhg->transport == VCA_COM_TCP_SOCKET) {
+    hhg->zmq_ctx = NULL;
+    hhg->zmq_socket = NULL;
+
+    hhg->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(hhg->epfd < 0) {
+      perror("epoll for hhg failed");
+      return -1;
+    }
+    if(!listen) {
+      return 0;
+    }
+
+    // the listening socket is the one without a connection in the event data
+    hhg->listen_fd = vca_com_tcp_listen(port);
+    if(hhg->listen_fd < 0) {
+      return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    rc = epoll_ctl(hhg->epfd, EPOLL_CTL_ADD, hhg->listen_fd, &ev);
+    if(rc == -1) {
+      perror("epoll add of listening socket failed");
+      return rc;
+    }
+
+    COML_DBM("Listening to tcp port %s", port);
+    return 0;
+  }
 
   hhg->zmq_ctx = zmq_ctx_new();
   hhg->zmq_socket = zmq_socket(hhg->zmq_ctx, ZMQ_STREAM); 
 
-  (void) vca_com_init_addr_from_string(&hhg->self, "0.0.0.0", "0", ip, port, "0");
+  if(!listen) {
+    return 0;
+  }
   
   if(strnlen(ip, 256) + strnlen(port, 256) + 8 < 255) {
     snprintf(ipname, 256, "tcp://*:%s", port);
@@ -49,8 +98,6 @@ int vca_com_hhg_init(vca_com_hhg_t * hhg,
 
   COML_DBM("Listening to %s", ipname);
 
-  hhg->msg_buf = malloc(MAX_MSG_SIZE);
-
   return rc;
 }
 
@@ -68,9 +115,71 @@ int vca_com_hhg_deinit(vca_com_hhg_t * hhg) {
   if(hhg->msg_buf)
     free(hhg->msg_buf);
 
+  if(hhg->listen_fd >= 0)
+    close(hhg->listen_fd);
+
+  if(hhg->epfd >= 0)
+    close(hhg->epfd);
+
+  if(hhg->batched) {
+    (void) vca_com_hhg_flush(hhg);
+    free(hhg->batched);
+  }
+
+  if(hhg->partial) {
+    while(hhg->num_partial > 0)
+      free(hhg->partial[--hhg->num_partial].buf);
+    free(hhg->partial);
+  }
+
   return 0;
 }
 
+// batch the msgs to com if hhg does, in place of old if given
+static void batch_com(vca_com_hhg_t * hhg, vca_com_t * old, vca_com_t * com) {
+
+  unsigned int i = 0;
+
+  if(!hhg->batched || hhg->batch_bytes == 0) {
+    return;
+  }
+
+  if(vca_com_set_batching(com, hhg->batch_bytes, hhg->batch_delay_us)) {
+    return;
+  }
+
+  for(i = 0; i < hhg->num_batched; i++) {
+    if(hhg->batched[i] == old) {
+      (void) vca_com_flush(old);
+      hhg->batched[i] = com;
+      return;
+    }
+  }
+
+  if(hhg->num_batched < HHG_MAX_CONCURRENT_CONNECTIONS) {
+    hhg->batched[hhg->num_batched++] = com;
+  } else {
+    // nobody would flush it
+    (void) vca_com_set_batching(com, 0, 0);
+  }
+}
+
+int vca_com_hhg_flush(vca_com_hhg_t * hhg) {
+
+  unsigned int i = 0;
+  int rc = 0;
+
+  if(!hhg)
+    return -1;
+
+  for(i = 0; i < hhg->num_batched; i++) {
+    if(vca_com_flush_due(hhg->batched[i]))
+      rc = -1;
+  }
+
+  return rc;
+}
+
 static void create_zmq_vca_com(vca_com_t ** com, uint8_t * id, 
 			       int id_size,
 			       vca_com_addr * self,
@@ -86,6 +195,8 @@ static void create_zmq_vca_com(vca_com_t ** com, uint8_t * id,
   (*com)->com = zmqs;
   vca_com_cpy_addr(self, &((*com)->self));
   (*com)->type = VCA_COM_ZMQ_SOCKET;
+  (*com)->view = NULL;
+  (*com)->batch = NULL;
   
   COML_DBM("created zmq socket for %hhu.%hhu.%hhu.%hhu:%hu", (*com)->self.host[0],
 	   (*com)->self.host[1], (*com)->self.host[2], (*com)->self.host[3], (*com)->self.host_port);
@@ -94,13 +205,14 @@ static void create_zmq_vca_com(vca_com_t ** com, uint8_t * id,
 }
 
 static void store_id_of_client(vca_com_hhg_t * hhg, 
+			       vca_com_msg_hdr * hdr,
 			       uint8_t * id,
 			       int id_size,
 			       void * socket) {
 
   vca_com_t * com = NULL;
+  vca_com_t * old = NULL;
   // first store the id, if not exists
-  vca_com_msg_hdr * hdr = (vca_com_msg_hdr *)hhg->msg_buf;
 
   COML_DBM("msg from %hhu.%hhu.%hhu.%hhu:%hu:%hu type %d", hdr->src.host[0],
 	hdr->src.host[1], hdr->src.host[2], hdr->src.host[3], hdr->src.host_port, hdr->src.socket,
@@ -109,6 +221,7 @@ static void store_id_of_client(vca_com_hhg_t * hhg,
   if(!vca_com_cons_table_find(connection_store, &hdr->src, &com)) {
     // create connection for socket to client
     create_zmq_vca_com(&com, (uint8_t *) id, id_size, &hdr->src, socket);
+    batch_com(hhg, NULL, com);
     
     // store new socket id in connection store
     vca_com_cons_table_insert(connection_store, &com->self, &com); 
@@ -118,7 +231,9 @@ static void store_id_of_client(vca_com_hhg_t * hhg,
       COML_DBM("found mismatching ID, will reinsert");
       vca_com_cons_table_erase(connection_store, &hdr->src);
       
+      old = com;
       create_zmq_vca_com(&com, (uint8_t *) id, id_size, &hdr->src, socket);
+      batch_com(hhg, old, com);
       
       vca_com_cons_table_insert(connection_store, &com->self, &com);
       // updated id for the same node
@@ -126,8 +241,141 @@ static void store_id_of_client(vca_com_hhg_t * hhg,
   }
 }
 
-int vca_com_hhg_accept_and_deliver(vca_com_hhg_t * hhg) {
+// msg put together for peer id so far, a new one if create is set; NULL if there is none or no room
+static vca_com_hhg_partial * zmq_partial(vca_com_hhg_t * hhg, uint8_t * id, int id_size, int create) {
+
+  vca_com_hhg_partial * p = NULL;
+  unsigned int i = 0;
+
+  if(!hhg->partial)
+    return NULL;
+
+  for(i = 0; i < hhg->num_partial; i++) {
+    p = &hhg->partial[i];
+    if(p->id_size == id_size && !memcmp(p->id, id, id_size))
+      return p;
+  }
+
+  if(!create || hhg->num_partial == HHG_MAX_CONCURRENT_CONNECTIONS)
+    return NULL;
+
+  p = &hhg->partial[hhg->num_partial++];
+  memset(p, 0, sizeof(vca_com_hhg_partial));
+  p->id_size = id_size > VCA_COM_ZMQ_ID_SIZE ? VCA_COM_ZMQ_ID_SIZE : id_size;
+  memcpy(p->id, id, p->id_size);
+  return p;
+}
+
+// forget what came of the msg of peer id, e.g. when its connection comes or goes
+static void zmq_partial_drop(vca_com_hhg_t * hhg, uint8_t * id, int id_size) {
+
+  vca_com_hhg_partial * p = zmq_partial(hhg, id, id_size, 0);
+
+  if(!p)
+    return;
+  free(p->buf);
+  *p = hhg->partial[--hhg->num_partial];
+}
+
+static int zmq_partial_append(vca_com_hhg_partial * p, uint8_t * data, unsigned long long size) {
+
+  uint8_t * buf = NULL;
+
+  if(p->size + size > p->capacity) {
+    buf = realloc(p->buf, p->size + size);
+    if(!buf)
+      return -1;
+    p->buf = buf;
+    p->capacity = p->size + size;
+  }
+  memcpy(p->buf + p->size, data, size);
+  p->size += size;
+  return 0;
+}
+
+static void zmq_deliver(vca_com_gw_worker * w, vca_com_msg_hdr * hdr, uint8_t * id, int id_size) {
+
+  // store ID of client for future responses
+  store_id_of_client(&w->hhg, hdr, id, id_size, w->hhg.zmq_socket);
+
+  // deliver msg if content exists
+  if(hdr->length > 0)
+    vca_com_gate_deliver_msg(w, (char *) hdr, sizeof(vca_com_msg_hdr) + hdr->length, &w->hhg.self);
+}
+
+// deliver the msgs in the frame of peer id; the msg cut off at the end is kept until its rest
+// comes in the next frames of the peer and completed from them first
+static void zmq_deliver_frame(vca_com_gw_worker * w, uint8_t * id, int id_size,
+			      uint8_t * frame, unsigned long long size) {
+
+  vca_com_hhg_t * hhg = &w->hhg;
+  vca_com_hhg_partial * p = zmq_partial(hhg, id, id_size, 0);
+  vca_com_msg_hdr * hdr = NULL;
+  unsigned long long off = 0;
+  unsigned long long take = 0;
+  unsigned long long len = 0;
+
+  if(p && p->size > 0) {
+    // first the rest of the hdr, then the rest of the msg it announces
+    if(p->size < sizeof(vca_com_msg_hdr)) {
+      take = sizeof(vca_com_msg_hdr) - p->size;
+      take = take < size ? take : size;
+      if(zmq_partial_append(p, frame, take)) {
+	zmq_partial_drop(hhg, id, id_size);
+	return;
+      }
+      off = take;
+      if(p->size < sizeof(vca_com_msg_hdr))
+	return;
+    }
+
+    hdr = vca_com_msg_get_hdr((char *) p->buf);
+    if(hdr->length > MAX_MSG_SIZE - sizeof(vca_com_msg_hdr)) {
+      COML_DBM("dropping msg of %llu bytes, lost track of the msgs of the peer", hdr->length);
+      zmq_partial_drop(hhg, id, id_size);
+      return;
+    }
+
+    // hdr moves with the buffer
+    len = sizeof(vca_com_msg_hdr) + hdr->length;
+    take = len - p->size;
+    take = take < size - off ? take : size - off;
+    if(zmq_partial_append(p, frame + off, take)) {
+      zmq_partial_drop(hhg, id, id_size);
+      return;
+    }
+    off += take;
+    if(p->size < len)
+      return;
+
+    zmq_deliver(w, vca_com_msg_get_hdr((char *) p->buf), id, id_size);
+    p->size = 0;
+  }
+
+  // a frame holds one msg or a batch of them, each behind its own hdr
+  for(; off < size; off += sizeof(vca_com_msg_hdr) + hdr->length) {
+    hdr = vca_com_msg_get_hdr((char *) frame + off);
+
+    if(size - off < sizeof(vca_com_msg_hdr) || hdr->length > size - off - sizeof(vca_com_msg_hdr)) {
+      if(size - off >= sizeof(vca_com_msg_hdr) && hdr->length > MAX_MSG_SIZE - sizeof(vca_com_msg_hdr)) {
+	COML_DBM("dropping msg of %llu bytes, lost track of the msgs of the peer", hdr->length);
+	return;
+      }
+      p = zmq_partial(hhg, id, id_size, 1);
+      if(!p || zmq_partial_append(p, frame + off, size - off)) {
+	COML_DBM("no room for the start of a msg, dropping it");
+	zmq_partial_drop(hhg, id, id_size);
+      }
+      return;
+    }
+
+    zmq_deliver(w, hdr, id, id_size);
+  }
+}
+
+static int zmq_accept_and_deliver(vca_com_gw_worker * w) {
   
+  vca_com_hhg_t * hhg = &w->hhg;
   int rc = 0;
   uint8_t id[VCA_COM_ZMQ_ID_SIZE];
   int id_size = 0;
@@ -142,39 +390,25 @@ int vca_com_hhg_accept_and_deliver(vca_com_hhg_t * hhg) {
     rc = zmq_recv(hhg->zmq_socket, id, VCA_COM_ZMQ_ID_SIZE, ZMQ_DONTWAIT);
 //    COML_DBM("recv id rc=%d", rc);
     if(rc > 0) { // recv an id
-      id_size = rc;
+      id_size = rc > VCA_COM_ZMQ_ID_SIZE ? VCA_COM_ZMQ_ID_SIZE : rc;
 
       COML_DBM("recv an id %s", id);
 
       rc = zmq_recv(hhg->zmq_socket, hhg->msg_buf, MAX_MSG_SIZE, ZMQ_DONTWAIT);
-      if(rc >= sizeof(vca_com_msg_hdr)) { // recv a msg with content
-        COML_DBM("recv a msg size %d", rc);
-    
-        // store ID of client for future responses
-        store_id_of_client(hhg, (uint8_t *) id, id_size, hhg->zmq_socket);
-	
-        // deliver msg (if content exists
-        if (rc > sizeof(vca_com_msg_hdr)) {
-          // handle empty and bulked up msgs
-          vca_com_msg_hdr * hdr = vca_com_msg_get_hdr((char *) hhg->msg_buf);
-          int hdrId = 0;
-          while((hdr + hdrId)->length == 0 && hdrId * sizeof(vca_com_msg_hdr) < rc) {
-            hdrId++;
-          }
-
-          if(rc > hdrId * sizeof(vca_com_msg_hdr)) // ensure that there is a msg to deliver
-            vca_com_gate_deliver_msg((char *) (hdr + hdrId), rc + 
-                                  hdrId * sizeof(vca_com_msg_hdr) , &hhg->self);
-        }
-
+      if(rc > MAX_MSG_SIZE) {
+        // the part cut off the frame is gone, and with it the bounds of the msgs that follow
+        COML_DBM("dropping frame of %d bytes", rc);
+        zmq_partial_drop(hhg, id, id_size);
+      } else if(rc > 0) { // recv content
+        COML_DBM("recv a frame size %d", rc);
+        zmq_deliver_frame(w, id, id_size, hhg->msg_buf, rc);
       } else {
         if(rc == -1) { // failure in recv
             perror("recv msg of zmq socket failed:");
         } else if (rc == 0) { // msg to indicate
           COML_DBM("new connection or connection close request");
+          zmq_partial_drop(hhg, id, id_size);
           // TODO handle extenral requests to close connection
-        } else {
-          COML_DBM("wrong message length (less than hdr and not defined as error)");
         }
       }
     } else {
@@ -189,6 +423,271 @@ int vca_com_hhg_accept_and_deliver(vca_com_hhg_t * hhg) {
   return 0;
 }
 
+// the tcp coms of the connection store, to find those of a connection that goes away;
+// tcp coms are put into and taken out of the store only under the lock
+static pthread_mutex_t tcp_coms_lock = PTHREAD_MUTEX_INITIALIZER;
+static vca_com_t ** tcp_coms = NULL;
+static unsigned int num_tcp_coms = 0;
+static unsigned int max_tcp_coms = 0;
+
+// drop a reference of tcps, the last one frees it
+static void tcp_put(vca_com_tcps * tcps) {
+
+  if(__atomic_sub_fetch(&tcps->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    vca_com_tcp_free(tcps);
+  }
+}
+
+static vca_com_t * create_tcp_vca_com(vca_com_addr * self, vca_com_tcps * tcps) {
+
+  vca_com_t * com = malloc(sizeof(vca_com_t));
+
+  __atomic_add_fetch(&tcps->refs, 1, __ATOMIC_RELAXED);
+  com->com = tcps;
+  vca_com_cpy_addr(self, &com->self);
+  com->type = VCA_COM_TCP_SOCKET;
+  com->view = NULL;
+  com->batch = NULL;
+
+  return com;
+}
+
+// put com into the connection store, with tcp_coms_lock held
+static void tcp_store_com(vca_com_t * com) {
+
+  vca_com_t ** coms = NULL;
+
+  if(!vca_com_cons_table_insert(connection_store, &com->self, &com))
+    return;
+
+  if(num_tcp_coms == max_tcp_coms) {
+    coms = realloc(tcp_coms, (max_tcp_coms + HHG_MAX_CONCURRENT_CONNECTIONS) * sizeof(vca_com_t *));
+    if(!coms) {
+      COML_DBM("no room to track a connection, it stays in the store after a close");
+      return;
+    }
+    tcp_coms = coms;
+    max_tcp_coms += HHG_MAX_CONCURRENT_CONNECTIONS;
+  }
+  tcp_coms[num_tcp_coms++] = com;
+}
+
+// take com out of the connection store, with tcp_coms_lock held
+static void tcp_erase_com(vca_com_gw_worker * w, vca_com_t * com) {
+
+  unsigned int i = 0;
+
+  vca_com_cons_table_erase(connection_store, &com->self);
+  for(i = 0; i < num_tcp_coms; i++) {
+    if(tcp_coms[i] == com) {
+      tcp_coms[i] = tcp_coms[--num_tcp_coms];
+      break;
+    }
+  }
+  vca_com_gate_retire(w, com);
+}
+
+// take the coms on tcps out of the connection store, the next msg to one of them connects anew
+static void tcp_forget(vca_com_gw_worker * w, vca_com_tcps * tcps) {
+
+  unsigned int i = 0;
+
+  pthread_mutex_lock(&tcp_coms_lock);
+  while(i < num_tcp_coms) {
+    if(tcp_coms[i]->com == tcps)
+      tcp_erase_com(w, tcp_coms[i]);
+    else
+      i++;
+  }
+  pthread_mutex_unlock(&tcp_coms_lock);
+}
+
+// poll tcps on the epoll set of hhg
+static int watch_tcp(vca_com_hhg_t * hhg, vca_com_tcps * tcps) {
+
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = tcps;
+  tcps->owner = hhg;
+  // the one of the connection, dropped when it closes
+  tcps->refs = 1;
+
+  return epoll_ctl(hhg->epfd, EPOLL_CTL_ADD, tcps->fd, &ev);
+}
+
+// the connection of a src is the one its last msg came on
+static void store_tcp_client(vca_com_gw_worker * w, vca_com_msg_hdr * hdr, vca_com_tcps * tcps) {
+
+  vca_com_t * com = NULL;
+
+  if(vca_com_cons_table_find(connection_store, &hdr->src, &com) && com->com == tcps)
+    return;
+
+  pthread_mutex_lock(&tcp_coms_lock);
+  if(vca_com_cons_table_find(connection_store, &hdr->src, &com)) {
+    if(com->com == tcps) {
+      pthread_mutex_unlock(&tcp_coms_lock);
+      return;
+    }
+    COML_DBM("src on a new connection, will reinsert");
+    tcp_erase_com(w, com);
+  }
+
+  tcp_store_com(create_tcp_vca_com(&hdr->src, tcps));
+  pthread_mutex_unlock(&tcp_coms_lock);
+}
+
+static void tcp_accept(vca_com_hhg_t * hhg) {
+
+  vca_com_tcps * tcps = NULL;
+  int fd = -1;
+
+  while((fd = accept(hhg->listen_fd, NULL, NULL)) >= 0) {
+    tcps = vca_com_tcp_wrap(fd, &hhg->tcp_opts);
+    if(!tcps || watch_tcp(hhg, tcps)) {
+      perror("failed to take new connection");
+      if(tcps)
+	vca_com_tcp_free(tcps);
+      else
+	close(fd);
+      continue;
+    }
+    COML_DBM("new tcp connection");
+  }
+
+  if(errno != EAGAIN && errno != EWOULDBLOCK) {
+    perror("accept failed");
+  }
+}
+
+// deliver the msgs received on tcps straight out of its receive buffer
+static void tcp_deliver(vca_com_gw_worker * w, vca_com_tcps * tcps) {
+
+  vca_com_hhg_t * hhg = &w->hhg;
+  vca_com_msg_hdr * hdr = NULL;
+  char * msg = NULL;
+  unsigned long long len = 0;
+  int burst = 0;
+  int rc = 0;
+
+  // epoll is level triggered, what is left comes next round
+  for(burst = 0; burst < HHG_TCP_BURST; burst++) {
+    rc = vca_com_tcp_recv(tcps, &msg, &len, 0);
+    if(rc != 0)
+      break;
+
+    hdr = vca_com_msg_get_hdr(msg);
+    store_tcp_client(w, hdr, tcps);
+
+    if(hdr->length > 0)
+      vca_com_gate_deliver_msg(w, msg, len, &hhg->self);
+  }
+
+  if(rc < 0) {
+    // the coms on tcps keep it until they are reclaimed, msgs to their dst go out on a new connection
+    COML_DBM("tcp connection closed");
+    tcp_forget(w, tcps);
+    (void) epoll_ctl(hhg->epfd, EPOLL_CTL_DEL, tcps->fd, NULL);
+    vca_com_tcp_close(tcps);
+    tcp_put(tcps);
+  }
+}
+
+static int tcp_accept_and_deliver(vca_com_gw_worker * w) {
+
+  vca_com_hhg_t * hhg = &w->hhg;
+  struct epoll_event ev[HHG_EPOLL_EVENTS];
+  int n = 0;
+  int i = 0;
+
+  n = epoll_wait(hhg->epfd, ev, HHG_EPOLL_EVENTS, 0);
+  if(n < 0 && errno != EINTR) {
+    perror("epoll wait failed");
+    return -1;
+  }
+
+  for(i = 0; i < n; i++) {
+    if(ev[i].data.ptr == NULL)
+      tcp_accept(hhg);
+    else
+      tcp_deliver(w, (vca_com_tcps *) ev[i].data.ptr);
+  }
+
+  return 0;
+}
+
+int vca_com_hhg_accept_and_deliver(struct vca_com_gw_worker * w) {
+
+  if(!w)
+    return -1;
+
+  switch(w->hhg.transport) {
+  case VCA_COM_TCP_SOCKET:
+    return tcp_accept_and_deliver(w);
+  default:
+    return zmq_accept_and_deliver(w);
+  }
+}
+
+static int tcp_create_com(vca_com_hhg_t * hhg,
+			  vca_com_addr * dest,
+			  vca_com_t ** com) {
+
+  char ip[16];
+  char port[8];
+  vca_com_tcps * tcps = NULL;
+
+  snprintf(ip, sizeof(ip), "%hhu.%hhu.%hhu.%hhu", dest->host[0],
+	   dest->host[1], dest->host[2], dest->host[3]);
+  snprintf(port, sizeof(port), "%hu", dest->host_port);
+
+  tcps = vca_com_tcp_connect(ip, port, &hhg->tcp_opts);
+  if(!tcps) {
+    return -1;
+  }
+
+  // answers come back on the same connection
+  if(watch_tcp(hhg, tcps)) {
+    perror("failed to poll new connection");
+    vca_com_tcp_free(tcps);
+    return -1;
+  }
+
+  *com = create_tcp_vca_com(dest, tcps);
+  pthread_mutex_lock(&tcp_coms_lock);
+  tcp_store_com(*com);
+  pthread_mutex_unlock(&tcp_coms_lock);
+
+  return 0;
+}
+
+void vca_com_hhg_free_com(vca_com_t * com) {
+
+  if(!com)
+    return;
+
+  if(com->type == VCA_COM_TCP_SOCKET)
+    tcp_put((vca_com_tcps *) com->com);
+
+  free(com);
+}
+
+void vca_com_hhg_send_failed(struct vca_com_gw_worker * w, vca_com_t * com) {
+
+  vca_com_tcps * tcps = NULL;
+
+  if(!w || !com || com->type != VCA_COM_TCP_SOCKET)
+    return;
+
+  // the owner sees the connection close on its next poll and lets go of it there
+  tcps = (vca_com_tcps *) com->com;
+  if(tcps->fd >= 0)
+    (void) shutdown(tcps->fd, SHUT_RDWR);
+  tcp_forget(w, tcps);
+}
+
 int vca_com_hhg_create_com(vca_com_hhg_t * hhg,
 			   vca_com_addr * dest,
 			   vca_com_t ** com) {
@@ -197,6 +696,10 @@ int vca_com_hhg_create_com(vca_com_hhg_t * hhg,
   char endpoint[256];
   size_t id_size = 0;
 
+  if(hhg && dest && com && hhg->transport == VCA_COM_TCP_SOCKET) {
+    return tcp_create_com(hhg, dest, com);
+  }
+
   if(!hhg || !dest || !*com) {
     return -1;
   }
@@ -217,7 +720,7 @@ int vca_com_hhg_create_com(vca_com_hhg_t * hhg,
     return -1;
 
   // push com into the connection store
-  store_id_of_client(hhg, (uint8_t *) endpoint, id_size, hhg->zmq_socket);
+  store_id_of_client(hhg, (vca_com_msg_hdr *) hhg->msg_buf, (uint8_t *) endpoint, id_size, hhg->zmq_socket);
   
   return 0;
 }
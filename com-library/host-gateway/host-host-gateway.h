@@ -26,6 +26,17 @@ extern "C" {
 #include <vca_com_ds.h>
 
 #define HHG_MAX_CONCURRENT_CONNECTIONS 1024
+#define HHG_EPOLL_EVENTS 64
+#define HHG_TCP_BURST 64 // msgs taken from one tcp connection per round
+
+  // start of a msg of a ZMQ_STREAM peer whose rest is still to come
+  typedef struct {
+    uint8_t id[VCA_COM_ZMQ_ID_SIZE];
+    int id_size;
+    uint8_t * buf;
+    unsigned long long size; // bytes of the msg so far
+    unsigned long long capacity;
+  } vca_com_hhg_partial;
 
   typedef struct {
     void * zmq_ctx;
@@ -34,21 +45,52 @@ extern "C" {
     uint8_t * msg_buf;
 
     vca_com_addr self;
+
+    // VCA_COM_ZMQ_SOCKET or VCA_COM_TCP_SOCKET, set beforehand like the batching
+    vca_com_type transport;
+    vca_com_tcp_opts tcp_opts;
+    int epfd;
+    int listen_fd;
+
+    // batching of the msgs sent to other hosts and clients, off if batch_bytes is 0
+    unsigned long long batch_bytes;
+    unsigned long long batch_delay_us;
+    vca_com_t ** batched;
+    unsigned int num_batched;
+
+    // ZMQ_STREAM frames are plain tcp reads, msgs cut by them are put together here per peer
+    vca_com_hhg_partial * partial;
+    unsigned int num_partial;
   } vca_com_hhg_t;
+
+  struct vca_com_gw_worker;
   
-  // starts accepting connections on ip/port from other hosts
-  // stores connections in hosts
+  // starts accepting connections on ip/port from other hosts if listen is set,
+  // otherwise the socket only connects out to them
+  // stores connections in hosts, batching as set in hhg beforehand
   int vca_com_hhg_init(vca_com_hhg_t * hhg,
 		       const char * ip,
-		       const char * port);
+		       const char * port,
+		       int listen);
 
   int vca_com_hhg_deinit(vca_com_hhg_t * hhg);
 
-  int vca_com_hhg_accept_and_deliver(vca_com_hhg_t * hhg);
+  // receives on the zmq socket of worker w and delivers
+  int vca_com_hhg_accept_and_deliver(struct vca_com_gw_worker * w);
+
+  // sends the batches of hhg that waited batch_delay_us
+  int vca_com_hhg_flush(vca_com_hhg_t * hhg);
 
   int vca_com_hhg_create_com(vca_com_hhg_t * hhg,
 			     vca_com_addr * dest,
 			     vca_com_t ** com);
+
+  // frees a com of the connection store nobody holds any longer
+  void vca_com_hhg_free_com(vca_com_t * com);
+
+  // a send of worker w, the owner of com, failed: a tcp com leaves the connection store
+  // together with the others on its connection, which is shut down
+  void vca_com_hhg_send_failed(struct vca_com_gw_worker * w, vca_com_t * com);
    
 
 #ifdef __cplusplus
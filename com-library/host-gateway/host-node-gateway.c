@@ -26,39 +26,120 @@
 #include <stdlib.h>
 #include <string.h>
 
-int vca_com_hng_spin_and_deliver(vca_com_hng_t * hng) {
+// read exactly length bytes of the task in s
+static int read_stream(task_stream * s, char * buffer, long length) {
+  long rc = 0;
+
+  while(length > 0) {
+    rc = recv_stream_read(s, buffer, length);
+    if(rc <= 0)
+      return -1;
+    buffer += rc;
+    length -= rc;
+  }
+
+  return 0;
+}
+
+// cut-through to another node of this host: the rest of the task goes from the ring of the
+// source socket into the ring of the destination, without staging it in the msg buffer
+static int forward_to_node(vca_com_gw_worker * w, task_stream * in, vca_com_msg_hdr * hdr,
+			   long task_len) {
+
+  vca_com_t * com = NULL;
+  task_stream out;
+
+  if(!vca_com_cons_table_find(connection_store, &hdr->dst, &com)
+     || com->type != VCA_COM_MEM_SHARING_HOST || vca_com_gate_owner(com) != w->index) {
+    return -1;
+  }
+
+  COML_DBM("forward msg to node %hu", hdr->dst.socket);
+
+  if(host_submit_stream_begin(com->com, &out, task_len, VCA_COM_HOST_TASK_ID(com)) < 0) {
+    return -1;
+  }
+  submit_stream_write(&out, hdr, sizeof(vca_com_msg_hdr));
+  stream_splice(&out, in, task_len - sizeof(vca_com_msg_hdr));
+  submit_stream_end(&out);
+
+  return 0;
+}
+
+// receive the next msg of socket on channel c, forward it or deliver it from the msg buffer
+static int recv_and_deliver(vca_com_hng_t * hng, vca_com_gw_worker * w, unsigned int socket, int c) {
 
-  unsigned int s = 0, c = 0;
   long task_len = 0;
+  task_stream in;
+  vca_com_msg_hdr * hdr = (vca_com_msg_hdr *) w->msg_buffer;
+
+  if(recv_stream_begin(hng->vca_task_opq, &in, &task_len, c, socket) != 0) {
+    return -1;
+  }
+
+  // received msg, look at the hdr before deciding where the rest goes
+  if(task_len < sizeof(vca_com_msg_hdr) || task_len > MAX_MSG_SIZE
+     || read_stream(&in, w->msg_buffer, sizeof(vca_com_msg_hdr))) {
+    COML_DBM("Dropping msg of length %ld", task_len);
+    recv_stream_end(&in);
+    return -1;
+  }
+
+  // set src to host ip
+  memcpy(hdr->src.host, hng->self.host, sizeof(char) * 4);
+  hdr->src.host_port = hng->self.host_port;
+
+  if(!forward_to_node(w, &in, hdr, task_len)) {
+    recv_stream_end(&in);
+    return 0;
+  }
+
+  // everything else is delivered from the msg buffer
+  if(read_stream(&in, w->msg_buffer + sizeof(vca_com_msg_hdr), task_len - sizeof(vca_com_msg_hdr))) {
+    recv_stream_end(&in);
+    return -1;
+  }
+  recv_stream_end(&in);
+
+  if(vca_com_gate_deliver_msg(w, w->msg_buffer, task_len, &hng->self)) {
+    COML_DBM("Failed to deliver msg or failure to either src or dst");
+    return -1;
+  }
+
+  return 0;
+}
+
+int vca_com_hng_spin_and_deliver(vca_com_hng_t * hng, vca_com_gw_worker * w) {
+
+  unsigned int s = 0;
+  int c = 0, next = 0;
+  queue_object * q = NULL;
   
   if(!hng || !hng->vca_task_opq) {
     //COML_DBM("com not initialzed");
     return -1;
   }
 
-  if(!hng->msg_buffer) {
-    hng->msg_buffer = malloc(MAX_MSG_SIZE);
+  if(!w->msg_buffer) {
+    w->msg_buffer = malloc(MAX_MSG_SIZE);
   }
 
   pthread_rwlock_rdlock(&hng->lock);
 
   for(s = 0; s < hng->num_active; s++) {
-    for(c = 0; c < MAX_CHANNELS; c++) {
-      
-      if(common_recv_task(hng->vca_task_opq, &task_len, (void*) hng->msg_buffer, c, hng->active_sockets[s])
-	 == 0) {
-	// received msg
+    q = ((task_queue_opaque *) hng->vca_task_opq)->rx_q_objs[hng->active_sockets[s]];
 
-	// set src to host ip
-	vca_com_msg_hdr * hdr = (vca_com_msg_hdr *) hng->msg_buffer;
-  memcpy(hdr->src.host, hng->self.host, sizeof(char) * 4);
-	hdr->src.host_port = hng->self.host_port;
-	
-	if(vca_com_gate_deliver_msg(hng->msg_buffer, task_len, &hng->self)) {
-	  COML_DBM("Failed to deliver msg or failure to either src or dst");
-	}
+    // only visit the channels flagged ready, each at most once per sweep
+    c = queue_poll_ready(q, 0);
+    while(c >= 0) {
+      
+      // channels of other shards are left to their worker
+      if(vca_com_gate_shard(hng->vca_task_opq, hng->active_sockets[s], c) == w->index) {
+	(void) recv_and_deliver(hng, w, hng->active_sockets[s], c);
       }
-      // continue with next channel
+      // continue with next ready channel, without wrapping around
+      next = queue_poll_ready(q, c + 1);
+      c = (next > c) ? next : -1;
     }
     // continue with next socket
   }
@@ -94,6 +175,8 @@ int vca_com_hng_accept_new_nodes(vca_com_hng_t * hng) {
     com->self = addr;
     com->com = (hng->vca_task_opq);
     com->type = VCA_COM_MEM_SHARING_HOST;
+    com->view = NULL;
+    com->batch = NULL;
     
     vca_com_cons_table_insert(connection_store, &addr, &com);
 
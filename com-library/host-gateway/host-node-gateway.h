@@ -45,13 +45,13 @@ extern "C" {
     // protects active_sockets and num_active
     pthread_rwlock_t lock;
 
-    char * msg_buffer;
-
   } vca_com_hng_t;
 
-  // spins on the spins on dequeue of all known sockets
+  struct vca_com_gw_worker;
+
+  // spins on the spins on dequeue of all known sockets, on the channels of the shard of w,
   // and delivers messages to other sockets or TCP deliver queue
-  int vca_com_hng_spin_and_deliver(vca_com_hng_t * hng);  
+  int vca_com_hng_spin_and_deliver(vca_com_hng_t * hng, struct vca_com_gw_worker * w);
   
   // accepts new connections via libzmq control planer interface
   int vca_com_hng_accept_new_nodes(vca_com_hng_t * hng);
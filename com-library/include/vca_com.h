@@ -27,6 +27,12 @@ extern "C" {
 
 #define VCA_COM_MAX_CHANNELS MAX_CHANNELS
 
+// largest batch of messages in one zmq frame, what the host gateway receives at once
+#define VCA_COM_MAX_BATCH_BYTES (1024*1024)
+
+// task id the host side of a memory sharing com submits with: channel 0 of the socket of the node
+#define VCA_COM_HOST_TASK_ID(com) TASK_ID((com)->self.socket, 0)
+
   // initialize communication to host specified by ip and port
   // Communcation over MAX_CHANNELS channels in parallel
   // returns 0 on success
@@ -68,6 +74,64 @@ extern "C" {
 		       unsigned long long * length,
 		       unsigned int * c);
 
+  // same as vca_com_recv_msg without copying the message out: msg is set to the message
+  // inside a buffer of com, valid until the next receive, vca_com_release_view or deinit_vca_com
+  // returns -1 on failure, 0 otherwise
+  int vca_com_recv_msg_view(vca_com_t * com,
+			    vca_com_addr * src,
+			    char ** msg,
+			    unsigned long long * length,
+			    unsigned int * c);
+
+  // done with the message of the last vca_com_recv_msg_view
+  void vca_com_release_view(vca_com_t * com);
+
+  // put the messages sent on a zmq com together into frames of up to max_bytes; a frame goes
+  // out once full, when its first message waited max_delay_us, or before com receives.
+  // max_bytes 0 sends each message on its own again. returns 0 on success
+  int vca_com_set_batching(vca_com_t * com,
+			   unsigned long long max_bytes,
+			   unsigned long long max_delay_us);
+
+  // send the messages batched on com now
+  int vca_com_flush(vca_com_t * com);
+
+  // send the messages batched on com if the first one waited long enough
+  int vca_com_flush_due(vca_com_t * com);
+
+  // native tcp transport of VCA_COM_TCP_SOCKET coms, also used by the host gateway.
+  // on the stream each message is its vca_com_msg_hdr followed by hdr.length bytes
+
+#define VCA_COM_TCP_MAX_MSG (1024*1024) // largest message with its hdr, as the host gateway takes
+#define VCA_COM_TCP_MAX_IOV 8
+
+  // options init_vca_com applies to its tcp connections
+  extern vca_com_tcp_opts vca_com_tcp_defaults;
+
+  // connect to ip/port, returns NULL on failure
+  vca_com_tcps * vca_com_tcp_connect(const char * ip,
+				     const char * port,
+				     const vca_com_tcp_opts * opts);
+
+  // take over the connected socket fd, e.g. one accepted on vca_com_tcp_listen
+  vca_com_tcps * vca_com_tcp_wrap(int fd, const vca_com_tcp_opts * opts);
+
+  // non-blocking socket listening on port, returns -1 on failure
+  int vca_com_tcp_listen(const char * port);
+
+  // close the socket of t, t stays for those still holding it until vca_com_tcp_free
+  void vca_com_tcp_close(vca_com_tcps * t);
+
+  void vca_com_tcp_free(vca_com_tcps * t);
+
+  // send the iovcnt buffers of iov as one piece, they may be reused on return
+  // returns 0 on success
+  int vca_com_tcp_sendv(vca_com_tcps * t, const struct iovec * iov, int iovcnt);
+
+  // next message of t with its hdr, valid until the next call; unless wait is set
+  // returns 1 if no message is complete yet. returns 0 on success
+  int vca_com_tcp_recv(vca_com_tcps * t, char ** msg, unsigned long long * length, int wait);
+
 #ifdef COML_DBG
 #define COML_DBM(...)                         \
   do {                                        \
@@ -58,7 +58,8 @@ extern "C" {
   typedef enum vca_com_type {
     VCA_COM_MEM_SHARING = 0,
     VCA_COM_MEM_SHARING_HOST = 1,
-    VCA_COM_ZMQ_SOCKET = 2
+    VCA_COM_ZMQ_SOCKET = 2,
+    VCA_COM_TCP_SOCKET = 3
   } vca_com_type;
 
   // vca com structure
@@ -72,6 +73,12 @@ extern "C" {
     // type of connection 
     vca_com_type type;
 
+    // state of vca_com_recv_msg_view, NULL until its first call
+    void * view;
+
+    // state of batched sends on zmq, NULL while not batching
+    void * batch;
+
   } vca_com_t;
 
   #define VCA_COM_ZMQ_ID_SIZE 256
@@ -85,6 +92,33 @@ extern "C" {
 
     size_t id_size;
   } vca_com_zmqs;
+
+  // socket options of the native tcp transport
+  typedef struct {
+    int nodelay; // TCP_NODELAY
+    int busy_poll_us; // SO_BUSY_POLL, 0 keeps the system default
+    unsigned long long zerocopy_min; // MSG_ZEROCOPY for sends of at least this many bytes, 0 never
+  } vca_com_tcp_opts;
+
+  typedef struct {
+    //socket, -1 once closed
+    int fd;
+
+    // MSG_ZEROCOPY from this many bytes on, 0 after the kernel copied anyway
+    unsigned long long zerocopy_min;
+
+    // received bytes, the next message starts at start
+    char * buf;
+    unsigned long long size;
+    unsigned long long start;
+    unsigned long long end;
+
+    // whoever polls the socket, e.g. a host gateway
+    void * owner;
+
+    // held by the connection and whatever shares it, e.g. the coms of a host gateway on it
+    unsigned int refs;
+  } vca_com_tcps;
   
   // sets fields in naddr to the specified values and performs simple checks on the inputs
   int vca_com_init_addr(vca_com_addr * addr,
@@ -18,7 +18,7 @@
  * Implementation of the vca communication library interface
  * for both applications running on vca cards and non-vca hosts.
  * Clients are either connected via memory sharing (for vca nodes)
- * or libzmq sockets to the host gateway. The host gateway routes
+ * or libzmq or plain tcp sockets (vca_com_tcp.c) to the host gateway. The host gateway routes
  * all incomming messages to the respective vca cards directly via 
  * memory sharing, if the host is the same, or libzmq sockets.
  *
@@ -31,11 +31,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <vca_com.h>
 #include <zmq.h>
 
 void * vca_com_zmq_ctx = NULL;
 
+// receive state of com: the zmq frame the last message came from, which may hold more,
+// or for memory sharing a buffer kept for all messages of vca_com_recv_msg_view
+typedef struct {
+  zmq_msg_t msg;
+  int has_msg;
+  unsigned long long next; // offset of the next message in msg
+  char * buf;
+  unsigned long long size;
+} vca_com_view;
+
+// messages to the peer of a zmq com put together into one frame, see vca_com_set_batching
+typedef struct {
+  char * buf;
+  unsigned long long used;
+  unsigned long long max_bytes;
+  unsigned long long max_delay_ns;
+  unsigned long long since; // when the first message of buf came
+} vca_com_batch;
+
 static void* init_zmq_socket_to_host(const char * host_ip,
 			    const char * host_port) {
   // setup zmq socket and store it in com->com
@@ -130,6 +150,8 @@ int init_vca_com(vca_com_t * com,
   // initialize com data structure
   com->com = NULL;
   com->type = type;
+  com->view = NULL;
+  com->batch = NULL;
   vca_com_cpy_addr(self, &com->self);
 
   // connect to host via memsharing library
@@ -149,6 +171,16 @@ int init_vca_com(vca_com_t * com,
       vca_com_send_msg(com, &dst, NULL, 0, 0);
       break;
     }
+  case VCA_COM_TCP_SOCKET:
+    {
+      vca_com_addr dst;
+      memset(&dst, 0, sizeof(vca_com_addr));
+      com->com = vca_com_tcp_connect(host_ip, host_port, &vca_com_tcp_defaults);
+      // the gateway learns who is behind the socket from the initial msg
+      if(com->com)
+	vca_com_send_msg(com, &dst, NULL, 0, 0);
+      break;
+    }
   default:
     return -1;
   }
@@ -176,6 +208,13 @@ int init_vca_com_repeat(vca_com_t * com,
   return 0;
 }
 
+static void view_drop(vca_com_view * v) {
+  if(v->has_msg) {
+    zmq_msg_close(&v->msg);
+    v->has_msg = 0;
+  }
+}
+
 // disconnect from host and free memory of com
 int deinit_vca_com(vca_com_t * com) {
   
@@ -183,6 +222,20 @@ int deinit_vca_com(vca_com_t * com) {
     return -1;
   }
 
+  if(com->batch) {
+    (void) vca_com_flush(com);
+    free(((vca_com_batch*) com->batch)->buf);
+    free(com->batch);
+    com->batch = NULL;
+  }
+
+  if(com->view) {
+    view_drop((vca_com_view*) com->view);
+    free(((vca_com_view*) com->view)->buf);
+    free(com->view);
+    com->view = NULL;
+  }
+
   switch (com->type) {
   case VCA_COM_MEM_SHARING:
   case VCA_COM_MEM_SHARING_HOST:
@@ -191,6 +244,9 @@ int deinit_vca_com(vca_com_t * com) {
   case VCA_COM_ZMQ_SOCKET: 
     deinit_zmq_socket_to_host(com->com);
     break;
+  case VCA_COM_TCP_SOCKET:
+    vca_com_tcp_free((vca_com_tcps*) com->com);
+    break;
   default:
     return -1;
   }
@@ -198,6 +254,161 @@ int deinit_vca_com(vca_com_t * com) {
   return 0;
 }
 
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// send frame to the peer of zmqs, a stream socket writes it out as it is
+static int zmq_send_frame(vca_com_zmqs * zmqs, zmq_msg_t * frame) {
+  int rc = 0;
+
+  rc = zmq_send(zmqs->socket, zmqs->id, zmqs->id_size, ZMQ_SNDMORE);
+  if(rc < (int) zmqs->id_size) {
+    perror("failed to send id for msg");
+    zmq_msg_close(frame);
+    return -1;
+  }
+  rc = zmq_msg_send(frame, zmqs->socket, ZMQ_SNDMORE);
+  if(rc < 0) {
+    perror("failed to send msg");
+    zmq_msg_close(frame);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void free_batch(void * data, void * hint) {
+  free(data);
+}
+
+int vca_com_flush(vca_com_t * com) {
+
+  vca_com_batch * b = NULL;
+  zmq_msg_t frame;
+
+  if(!com) {
+    return -1;
+  }
+
+  b = (vca_com_batch*) com->batch;
+  if(!b || b->used == 0) {
+    return 0;
+  }
+
+  // zmq takes over the buffer, the next batch starts in a new one
+  if(zmq_msg_init_data(&frame, b->buf, b->used, free_batch, NULL) != 0) {
+    perror("failed to hand batch to zmq");
+    return -1;
+  }
+  b->buf = NULL;
+  b->used = 0;
+
+  return zmq_send_frame((vca_com_zmqs*) com->com, &frame);
+}
+
+int vca_com_flush_due(vca_com_t * com) {
+
+  vca_com_batch * b = com ? (vca_com_batch*) com->batch : NULL;
+
+  if(b && b->used > 0 && now_ns() - b->since >= b->max_delay_ns) {
+    return vca_com_flush(com);
+  }
+
+  return 0;
+}
+
+int vca_com_set_batching(vca_com_t * com,
+			 unsigned long long max_bytes,
+			 unsigned long long max_delay_us) {
+
+  vca_com_batch * b = NULL;
+
+  if(!com || com->type != VCA_COM_ZMQ_SOCKET) {
+    return -1;
+  }
+
+  // what was batched so far goes out under the old limits
+  if(vca_com_flush(com)) {
+    return -1;
+  }
+
+  if(max_bytes == 0) {
+    if(com->batch) {
+      free(((vca_com_batch*) com->batch)->buf);
+      free(com->batch);
+      com->batch = NULL;
+    }
+    return 0;
+  }
+
+  if(!com->batch) {
+    com->batch = calloc(1, sizeof(vca_com_batch));
+    if(!com->batch)
+      return -1;
+  }
+  b = (vca_com_batch*) com->batch;
+  free(b->buf);
+  b->buf = NULL;
+  b->max_bytes = (max_bytes > VCA_COM_MAX_BATCH_BYTES) ? VCA_COM_MAX_BATCH_BYTES : max_bytes;
+  b->max_delay_ns = max_delay_us * 1000;
+
+  return 0;
+}
+
+// hdr, if given, and msg as one message to the peer of com, put into the batch if com batches
+static int zmq_send_msg(vca_com_t * com, vca_com_msg_hdr * hdr, char * msg, unsigned long long length) {
+
+  vca_com_batch * b = (vca_com_batch*) com->batch;
+  unsigned long long hlen = hdr ? sizeof(vca_com_msg_hdr) : 0;
+  zmq_msg_t frame;
+
+  if(b && hlen + length <= b->max_bytes) {
+    if(b->used + hlen + length > b->max_bytes && vca_com_flush(com)) {
+      return -1;
+    }
+    if(!b->buf && !(b->buf = malloc(b->max_bytes))) {
+      return -1;
+    }
+    if(b->used == 0) {
+      b->since = now_ns();
+    }
+    if(hlen > 0) {
+      memcpy(b->buf + b->used, hdr, hlen);
+    }
+    memcpy(b->buf + b->used + hlen, msg, length);
+    b->used += hlen + length;
+
+    // out once no other msg fits or the first one waited long enough
+    if(b->max_bytes - b->used <= sizeof(vca_com_msg_hdr)) {
+      return vca_com_flush(com);
+    }
+    return vca_com_flush_due(com);
+  }
+
+  // too large for a batch, what waits goes first to keep the order
+  if(b && vca_com_flush(com)) {
+    return -1;
+  }
+
+  // a stream socket sends a frame as it is, so hdr and msg are put together in the frame zmq sends
+  if(zmq_msg_init_size(&frame, hlen + length) != 0) {
+    perror("failed to allocate msg");
+    return -1;
+  }
+  if(hlen > 0) {
+    memcpy(zmq_msg_data(&frame), hdr, hlen);
+  }
+  if(length > 0) {
+    memcpy((char *) zmq_msg_data(&frame) + hlen, msg, length);
+  }
+
+  return zmq_send_frame((vca_com_zmqs*) com->com, &frame);
+}
+
 int vca_com_send_hdrless_msg(vca_com_t * com,
 			     char * msg,
 			     unsigned long long length,
@@ -209,24 +420,14 @@ int vca_com_send_hdrless_msg(vca_com_t * com,
     vca_submit_task(com->com, length, msg, c);
     break;
   case VCA_COM_MEM_SHARING_HOST:
-    host_submit_task(com->com, length, msg, com->self.socket);
+    host_submit_task(com->com, length, msg, VCA_COM_HOST_TASK_ID(com));
     break;
   case VCA_COM_ZMQ_SOCKET:
+    return zmq_send_msg(com, NULL, msg, length);
+  case VCA_COM_TCP_SOCKET:
     {
-      vca_com_zmqs * zmqs = (vca_com_zmqs*) com->com;
-      int rc = 0;
-      //zmq_sock_send
-      rc = zmq_send(zmqs->socket, zmqs->id, zmqs->id_size, ZMQ_SNDMORE);
-      if(rc < zmqs->id_size) {
-	perror("failed to send id for msg");
-	return rc;
-      }
-      rc = zmq_send(zmqs->socket, msg, length, ZMQ_SNDMORE);
-      if(rc < length) {
-	perror("failed to send msg");
-	return rc;
-      }
-      break;
+      struct iovec iov = { msg, length };
+      return vca_com_tcp_sendv((vca_com_tcps*) com->com, &iov, 1);
     }
   default:
     return -1;
@@ -242,37 +443,176 @@ int vca_com_send_msg(vca_com_t * com,
 		     unsigned long long length,
 		     unsigned int c) {
   
-  char sspace[4096];
-  void * buffer = (void*) sspace;
-  vca_com_msg_hdr * hdr = NULL;
-  unsigned long long full_length = length + sizeof(vca_com_msg_hdr);
-  int ret = 0;
+  vca_com_msg_hdr mhdr;
+
+  memset(&mhdr, 0, sizeof(vca_com_msg_hdr));
+  vca_com_cpy_addr(&com->self, &mhdr.src);
+  vca_com_cpy_addr(dst, &mhdr.dst);
+  mhdr.length = length;
+
+  switch (com->type) {
+  case VCA_COM_MEM_SHARING:
+  case VCA_COM_MEM_SHARING_HOST:
+    {
+      // memory sharing takes hdr and msg as two segments, no need to assemble them
+      struct iovec iov[2] = { { &mhdr, sizeof(mhdr) }, { msg, length } };
 
-  // for short messages rely on the stack allocated array, otherwise default ot dyn. mem alloc
-  if(full_length > 4096) {
-    buffer = malloc(full_length);
+      if(com->type == VCA_COM_MEM_SHARING)
+	vca_submit_taskv(com->com, iov, (length > 0) ? 2 : 1, c);
+      else
+	host_submit_taskv(com->com, iov, (length > 0) ? 2 : 1, VCA_COM_HOST_TASK_ID(com));
+      break;
+    }
+  case VCA_COM_ZMQ_SOCKET:
+    return zmq_send_msg(com, &mhdr, msg, length);
+  case VCA_COM_TCP_SOCKET:
+    {
+      // hdr and msg go out in one sendmsg, neither is copied before
+      struct iovec iov[2] = { { &mhdr, sizeof(mhdr) }, { msg, length } };
+
+      return vca_com_tcp_sendv((vca_com_tcps*) com->com, iov, (length > 0) ? 2 : 1);
+    }
+  default:
+    return -1;
   }
-  
-  // setup msg hdr hdr
-  hdr = vca_com_msg_get_hdr(buffer);
-  memset(hdr, 0, sizeof(vca_com_msg_hdr));
-  vca_com_cpy_addr(&com->self, &hdr->src);
-  vca_com_cpy_addr(dst, &hdr->dst);
-  hdr->length = length;
-
-  // copy message
-  if(length > 0) {
-    memcpy(vca_com_msg_get_msg(buffer), msg, length);
+
+  return 0;
+}
+
+// next data frame of the peer of zmqs, stepping over those of connection establishment
+static int zmq_recv_frame(vca_com_zmqs * zmqs, zmq_msg_t * frame) {
+  char tmpid[sizeof(zmqs->id)];
+  int rc = 0;
+
+  do {
+    rc = zmq_recv(zmqs->socket, tmpid, sizeof(tmpid), 0);
+    if(rc < 0 || memcmp(zmqs->id, tmpid, zmqs->id_size))
+      return -1;
+    rc = zmq_msg_recv(frame, zmqs->socket, 0);
+    if(rc < 0)
+      return -1;
+  } while (rc < 1);
+
+  return 0;
+}
+
+static vca_com_view * get_view(vca_com_t * com) {
+  if(!com->view) {
+    com->view = calloc(1, sizeof(vca_com_view));
+  }
+  return (vca_com_view*) com->view;
+}
+
+// bytes of the frame of v not taken yet
+static unsigned long long view_left(vca_com_view * v) {
+  return v->has_msg ? zmq_msg_size(&v->msg) - v->next : 0;
+}
+
+// a frame with bytes not taken yet in v, the next of the peer of com once all are
+static int view_fill(vca_com_t * com, vca_com_view * v) {
+
+  if(view_left(v) > 0) {
+    return 0;
   }
 
-  ret = vca_com_send_hdrless_msg(com, buffer, full_length, c);
-  
-  // free dyn. allocated msg after sending
-  if(buffer != sspace) {
-    free(buffer);
+  view_drop(v);
+  zmq_msg_init(&v->msg);
+  if(zmq_recv_frame((vca_com_zmqs*) com->com, &v->msg) != 0) {
+    zmq_msg_close(&v->msg);
+    return -1;
+  }
+  v->has_msg = 1;
+  v->next = 0;
+
+  return 0;
+}
+
+// copy the next length bytes of the frames of the peer of com to off in the buffer of v
+static int view_gather(vca_com_t * com, vca_com_view * v, unsigned long long off, unsigned long long length) {
+
+  unsigned long long n = 0;
+
+  if(off + length > v->size) {
+    char * buf = realloc(v->buf, off + length);
+    if(!buf) {
+      return -1;
+    }
+    v->buf = buf;
+    v->size = off + length;
+  }
+
+  while(length > 0) {
+    if(view_fill(com, v)) {
+      return -1;
+    }
+    n = (view_left(v) < length) ? view_left(v) : length;
+    memcpy(v->buf + off, (char *) zmq_msg_data(&v->msg) + v->next, n);
+    v->next += n;
+    off += n;
+    length -= n;
+  }
+
+  return 0;
+}
+
+// next message from the peer of com; a frame may hold a batch of them, it is kept in the view
+// of com until all are taken. hdr points into the frame, length is that of the msg behind it.
+// A ZMQ_STREAM frame is what one tcp read got, a msg it cuts off is put together in the buffer
+// of the view from the frames that follow
+static int zmq_next_msg(vca_com_t * com, vca_com_msg_hdr ** hdr, unsigned long long * length) {
+
+  vca_com_view * v = get_view(com);
+
+  if(!v) {
+    return -1;
+  }
+
+  // waiting for an answer, so nothing of ours may wait in the batch
+  if(vca_com_flush(com)) {
+    return -1;
+  }
+
+  if(view_fill(com, v)) {
+    return -1;
+  }
+
+  // whole msg in the frame, it stays there
+  *hdr = (vca_com_msg_hdr *) ((char *) zmq_msg_data(&v->msg) + v->next);
+  if(view_left(v) >= sizeof(vca_com_msg_hdr)
+     && (*hdr)->length <= view_left(v) - sizeof(vca_com_msg_hdr)) {
+    *length = (*hdr)->length;
+    v->next += sizeof(vca_com_msg_hdr) + *length;
+    return 0;
+  }
+
+  if(view_gather(com, v, 0, sizeof(vca_com_msg_hdr))) {
+    view_drop(v);
+    return -1;
+  }
+  *length = ((vca_com_msg_hdr *) v->buf)->length;
+  if(*length > VCA_COM_TCP_MAX_MSG - sizeof(vca_com_msg_hdr)
+     || view_gather(com, v, sizeof(vca_com_msg_hdr), *length)) {
+    // the bounds of the msgs that follow are lost with this one
+    view_drop(v);
+    return -1;
+  }
+  *hdr = (vca_com_msg_hdr *) v->buf;
+
+  return 0;
+}
+
+// next message from the peer of com, *hdr points into the receive buffer of the socket
+static int tcp_next_msg(vca_com_t * com, vca_com_msg_hdr ** hdr, unsigned long long * length) {
+
+  char * msg = NULL;
+
+  if(vca_com_tcp_recv((vca_com_tcps*) com->com, &msg, length, 1) != 0) {
+    return -1;
   }
+  *hdr = (vca_com_msg_hdr *) msg;
+  *length -= sizeof(vca_com_msg_hdr);
 
-  return ret;
+  return 0;
 }
 
 // receive next message from src via com on channel c
@@ -282,8 +622,6 @@ int vca_com_recv_msg(vca_com_t * com,
 		     unsigned long long * length,
 		     unsigned int * c) {
   
-  char sspace[4096];
-  void * buffer = (void*) sspace;
   unsigned long long task_len = 0;
   vca_com_msg_hdr * hdr = NULL;
   int rc = 0;
@@ -293,53 +631,155 @@ int vca_com_recv_msg(vca_com_t * com,
     return -1;
   }
 
-  if (*length > 4096) {
-    buffer = malloc(*length + sizeof(vca_com_msg_hdr));
-  }
-
   switch(com->type) {
   case VCA_COM_MEM_SHARING:
-     rc = vca_recv_task(com->com, (long*) &task_len, buffer, *c); 
-     break;
   case VCA_COM_MEM_SHARING_HOST:
-     rc = host_recv_task(com->com, (long*) &task_len, buffer, (int*) c);
-     break;
-  case VCA_COM_ZMQ_SOCKET:
     {
-      vca_com_zmqs * zmqs = (vca_com_zmqs*)com->com;
-      char tmpid[sizeof(zmqs->id)];
-      do {
-        rc = zmq_recv(zmqs->socket, tmpid, sizeof(tmpid), 0);
-        if(rc < 0 || memcmp(zmqs->id, tmpid, zmqs->id_size))
-  	  break;
-        rc = zmq_recv(zmqs->socket, buffer, *length, 0);
-        if(rc < 0)
-	  break;
-        task_len = (unsigned long long) rc; // set length of request
-      } while (rc < 1); // to step over connection establishment
-      if (rc > 0)
-	rc = 0; // to emulate shared memory return semantics
-      break;
+      // memory sharing receives hdr and msg straight into their own places
+      vca_com_msg_hdr mhdr;
+      struct iovec iov[2] = { { &mhdr, sizeof(mhdr) }, { msg, *length } };
+
+      if(com->type == VCA_COM_MEM_SHARING)
+	rc = vca_recv_taskv(com->com, (long*) &task_len, iov, 2, *c);
+      else
+	rc = host_recv_taskv(com->com, (long*) &task_len, iov, 2, (int*) c);
+
+      if(rc == 0) {
+	vca_com_cpy_addr(&mhdr.src, src);
+
+	// check that task fit
+	if(task_len < sizeof(vca_com_msg_hdr) || task_len - sizeof(vca_com_msg_hdr) > *length) {
+	  return -1;
+	}
+	*length = task_len - sizeof(vca_com_msg_hdr);
+      }
+      return rc;
+    }
+  case VCA_COM_ZMQ_SOCKET:
+  case VCA_COM_TCP_SOCKET:
+    // copied once, out of the frame or buffer the socket received into
+    if(com->type == VCA_COM_ZMQ_SOCKET)
+      rc = zmq_next_msg(com, &hdr, &task_len);
+    else
+      rc = tcp_next_msg(com, &hdr, &task_len);
+    if(rc == 0) {
+      vca_com_cpy_addr(&hdr->src, src);
+
+      // check that task fits
+      if(task_len > *length) {
+	return -1;
+      }
+      *length = task_len;
+      memcpy(msg, (char *) hdr + sizeof(vca_com_msg_hdr), *length);
     }
+    return rc;
+  default:
+    return -1;
+  }
+}
+
+// read exactly length bytes of the task in s
+static int read_stream(task_stream * s, char * buffer, unsigned long long length) {
+  long rc = 0;
+
+  while(length > 0) {
+    rc = recv_stream_read(s, buffer, length);
+    if(rc <= 0)
+      return -1;
+    buffer += rc;
+    length -= rc;
+  }
+
+  return 0;
+}
+
+int vca_com_recv_msg_view(vca_com_t * com,
+			  vca_com_addr * src,
+			  char ** msg,
+			  unsigned long long * length,
+			  unsigned int * c) {
+
+  vca_com_view * v = NULL;
+  vca_com_msg_hdr mhdr;
+  task_stream s;
+  long task_len = 0;
+  int rc = 0;
+
+  if(!com || !src || !msg || !length || !c) {
+    return -1;
+  }
+
+  v = get_view(com);
+  if(!v) {
+    return -1;
   }
- 
-  if(rc == 0) {
-    // received a message
-    hdr = vca_com_msg_get_hdr(buffer);
-    vca_com_cpy_addr(&hdr->src, src);
 
-    // check that task fits
-    if(*length < task_len) {
+  switch(com->type) {
+  case VCA_COM_ZMQ_SOCKET:
+  case VCA_COM_TCP_SOCKET:
+    {
+      // the message stays where the socket received it
+      vca_com_msg_hdr * hdr = NULL;
+
+      rc = (com->type == VCA_COM_ZMQ_SOCKET) ? zmq_next_msg(com, &hdr, length) : tcp_next_msg(com, &hdr, length);
+      if(rc != 0) {
 	return -1;
+      }
+      vca_com_cpy_addr(&hdr->src, src);
+      *msg = (char *) hdr + sizeof(vca_com_msg_hdr);
+      return 0;
     }
-    
-    *length = task_len - sizeof(vca_com_msg_hdr);
-    memcpy(msg, vca_com_msg_get_msg(buffer), *length);
+  case VCA_COM_MEM_SHARING:
+    rc = vca_recv_stream_begin(com->com, &s, &task_len, *c);
+    break;
+  case VCA_COM_MEM_SHARING_HOST:
+    rc = host_recv_stream_begin(com->com, &s, &task_len, (int*) c);
+    break;
+  default:
+    return -1;
   }
 
-  if(buffer != sspace) {
-    free(buffer); // free if previously allocated
+  if(rc != 0)
+    return -1;
+
+  // the ring slots go back as they are read, so the message lands once in the buffer of com
+  if(task_len < sizeof(vca_com_msg_hdr)) {
+    recv_stream_end(&s);
+    return -1;
+  }
+  *length = task_len - sizeof(vca_com_msg_hdr);
+  if(*length > v->size) {
+    char * buf = realloc(v->buf, *length);
+    if(!buf) {
+      recv_stream_end(&s);
+      return -1;
+    }
+    v->buf = buf;
+    v->size = *length;
   }
 
-  return rc;
+  rc = read_stream(&s, (char *) &mhdr, sizeof(mhdr));
+  if(rc == 0)
+    rc = read_stream(&s, v->buf, *length);
+  recv_stream_end(&s);
+  if(rc != 0)
+    return -1;
+
+  vca_com_cpy_addr(&mhdr.src, src);
+  *msg = v->buf;
+  return 0;
+}
+
+void vca_com_release_view(vca_com_t * com) {
+
+  vca_com_view * v = NULL;
+
+  if(!com || !com->view)
+    return;
+
+  // a frame with msgs still to take stays
+  v = (vca_com_view*) com->view;
+  if(v->has_msg && v->next >= zmq_msg_size(&v->msg)) {
+    view_drop(v);
+  }
 }
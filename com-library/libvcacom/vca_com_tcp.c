@@ -0,0 +1,387 @@
+/*
+ * Copyright 2019 Intel(R) Corporation (http://www.intel.com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * vca_com_tcp.c
+ *
+ * Native tcp transport of libvcacom. The messages go on the stream
+ * as they are, each a vca_com_msg_hdr and the hdr.length bytes behind
+ * it, which is what a ZMQ_STREAM peer sees as well. Without the zmq
+ * I/O thread in between, a send is one sendmsg of the hdr and the
+ * message of the caller, and a receive hands out the message where
+ * it was read into.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <vca_com.h>
+
+// older libc headers lack the zerocopy interface of linux 4.14
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+#define TCP_RECV_BUF (64*1024)
+
+vca_com_tcp_opts vca_com_tcp_defaults = { 1, 0, 0 };
+
+static void configure(int fd, vca_com_tcps * t, const vca_com_tcp_opts * opts) {
+  int one = 1;
+  int val = 0;
+
+  if(opts->nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
+    perror("failed to set TCP_NODELAY");
+  }
+
+  // raising it above net.core.busy_read takes CAP_NET_ADMIN
+  val = opts->busy_poll_us;
+  if(val > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val))) {
+    COML_DBM("SO_BUSY_POLL of %d us not set: %s", val, strerror(errno));
+  }
+
+  t->zerocopy_min = 0;
+  if(opts->zerocopy_min > 0) {
+    if(setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+      t->zerocopy_min = opts->zerocopy_min;
+    } else {
+      COML_DBM("MSG_ZEROCOPY not available: %s", strerror(errno));
+    }
+  }
+}
+
+vca_com_tcps * vca_com_tcp_wrap(int fd, const vca_com_tcp_opts * opts) {
+
+  vca_com_tcps * t = NULL;
+
+  if(fd < 0) {
+    return NULL;
+  }
+
+  t = calloc(1, sizeof(vca_com_tcps));
+  if(!t) {
+    return NULL;
+  }
+
+  t->fd = fd;
+  configure(fd, t, opts ? opts : &vca_com_tcp_defaults);
+
+  return t;
+}
+
+vca_com_tcps * vca_com_tcp_connect(const char * ip,
+				   const char * port,
+				   const vca_com_tcp_opts * opts) {
+
+  struct addrinfo hints;
+  struct addrinfo * res = NULL;
+  struct addrinfo * ai = NULL;
+  vca_com_tcps * t = NULL;
+  int fd = -1;
+  int rc = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  rc = getaddrinfo(ip, port, &hints, &res);
+  if(rc != 0) {
+    COML_DBM("failed to resolve %s:%s: %s", ip, port, gai_strerror(rc));
+    return NULL;
+  }
+
+  COML_DBM("connecting to %s:%s", ip, port);
+
+  for(ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if(fd < 0)
+      continue;
+    if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if(fd < 0) {
+    perror("failed to connect");
+    return NULL;
+  }
+
+  t = vca_com_tcp_wrap(fd, opts);
+  if(!t) {
+    close(fd);
+  }
+
+  return t;
+}
+
+int vca_com_tcp_listen(const char * port) {
+
+  struct sockaddr_in6 sa;
+  int one = 1;
+  int fd = -1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin6_family = AF_INET6;
+  sa.sin6_addr = in6addr_any;
+  sa.sin6_port = htons((unsigned short) strtoul(port, NULL, 10));
+
+  // one socket for ipv4 and ipv6, as zmq's tcp://*
+  fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0) {
+    perror("failed to create listening socket");
+    return -1;
+  }
+
+  (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if(bind(fd, (struct sockaddr *) &sa, sizeof(sa)) || listen(fd, SOMAXCONN)) {
+    perror("socket bind failed");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+void vca_com_tcp_close(vca_com_tcps * t) {
+
+  if(!t || t->fd < 0)
+    return;
+
+  close(t->fd);
+  t->fd = -1;
+
+  free(t->buf);
+  t->buf = NULL;
+  t->size = t->start = t->end = 0;
+}
+
+void vca_com_tcp_free(vca_com_tcps * t) {
+
+  vca_com_tcp_close(t);
+  free(t);
+}
+
+// wait for events on fd, 0 once they are there
+static int wait_fd(int fd, short events) {
+  struct pollfd p = { fd, events, 0 };
+  int rc = 0;
+
+  do {
+    rc = poll(&p, 1, -1);
+  } while(rc < 0 && errno == EINTR);
+
+  return (rc < 0 || (p.revents & (POLLHUP | POLLNVAL))) ? -1 : 0;
+}
+
+// the pages of a zerocopy send stay with the kernel until it reports them done,
+// so wait for the reports of the calls of a send before the caller gets its buffers back
+static int zerocopy_wait(vca_com_tcps * t, unsigned int calls) {
+  char control[128];
+  struct msghdr mh;
+  struct cmsghdr * cm = NULL;
+  struct sock_extended_err * serr = NULL;
+
+  while(calls > 0) {
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    if(recvmsg(t->fd, &mh, MSG_ERRQUEUE) < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+	// the error queue only signals POLLERR
+	if(wait_fd(t->fd, 0))
+	  return -1;
+	continue;
+      }
+      perror("failed to read zerocopy completion");
+      return -1;
+    }
+
+    for(cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+      if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+	   || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+	continue;
+      serr = (struct sock_extended_err *) CMSG_DATA(cm);
+      if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+	continue;
+
+      // completions come as a range of call ids
+      calls -= (serr->ee_data - serr->ee_info + 1 > calls) ? calls : serr->ee_data - serr->ee_info + 1;
+
+      // e.g. over loopback the kernel copies after all, then copying in the first place is cheaper
+      if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+	COML_DBM("zerocopy sends got copied, turning them off");
+	t->zerocopy_min = 0;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int vca_com_tcp_sendv(vca_com_tcps * t, const struct iovec * iov, int iovcnt) {
+
+  struct iovec v[VCA_COM_TCP_MAX_IOV];
+  struct msghdr mh;
+  unsigned long long total = 0;
+  unsigned int zc_calls = 0;
+  int flags = MSG_NOSIGNAL;
+  ssize_t rc = 0;
+  int i = 0;
+
+  if(!t || t->fd < 0 || iovcnt < 0 || iovcnt > VCA_COM_TCP_MAX_IOV) {
+    return -1;
+  }
+
+  for(i = 0; i < iovcnt; i++) {
+    v[i] = iov[i];
+    total += iov[i].iov_len;
+  }
+
+  if(t->zerocopy_min > 0 && total >= t->zerocopy_min) {
+    flags |= MSG_ZEROCOPY;
+  }
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = v;
+  mh.msg_iovlen = iovcnt;
+
+  while(total > 0) {
+    rc = sendmsg(t->fd, &mh, flags);
+    if(rc < 0) {
+      if(errno == EINTR)
+	continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+	if(wait_fd(t->fd, POLLOUT))
+	  return -1;
+	continue;
+      }
+      if(errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+	// out of option memory for the completions
+	flags &= ~MSG_ZEROCOPY;
+	continue;
+      }
+      perror("failed to send msg");
+      return -1;
+    }
+
+    if(flags & MSG_ZEROCOPY)
+      zc_calls++;
+
+    // step over what went out
+    total -= rc;
+    while(rc > 0 && mh.msg_iovlen > 0) {
+      if((size_t) rc < mh.msg_iov->iov_len) {
+	mh.msg_iov->iov_base = (char *) mh.msg_iov->iov_base + rc;
+	mh.msg_iov->iov_len -= rc;
+	rc = 0;
+      } else {
+	rc -= mh.msg_iov->iov_len;
+	mh.msg_iov++;
+	mh.msg_iovlen--;
+      }
+    }
+  }
+
+  return (zc_calls > 0) ? zerocopy_wait(t, zc_calls) : 0;
+}
+
+int vca_com_tcp_recv(vca_com_tcps * t, char ** msg, unsigned long long * length, int wait) {
+
+  vca_com_msg_hdr * hdr = NULL;
+  unsigned long long need = 0;
+  ssize_t rc = 0;
+
+  if(!t || t->fd < 0 || !msg || !length) {
+    return -1;
+  }
+
+  for(;;) {
+    need = sizeof(vca_com_msg_hdr);
+    if(t->end - t->start >= sizeof(vca_com_msg_hdr)) {
+      hdr = (vca_com_msg_hdr *) (t->buf + t->start);
+      if(hdr->length > VCA_COM_TCP_MAX_MSG - sizeof(vca_com_msg_hdr)) {
+	COML_DBM("msg of %llu bytes too large", hdr->length);
+	return -1;
+      }
+      need += hdr->length;
+      if(t->end - t->start >= need) {
+	*msg = t->buf + t->start;
+	*length = need;
+	t->start += need;
+	return 0;
+      }
+    }
+
+    // room for the rest of the message behind what is there, moving it to the front if need be
+    if(t->start == t->end) {
+      t->start = t->end = 0;
+    }
+    if(t->size - t->start < need) {
+      memmove(t->buf, t->buf + t->start, t->end - t->start);
+      t->end -= t->start;
+      t->start = 0;
+    }
+    if(t->size < need || t->size == 0) {
+      unsigned long long size = (need > TCP_RECV_BUF) ? need : TCP_RECV_BUF;
+      char * buf = realloc(t->buf, size);
+      if(!buf)
+	return -1;
+      t->buf = buf;
+      t->size = size;
+    }
+
+    rc = recv(t->fd, t->buf + t->end, t->size - t->end, wait ? 0 : MSG_DONTWAIT);
+    if(rc > 0) {
+      t->end += rc;
+      continue;
+    }
+    if(rc == 0) {
+      COML_DBM("connection closed by peer");
+      return -1;
+    }
+    if(errno == EINTR)
+      continue;
+    if(errno == EAGAIN || errno == EWOULDBLOCK) {
+      if(!wait)
+	return 1;
+      if(wait_fd(t->fd, POLLIN))
+	return -1;
+      continue;
+    }
+    perror("failed to recv msg");
+    return -1;
+  }
+}
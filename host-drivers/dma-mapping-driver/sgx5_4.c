@@ -97,6 +97,8 @@ static void sgx5_unmap(unsigned long *paddr)
 
 }
 
+#include "sgx5_dev.h"
+
 
 static ssize_t read_map0(struct kobject *kobj, struct kobj_attribute *attr,
                       char *buf)
@@ -194,12 +196,16 @@ static int __init sgx5_11_init (void)
                 pr_debug("somnath: failed to create the map 1 file in /sys/kernel/sgx5_mapper_11 \n");
         }
 
+        if (!error && sgx5_dev_register("sgx5_mapper_4", SGX5_PLATFORM_HOST, 4))
+                printk("somnath: failed to register /dev/sgx5_mapper_4, only sysfs is available\n");
+
         return error;
 }
 
 static void __exit sgx5_11_exit (void)
 {
         pr_debug ("somnath: Module 11 uninitialized successfully \n");
+        sgx5_dev_unregister();
         kobject_put(sgx5_kobject);
 }
 
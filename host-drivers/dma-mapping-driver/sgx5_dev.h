@@ -0,0 +1,521 @@
+/*
+ * Intel VCA Software Stack (VCASS)
+ *
+ * Copyright(c) 2016-2017 Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Intel VCA sgx5 mapper character device
+ *
+ * Included by every sgx5 mapper module after its stored_maps, MAX_MAPS_NR,
+ * sgx5_map() and sgx5_unmap(), so the ioctls work on the same slots as the
+ * sysfs map files. On top of those every open file has a table of its own
+ * mappings, see SGX5_MAP_ANY. sgx5_kobject and somnath_xdev give the numa_node
+ * file its directory and its PCI device, which also owns the DMA buffers and
+ * the DMA channel of SGX5_IOC_DMA_COPY.
+ */
+#ifndef _SGX5_DEV_H_
+#define _SGX5_DEV_H_
+
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/pci.h>
+#include <linux/dma-mapping.h>
+#include <linux/dmaengine.h>
+#include <linux/sysfs.h>
+#ifdef CONFIG_MTRR
+#include <asm/mtrr.h>
+#endif
+
+#include "sgx5_ioctl.h"
+
+#define SGX5_MAX_CACHE_RANGES 8
+
+struct sgx5_cache_range {
+	int handle;
+	unsigned long base;
+	unsigned long size;
+};
+
+static DEFINE_MUTEX(sgx5_dev_lock);
+static DEFINE_MUTEX(sgx5_dev_dma_lock);
+static char sgx5_dev_name[32];
+static struct sgx5_platform_info sgx5_dev_info;
+static struct sgx5_cache_range sgx5_dev_cache[SGX5_MAX_CACHE_RANGES];
+static int sgx5_dev_cache_nr;
+static int sgx5_dev_registered;
+
+/* Mapping of an open file; the table holds one reference and every vma one more */
+struct sgx5_dev_mapping {
+	struct list_head node;
+	struct kref ref;
+	u32 map;
+	u32 cache;
+	unsigned long remote_phys_addr;
+	unsigned long len;
+	unsigned long local_phys_addr;
+	void *cpu_addr;			/* DMA buffer instead of an aperture window */
+	dma_addr_t dma_addr;
+};
+
+struct sgx5_dev_file {
+	struct mutex lock;
+	struct list_head maps;
+	u32 next_map;
+};
+
+static void sgx5_dev_mapping_release(struct kref *ref)
+{
+	struct sgx5_dev_mapping *m = container_of(ref, struct sgx5_dev_mapping, ref);
+
+	if (m->cpu_addr) {
+		dma_free_coherent(&somnath_xdev->pdev->dev, m->len, m->cpu_addr, m->dma_addr);
+	} else {
+		/* the lookup table is shared with sgx5_map() of the other files */
+		mutex_lock(&sgx5_dev_lock);
+		sgx5_unmap(&m->local_phys_addr);
+		mutex_unlock(&sgx5_dev_lock);
+	}
+	kfree(m);
+}
+
+static struct sgx5_dev_mapping *sgx5_dev_find(struct sgx5_dev_file *f, u32 map)
+{
+	struct sgx5_dev_mapping *m;
+
+	list_for_each_entry(m, &f->maps, node)
+		if (m->map == map)
+			return m;
+	return NULL;
+}
+
+static void sgx5_dev_add(struct sgx5_dev_file *f, struct sgx5_dev_mapping *m)
+{
+	kref_init(&m->ref);
+	m->map = f->next_map++;
+	if (f->next_map < SGX5_FILE_MAP_BASE || f->next_map == SGX5_MAP_ANY)
+		f->next_map = SGX5_FILE_MAP_BASE;
+	list_add_tail(&m->node, &f->maps);
+}
+
+static long sgx5_dev_file_map_cmd(struct sgx5_dev_file *f, unsigned int cmd, struct sgx5_map_req *req)
+{
+	struct sgx5_dev_mapping *m;
+
+	if (cmd == SGX5_IOC_MAP) {
+		if (!req->remote_phys_addr || !req->len || ((req->remote_phys_addr | req->len) & ~PAGE_MASK)
+		    || req->len > (1UL << SGX5_MMAP_SHIFT))
+			return -EINVAL;
+
+		m = kzalloc(sizeof(*m), GFP_KERNEL);
+		if (!m)
+			return -ENOMEM;
+
+		/* the PLX lookup table is what bounds the number of mappings */
+		mutex_lock(&sgx5_dev_lock);
+		if (sgx5_map(req->remote_phys_addr, req->len, &m->local_phys_addr) != 0 || m->local_phys_addr == 0) {
+			mutex_unlock(&sgx5_dev_lock);
+			kfree(m);
+			return -ENOSPC;
+		}
+		mutex_unlock(&sgx5_dev_lock);
+
+		m->cache = req->cache;
+		m->remote_phys_addr = req->remote_phys_addr;
+		m->len = req->len;
+		sgx5_dev_add(f, m);
+	} else {
+		m = sgx5_dev_find(f, req->map);
+		if (!m)
+			return -ENOENT;
+	}
+
+	req->map = m->map;
+	req->remote_phys_addr = m->remote_phys_addr;
+	req->len = m->len;
+	req->local_phys_addr = m->local_phys_addr;
+	req->mmap_offset = (u64)m->map << SGX5_MMAP_SHIFT;
+
+	if (cmd == SGX5_IOC_UNMAP) {
+		list_del(&m->node);
+		kref_put(&m->ref, sgx5_dev_mapping_release);
+	}
+	return 0;
+}
+
+/* Contiguous memory on the node of the PLX device that never moves, whatever the page allocator looks like by now */
+static long sgx5_dev_file_dma_alloc(struct sgx5_dev_file *f, struct sgx5_dma_req *req)
+{
+	struct sgx5_dev_mapping *m;
+
+	if (!somnath_xdev || !somnath_xdev->pdev)
+		return -ENODEV;
+	if (!req->len || (req->len & ~PAGE_MASK) || req->len > (1UL << SGX5_MMAP_SHIFT))
+		return -EINVAL;
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+
+	m->cpu_addr = dma_alloc_coherent(&somnath_xdev->pdev->dev, req->len, &m->dma_addr, GFP_KERNEL);
+	if (!m->cpu_addr) {
+		kfree(m);
+		return -ENOMEM;
+	}
+	memset(m->cpu_addr, 0, req->len);
+	m->len = req->len;
+	sgx5_dev_add(f, m);
+
+	req->map = m->map;
+	req->dma_addr = m->dma_addr;
+	req->mmap_offset = (u64)m->map << SGX5_MMAP_SHIFT;
+	return 0;
+}
+
+/* One copy at a time through the DMA channel of the PLX device, which its driver shares with others */
+static long sgx5_dev_dma_copy(struct sgx5_copy_req *req)
+{
+	struct dma_chan *ch = somnath_xdev ? somnath_xdev->dma_ch : NULL;
+	struct dma_async_tx_descriptor *tx;
+	dma_cookie_t cookie;
+	long ret = 0;
+
+	if (!ch)
+		return -ENODEV;
+	if (req->len == 0)
+		return 0;
+
+	mutex_lock(&sgx5_dev_dma_lock);
+	tx = ch->device->device_prep_dma_memcpy(ch, req->dst, req->src, req->len, DMA_PREP_FENCE);
+	if (!tx) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	cookie = tx->tx_submit(tx);
+	if (dma_submit_error(cookie)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (dma_sync_wait(ch, cookie) != 0)
+		ret = -EIO;
+out:
+	mutex_unlock(&sgx5_dev_dma_lock);
+	return ret;
+}
+
+static long sgx5_dev_map_cmd(unsigned int cmd, struct sgx5_map_req *req)
+{
+	struct sgx5_map_struct *m = &stored_maps[req->map];
+
+	if (cmd == SGX5_IOC_QUERY) {
+		req->remote_phys_addr = m->remote_phys_addr;
+		req->len = m->len;
+		req->local_phys_addr = m->local_phys_addr;
+		return 0;
+	}
+
+	/* same as writing "0x0 0x0" to the map file before the new range */
+	if (m->local_phys_addr != 0)
+		sgx5_unmap(&m->local_phys_addr);
+	m->remote_phys_addr = 0;
+	m->len = 0;
+
+	if (cmd == SGX5_IOC_UNMAP)
+		return 0;
+
+	if (!req->remote_phys_addr || !req->len || ((req->remote_phys_addr | req->len) & ~PAGE_MASK))
+		return -EINVAL;
+
+	if (sgx5_map(req->remote_phys_addr, req->len, &m->local_phys_addr) != 0 || m->local_phys_addr == 0) {
+		printk("somnath: ioctl mapping fail remote_phys_addr=0x%llx len=0x%llx\n", req->remote_phys_addr, req->len);
+		m->local_phys_addr = 0;
+		return -ENODEV;
+	}
+
+	m->remote_phys_addr = req->remote_phys_addr;
+	m->len = req->len;
+	req->local_phys_addr = m->local_phys_addr;
+	return 0;
+}
+
+static long sgx5_dev_set_caching(struct sgx5_cache_req *req)
+{
+#ifdef CONFIG_MTRR
+	int handle;
+
+	if (req->type != SGX5_CACHE_WRITE_THROUGH && req->type != SGX5_CACHE_WRITE_COMBINING)
+		return -EINVAL;
+	if (sgx5_dev_cache_nr == SGX5_MAX_CACHE_RANGES)
+		return -ENOSPC;
+
+	handle = mtrr_add(req->base, req->size,
+			  req->type == SGX5_CACHE_WRITE_COMBINING ? MTRR_TYPE_WRCOMB : MTRR_TYPE_WRTHROUGH, true);
+	if (handle < 0)
+		return handle;
+
+	sgx5_dev_cache[sgx5_dev_cache_nr].handle = handle;
+	sgx5_dev_cache[sgx5_dev_cache_nr].base = req->base;
+	sgx5_dev_cache[sgx5_dev_cache_nr].size = req->size;
+	sgx5_dev_cache_nr++;
+	req->handle = handle;
+	return 0;
+#else
+	/* PAT only: the memory type has to come with the user mapping itself */
+	return -ENXIO;
+#endif
+}
+
+static long sgx5_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct sgx5_dev_file *f = file->private_data;
+	void __user *uarg = (void __user *)arg;
+	struct sgx5_map_req req;
+	struct sgx5_cache_req cache;
+	struct sgx5_dma_req dma;
+	struct sgx5_copy_req copy;
+	long ret;
+
+	switch (cmd) {
+	case SGX5_IOC_MAP:
+	case SGX5_IOC_UNMAP:
+	case SGX5_IOC_QUERY:
+		/* a mapping reaches any remote physical address, as SGX5_IOC_DMA_COPY does */
+		if (cmd == SGX5_IOC_MAP && !capable(CAP_SYS_RAWIO))
+			return -EPERM;
+		if (copy_from_user(&req, uarg, sizeof(req)))
+			return -EFAULT;
+
+		if (req.map < MAX_MAPS_NR) {
+			mutex_lock(&sgx5_dev_lock);
+			ret = sgx5_dev_map_cmd(cmd, &req);
+			mutex_unlock(&sgx5_dev_lock);
+		} else if ((cmd == SGX5_IOC_MAP) ? (req.map == SGX5_MAP_ANY) : (req.map >= SGX5_FILE_MAP_BASE)) {
+			mutex_lock(&f->lock);
+			ret = sgx5_dev_file_map_cmd(f, cmd, &req);
+			mutex_unlock(&f->lock);
+		} else {
+			return -EINVAL;
+		}
+
+		if (ret == 0 && cmd != SGX5_IOC_UNMAP && copy_to_user(uarg, &req, sizeof(req)))
+			ret = -EFAULT;
+		return ret;
+
+	case SGX5_IOC_SET_CACHING:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&cache, uarg, sizeof(cache)))
+			return -EFAULT;
+
+		mutex_lock(&sgx5_dev_lock);
+		ret = sgx5_dev_set_caching(&cache);
+		mutex_unlock(&sgx5_dev_lock);
+
+		if (ret == 0 && copy_to_user(uarg, &cache, sizeof(cache)))
+			ret = -EFAULT;
+		return ret;
+
+	case SGX5_IOC_DMA_ALLOC:
+		if (copy_from_user(&dma, uarg, sizeof(dma)))
+			return -EFAULT;
+
+		mutex_lock(&f->lock);
+		ret = sgx5_dev_file_dma_alloc(f, &dma);
+		mutex_unlock(&f->lock);
+
+		if (ret == 0 && copy_to_user(uarg, &dma, sizeof(dma))) {
+			struct sgx5_map_req req = { .map = dma.map };
+
+			mutex_lock(&f->lock);
+			sgx5_dev_file_map_cmd(f, SGX5_IOC_UNMAP, &req);
+			mutex_unlock(&f->lock);
+			ret = -EFAULT;
+		}
+		return ret;
+
+	case SGX5_IOC_DMA_COPY:
+		/* any bus address, as good as /dev/mem */
+		if (!capable(CAP_SYS_RAWIO))
+			return -EPERM;
+		if (copy_from_user(&copy, uarg, sizeof(copy)))
+			return -EFAULT;
+		return sgx5_dev_dma_copy(&copy);
+
+	case SGX5_IOC_PLATFORM:
+		return copy_to_user(uarg, &sgx5_dev_info, sizeof(sgx5_dev_info)) ? -EFAULT : 0;
+	}
+
+	return -ENOTTY;
+}
+
+static void sgx5_dev_vm_open(struct vm_area_struct *vma)
+{
+	struct sgx5_dev_mapping *m = vma->vm_private_data;
+
+	kref_get(&m->ref);
+}
+
+static void sgx5_dev_vm_close(struct vm_area_struct *vma)
+{
+	struct sgx5_dev_mapping *m = vma->vm_private_data;
+
+	kref_put(&m->ref, sgx5_dev_mapping_release);
+}
+
+static const struct vm_operations_struct sgx5_dev_vm_ops = {
+	.open = sgx5_dev_vm_open,
+	.close = sgx5_dev_vm_close,
+};
+
+/* Map (part of) a per file mapping straight into user space, write combined or write through, DMA buffers cached */
+static int sgx5_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct sgx5_dev_file *f = file->private_data;
+	unsigned long map_pages = 1UL << (SGX5_MMAP_SHIFT - PAGE_SHIFT);
+	unsigned long offset = (vma->vm_pgoff & (map_pages - 1)) << PAGE_SHIFT;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct sgx5_dev_mapping *m;
+	int ret;
+
+	mutex_lock(&f->lock);
+	m = sgx5_dev_find(f, vma->vm_pgoff >> (SGX5_MMAP_SHIFT - PAGE_SHIFT));
+	if (!m || offset + size > m->len) {
+		mutex_unlock(&f->lock);
+		return -EINVAL;
+	}
+
+	if (m->cpu_addr) {
+		/* the buffer helper takes the offset into the buffer from vm_pgoff */
+		vma->vm_pgoff = offset >> PAGE_SHIFT;
+		vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+		ret = dma_mmap_coherent(&somnath_xdev->pdev->dev, vma, m->cpu_addr, m->dma_addr, m->len);
+		goto done;
+	}
+
+	if (m->cache == SGX5_CACHE_WRITE_COMBINING)
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	else
+#ifdef pgprot_writethrough
+		vma->vm_page_prot = pgprot_writethrough(vma->vm_page_prot);
+#else
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+#endif
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	ret = io_remap_pfn_range(vma, vma->vm_start, (m->local_phys_addr + offset) >> PAGE_SHIFT,
+				 size, vma->vm_page_prot);
+done:
+	if (ret == 0) {
+		vma->vm_private_data = m;
+		vma->vm_ops = &sgx5_dev_vm_ops;
+		kref_get(&m->ref);
+	}
+	mutex_unlock(&f->lock);
+
+	return ret;
+}
+
+static int sgx5_dev_open(struct inode *inode, struct file *file)
+{
+	struct sgx5_dev_file *f = kzalloc(sizeof(*f), GFP_KERNEL);
+
+	if (!f)
+		return -ENOMEM;
+
+	mutex_init(&f->lock);
+	INIT_LIST_HEAD(&f->maps);
+	f->next_map = SGX5_FILE_MAP_BASE;
+	file->private_data = f;
+	return 0;
+}
+
+/* last close, also when the process dies; mmap()ed mappings live on until munmap() */
+static int sgx5_dev_release(struct inode *inode, struct file *file)
+{
+	struct sgx5_dev_file *f = file->private_data;
+	struct sgx5_dev_mapping *m, *tmp;
+
+	list_for_each_entry_safe(m, tmp, &f->maps, node) {
+		list_del(&m->node);
+		kref_put(&m->ref, sgx5_dev_mapping_release);
+	}
+
+	kfree(f);
+	return 0;
+}
+
+static const struct file_operations sgx5_dev_fops = {
+	.owner = THIS_MODULE,
+	.open = sgx5_dev_open,
+	.release = sgx5_dev_release,
+	.mmap = sgx5_dev_mmap,
+	.unlocked_ioctl = sgx5_dev_ioctl,
+	.compat_ioctl = sgx5_dev_ioctl,
+};
+
+static struct miscdevice sgx5_dev_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = sgx5_dev_name,
+	.fops = &sgx5_dev_fops,
+	.mode = 0660,
+};
+
+/* User space places the rings of the socket and its threads on this node */
+static ssize_t sgx5_dev_numa_node_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", sgx5_dev_info.numa_node);
+}
+
+static struct kobj_attribute sgx5_dev_numa_node_attribute = __ATTR(numa_node, 0444, sgx5_dev_numa_node_show, NULL);
+
+/* name is the one of the sysfs directory, so /dev/<name> pairs with /sys/kernel/<name> */
+static int sgx5_dev_register(const char *name, int platform, int socket)
+{
+	snprintf(sgx5_dev_name, sizeof(sgx5_dev_name), "%s", name);
+	sgx5_dev_info.platform = platform;
+	sgx5_dev_info.socket = socket;
+	sgx5_dev_info.maps = MAX_MAPS_NR;
+	sgx5_dev_info.numa_node = (somnath_xdev && somnath_xdev->pdev) ? dev_to_node(&somnath_xdev->pdev->dev) : NUMA_NO_NODE;
+
+	if (sysfs_create_file(sgx5_kobject, &sgx5_dev_numa_node_attribute.attr))
+		printk("sgx5: no numa_node file in /sys/kernel/%s\n", name);
+
+	if (misc_register(&sgx5_dev_misc))
+		return -ENODEV;
+
+	sgx5_dev_registered = 1;
+	return 0;
+}
+
+static void sgx5_dev_unregister(void)
+{
+	sysfs_remove_file(sgx5_kobject, &sgx5_dev_numa_node_attribute.attr);
+	if (sgx5_dev_registered)
+		misc_deregister(&sgx5_dev_misc);
+	sgx5_dev_registered = 0;
+
+#ifdef CONFIG_MTRR
+	while (sgx5_dev_cache_nr > 0) {
+		sgx5_dev_cache_nr--;
+		mtrr_del(sgx5_dev_cache[sgx5_dev_cache_nr].handle, sgx5_dev_cache[sgx5_dev_cache_nr].base,
+			 sgx5_dev_cache[sgx5_dev_cache_nr].size);
+	}
+#endif
+}
+
+#endif /* _SGX5_DEV_H_ */
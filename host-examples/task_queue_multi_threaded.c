@@ -42,14 +42,9 @@ void *enqueue(void *channel)
         unsigned long buffer[2048] = {0x1234567890,};
         unsigned long ret = -1, total_recvd = 0;
 	int i = *((int *)channel);
-	cpu_set_t cpuset;
-	const pthread_t pid = pthread_self();
-	CPU_ZERO(&cpuset);
-	CPU_SET(i, &cpuset);
-
-	const int set_result = pthread_setaffinity_np(pid, sizeof(cpu_set_t), &cpuset);
-  	if (set_result != 0) {
-    		printf("pthread_setaffinity_np error setting on id %d\n",i);
+	// i-th CPU next to the card rather than CPU i
+  	if (vca_pin_thread(VCA_SOCKET_0, i) != 0) {
+    		printf("vca_pin_thread error setting on id %d\n",i);
   	}
         printf("Running Thread on Channel %d \n",i);
 
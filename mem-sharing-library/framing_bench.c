@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/param.h>
+#include "vca_mem.h"
+
+// Compares FRAMING_BURST and FRAMING_COMPACT on an in-process queue: one thread
+// submits tasks of a fixed size, the main thread receives them
+
+#define MIN_PAYLOAD 32
+#define MAX_PAYLOAD (64 * 1024)
+#define BYTES_PER_RUN (256UL * 1024 * 1024)
+#define MAX_TASKS_PER_RUN 1000000UL
+
+typedef struct {
+  task_queue_opaque *opq;
+  long payload;
+  unsigned long tasks;
+} bench_run;
+
+static void *producer(void *arg)
+{
+  bench_run *run = arg;
+  void *buffer = calloc(1, MAX_PAYLOAD + BUFF_SIZE_BOUNDARY);
+  unsigned long i;
+
+  assert(buffer != NULL);
+  for (i = 0; i < run->tasks; i++)
+    common_submit_task(run->opq, run->payload, buffer, 0, 0);
+
+  free(buffer);
+  return NULL;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  const char *framing_name[] = { "burst", "compact" };
+  queue_params params = DEFAULT_QUEUE_PARAMS;
+  task_queue_opaque opq;
+  void *buffer = malloc(MAX_PAYLOAD + BUFF_SIZE_BOUNDARY);
+  unsigned int framing;
+  unsigned long i;
+  long payload, len;
+  pthread_t thread;
+  bench_run run;
+  double start, elapsed;
+
+  assert(buffer != NULL);
+  params.channels = 1;
+
+  printf("%8s %8s %10s %12s %10s %12s\n", "payload", "framing", "ring bytes", "utilization", "Kmsgs/s", "payload MB/s");
+
+  for (payload = MIN_PAYLOAD; payload <= MAX_PAYLOAD; payload <<= 1) {
+    for (framing = FRAMING_BURST; framing <= FRAMING_COMPACT; framing++) {
+      params.framing = framing;
+      memset(&opq, 0, sizeof(opq));
+      opq.tx_q_objs[0] = opq.rx_q_objs[0] = init_local_queue(&params);
+      assert(opq.tx_q_objs[0] != NULL);
+
+      run.opq = &opq;
+      run.payload = payload;
+      run.tasks = MIN(BYTES_PER_RUN / payload, MAX_TASKS_PER_RUN);
+
+      start = now();
+      assert(pthread_create(&thread, NULL, producer, &run) == 0);
+      for (i = 0; i < run.tasks; i++)
+        while (common_recv_task(&opq, &len, buffer, 0, 0) != 0);
+      elapsed = now() - start;
+      pthread_join(thread, NULL);
+
+      assert(len == payload);
+      printf("%8ld %8s %10lu %11.1f%% %10.1f %12.1f\n", payload, framing_name[framing],
+	     task_footprint(opq.tx_q_objs[0], payload),
+	     100.0 * payload / task_footprint(opq.tx_q_objs[0], payload),
+	     run.tasks / elapsed / 1e3, run.tasks * payload / elapsed / (1024 * 1024));
+
+      free_queue(opq.tx_q_objs[0]);
+    }
+  }
+
+  free(buffer);
+  return 0;
+}
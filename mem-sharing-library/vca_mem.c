@@ -15,6 +15,9 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memfd_create, CPU_SET
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -34,6 +37,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <stdio.h>
@@ -44,7 +49,14 @@
 #include <malloc.h>
 #include <sys/param.h>
 #include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <immintrin.h>
 #include <zmq.h>
+#include "sgx5_ioctl.h"
 
 #include "vca_mem.h"
 
@@ -55,7 +67,22 @@ void __assert_fail(const char * assertion, const char * file, unsigned int line,
 
 #endif
 
+// Telemetry. Every thread counts into a stats_block of its own per queue, found through a small
+// thread local cache keyed by the queue's stats_id (ids are never reused, freed queues can't alias)
+#define STATS_CACHE_SIZE 8
+
+static unsigned int stats_flags = STATS_COUNTERS;
+#ifndef ENCLAVE
+static unsigned long stats_next_id = 1; // see queue_init_stats
+#endif
+static __thread struct {
+  unsigned long id;
+  stats_block *block;
+} stats_cache[STATS_CACHE_SIZE];
+
 #ifndef ENCLAVE
+static void queue_init_stats(queue_object *queue_obj);
+
 #define ZMQ_SEND ((int (*) (void *, void *, size_t, int)) zmq_send)
 #define ZMQ_RECV zmq_recv //((int (*) (void *, void *, size_t, int)) zmq_recv)
 
@@ -107,53 +134,156 @@ int get_entry(PagemapEntry *entry, int pagemap_fd, uintptr_t vaddr)
     return 0;
 }
 
+int phys_translator_open(phys_translator *t)
+{
+    t->page_size = sysconf(_SC_PAGE_SIZE);
+    t->pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    return (t->pagemap_fd < 0) ? GENERAL_ERROR : 0;
+}
+
+void phys_translator_close(phys_translator *t)
+{
+    if (t->pagemap_fd >= 0)
+        close(t->pagemap_fd);
+    t->pagemap_fd = -1;
+}
 
-unsigned long  virt_to_phys_user(uintptr_t vaddr)
+static phys_translator self_translator = { -1, 0 };
+static pid_t self_translator_pid;
+
+// process wide context, opened on first use and again in a forked child
+static phys_translator *get_self_translator(void)
 {
-    char pagemap_file[BUFSIZ];
-    int pagemap_fd;
+    phys_translator t;
     pid_t pid = getpid();
+    int expected = -1;
 
-    snprintf(pagemap_file, sizeof(pagemap_file), "/proc/%ju/pagemap", (uintmax_t)pid);
-    pagemap_fd = open(pagemap_file, O_RDONLY);
-    if (pagemap_fd < 0) {
-        return -1;
+    if (likely(__atomic_load_n(&self_translator.pagemap_fd, __ATOMIC_ACQUIRE) >= 0 && self_translator_pid == pid))
+        return &self_translator;
+
+    if (self_translator.pagemap_fd >= 0 && self_translator_pid != pid) // inherited, still describes the parent
+        phys_translator_close(&self_translator);
+
+    if (phys_translator_open(&t))
+        return NULL;
+
+    self_translator.page_size = t.page_size;
+    self_translator_pid = pid;
+    if (!__atomic_compare_exchange_n(&self_translator.pagemap_fd, &expected, t.pagemap_fd, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        close(t.pagemap_fd); // another thread got there first
+
+    return &self_translator;
+}
+
+int virt_to_phys_range(phys_translator *t, uintptr_t vaddr, unsigned long size, phys_extent *extents, int max_extents)
+{
+    uint64_t entries[PAGEMAP_BATCH];
+    uintptr_t page, last_page, end = vaddr + size;
+    unsigned long n, i, phys, delta;
+    ssize_t ret;
+    int count = 0;
+
+    if (t == NULL)
+        t = get_self_translator();
+    if (t == NULL || t->pagemap_fd < 0 || size == 0 || max_extents <= 0)
+        return GENERAL_ERROR;
+
+    last_page = (end - 1) / t->page_size;
+    for (page = vaddr / t->page_size; page <= last_page; ) {
+        n = MIN(last_page - page + 1, PAGEMAP_BATCH);
+        ret = pread(t->pagemap_fd, entries, n * sizeof(uint64_t), page * sizeof(uint64_t));
+        if (ret <= 0 || ret % sizeof(uint64_t))
+            return GENERAL_ERROR;
+
+        n = ret / sizeof(uint64_t);
+        for (i = 0; i < n; i++, page++) {
+            if (!(entries[i] & PAGEMAP_PRESENT) || !(entries[i] & PAGEMAP_PFN_MASK))
+                return GENERAL_ERROR;
+
+            phys = (entries[i] & PAGEMAP_PFN_MASK) * t->page_size;
+            if (count && extents[count - 1].phys + extents[count - 1].size == phys) {
+                extents[count - 1].size += t->page_size;
+                continue;
+            }
+
+            if (count == max_extents)
+                return GENERAL_ERROR;
+            extents[count].vaddr = page * t->page_size;
+            extents[count].phys = phys;
+            extents[count].size = t->page_size;
+            count++;
+        }
     }
-    PagemapEntry entry;
-    if (get_entry(&entry, pagemap_fd, vaddr)) {
+
+    // trim the outer extents to the requested range
+    extents[count - 1].size = end - extents[count - 1].vaddr;
+    delta = vaddr - extents[0].vaddr;
+    extents[0].vaddr += delta;
+    extents[0].phys += delta;
+    extents[0].size -= delta;
+
+    return count;
+}
+
+unsigned long  virt_to_phys_user(uintptr_t vaddr)
+{
+    phys_extent extent;
+
+    if (virt_to_phys_range(NULL, vaddr, 1, &extent, 1) != 1)
         return -1;
-    }
-    close(pagemap_fd);
-    //printf("pa base 0x%lx vaddr % 4096 ix 0x%lx\n",entry.pfn * sysconf(_SC_PAGE_SIZE),(vaddr % sysconf(_SC_PAGE_SIZE)));
-    return ((unsigned long)((entry.pfn * sysconf(_SC_PAGE_SIZE)) + (vaddr % sysconf(_SC_PAGE_SIZE))));
+
+    return extent.phys;
 }
 
 
 
-void* get_contiguous__2MB(void)
+// Prefer node for the pages of [addr, addr + size), moving those already there
+static void bind_to_node(void *addr, unsigned long size, int node)
+{
+   unsigned long nodemask[4] = { 0 };
+
+   if (node < 0 || node >= (int)(sizeof(nodemask) * 8))
+      return;
+
+   nodemask[node / (sizeof(unsigned long) * 8)] = 1UL << (node % (sizeof(unsigned long) * 8));
+   if (syscall(SYS_mbind, addr, size, MPOL_PREFERRED, nodemask, sizeof(nodemask) * 8 + 1, MPOL_MF_MOVE) != 0)
+      perror("mbind");
+}
+
+void* get_contiguous_hugepages(unsigned long size)
+{
+   return get_contiguous_hugepages_node(size, -1);
+}
+
+void* get_contiguous_hugepages_node(unsigned long size, int node)
 {
-   int offset;
-   unsigned long phys = 0, base_phys = 0;
+   phys_extent extent;
    void *vaddr;
-   vaddr = memalign(_2MB,_2MB);
-   assert(madvise(vaddr,_2MB, MADV_HUGEPAGE) == 0);
-   assert(mlock(vaddr,_2MB) == 0);
-   base_phys = virt_to_phys_user((unsigned long)vaddr);
-   for (offset=0;offset<_2MB;offset += PAGE_SIZE)
-   {  
-      phys = virt_to_phys_user((unsigned long)vaddr + offset);
-      if  (phys != (base_phys + offset ))
-           {
-		free(vaddr);
-		return NULL;
-          }
-   }
+
+   size = (size + _2MB - 1) & ~((unsigned long)_2MB - 1);
+   vaddr = memalign(_2MB,size);
    assert(vaddr != NULL);
-   memset((void *)vaddr,0x00,REMOTE_RING_SIZE);
+   assert(madvise(vaddr,size, MADV_HUGEPAGE) == 0);
+   bind_to_node(vaddr, size, node); // before mlock faults the pages in
+   assert(mlock(vaddr,size) == 0);
+   // a single extent means the whole range is physically contiguous
+   if (virt_to_phys_range(NULL, (uintptr_t)vaddr, size, &extent, 1) != 1)
+   {
+	munlock(vaddr,size);
+	free(vaddr);
+	return NULL;
+   }
+   memset((void *)vaddr,0x00,size);
    
    return vaddr;
 }
 
+void* get_contiguous__2MB(void)
+{
+   return get_contiguous_hugepages(_2MB);
+}
+
 void * get_contiguous__4KB(void)
 {
   void * vaddr = NULL;
@@ -167,9 +297,64 @@ void * get_contiguous__4KB(void)
 }
    
 
+// Transport chosen by vca_mem_set_transport or the environment, see get_transport
+typedef struct vca_transport vca_transport;
+static const vca_transport *transport;
+static int loopback_transport(void);
+static int loopback_platform = HOST; // HOST or CARD, decided by the side that connects
+static int loopback_card_socket;
+
+// sgx5 mapper devices, probed once; without them the sysfs files and shell commands are used
+static int sgx5_fds[VCA_SOCKETS];
+static struct sgx5_platform_info sgx5_info;
+static int sgx5_state; // 0 not probed yet, 1 devices found, -1 none
+
+static void sgx5_probe(void)
+{
+   char path[64];
+   int i;
+
+   sgx5_state = -1;
+   for (i = 0; i < VCA_SOCKETS; i++) {
+      snprintf(path, sizeof(path), "/dev/" SGX5_DEVICE_NAME, i);
+      sgx5_fds[i] = open(path, O_RDWR | O_CLOEXEC);
+      if (sgx5_fds[i] >= 0 && sgx5_state < 0 && ioctl(sgx5_fds[i], SGX5_IOC_PLATFORM, &sgx5_info) == 0)
+         sgx5_state = 1;
+   }
+}
+
+// mapper device for socket; a card only has the one for itself
+static int sgx5_device(int socket)
+{
+   if (sgx5_state == 0)
+      sgx5_probe();
+   if (sgx5_state < 0)
+      return -1;
+
+   if (sgx5_info.platform == SGX5_PLATFORM_CARD)
+      socket = sgx5_info.socket;
+   if (socket < 0 || socket >= VCA_SOCKETS)
+      return -1;
+
+   return sgx5_fds[socket];
+}
+
 int get_local_platform_type(void)
 {
-   return system("lsmod | grep 'vca_mgr ' > /dev/null");	
+   static int platform = -1;
+
+   if (likely(platform >= 0))
+      return platform;
+   if (loopback_transport())
+      return loopback_platform;
+
+   sgx5_device(0);
+   if (sgx5_state > 0)
+      platform = (sgx5_info.platform == SGX5_PLATFORM_HOST) ? HOST : CARD;
+   else
+      platform = system("lsmod | grep 'vca_mgr ' > /dev/null") ? CARD : HOST;
+
+   return platform;
 }
 
 // TODO: assumes single digit number of CPUs (max 3 SGX cards)
@@ -178,6 +363,12 @@ int get_card_self_socket_number(void)
         char hostname[256];
 	int hn_len = 0;
         int card_cpu = 0, card_id = 0;
+
+        if (loopback_transport())
+                return loopback_card_socket;
+        if (sgx5_device(-1) >= 0 && sgx5_info.platform == SGX5_PLATFORM_CARD)
+                return sgx5_info.socket;
+
         hostname[255] = '\0';
         gethostname(hostname,255);
 	hn_len = strnlen(hostname, 256);
@@ -187,6 +378,78 @@ int get_card_self_socket_number(void)
         return card_id * 3 + card_cpu; //Card socket can only see 1 host socket so /tmp/pipe_0 will always be used
 }
 
+int vca_socket_numa_node(int socket)
+{
+   struct sgx5_platform_info info;
+   char path[64];
+   FILE *fp;
+   int node = -1, fd;
+
+   if (loopback_transport())
+      return -1;
+   if (socket == -1)
+      socket = get_card_self_socket_number();
+
+   if ((fd = sgx5_device(socket)) >= 0 && ioctl(fd, SGX5_IOC_PLATFORM, &info) == 0)
+      return info.numa_node;
+
+   snprintf(path, sizeof(path), "/sys/kernel/sgx5_mapper_%d/numa_node", socket);
+   if ((fp = fopen(path, "r")) != NULL) {
+      if (fscanf(fp, "%d", &node) != 1)
+         node = -1;
+      fclose(fp);
+   }
+   return node;
+}
+
+int vca_socket_cpuset(int socket, cpu_set_t *cpus)
+{
+   char path[64], list[BUFSIZ], *p = list, *end;
+   int node = vca_socket_numa_node(socket);
+   long first, last, cpu;
+   FILE *fp;
+
+   CPU_ZERO(cpus);
+   snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+   if (node >= 0 && (fp = fopen(path, "r")) != NULL) {
+      // ranges like 0-7,16-23
+      if (fgets(list, sizeof(list), fp) != NULL) {
+         while ((first = strtol(p, &end, 10)) >= 0 && end != p) {
+            last = (*end == '-') ? strtol(end + 1, &end, 10) : first;
+            for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+               CPU_SET(cpu, cpus);
+            if (*end != ',')
+               break;
+            p = end + 1;
+         }
+      }
+      fclose(fp);
+   }
+
+   if (CPU_COUNT(cpus) == 0)
+      for (cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++)
+         CPU_SET(cpu, cpus);
+
+   return CPU_COUNT(cpus);
+}
+
+int vca_pin_thread(int socket, int n)
+{
+   cpu_set_t cpus, one;
+   int count = vca_socket_cpuset(socket, &cpus), cpu;
+
+   if (n >= 0) {
+      n %= count;
+      for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+         if (CPU_ISSET(cpu, &cpus) && n-- == 0)
+            break;
+      CPU_ZERO(&one);
+      CPU_SET(cpu, &one);
+      cpus = one;
+   }
+
+   return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) ? GENERAL_ERROR : 0;
+}
 
 void execute(const char *fmt, ...) {
     char command[MAX_COMMAND_LEN] = {0,};
@@ -206,9 +469,15 @@ void initialize_system(const char * ip, const char * port, int * socket)
   // is the system already initialized?
   if(!c && !context) {
 
+    // in loopback the side that connects plays the card
+    if (loopback_transport())
+      loopback_platform = (*socket == -1 || *socket == -3) ? CARD : HOST;
+
     // form the ip name and port as a string
     if(ip && port > 0) {
       snprintf(ipname, 256, "tcp://%s:%s", ip, port);
+    } else if (loopback_transport()) {
+      snprintf(ipname, 256, "tcp://127.0.0.1:%s", (port) ? port : VCA_HOST_PORT);
     } else {
       // no ip or port specified, use defaults from the table
       if(*socket > -1 && *socket < 6)
@@ -291,8 +560,8 @@ int send_recv_mapping(transfer_mapping * in, transfer_mapping * out, int socket)
   
   if (get_local_platform_type() == HOST) {
     rc = request_sharing(out, ZMQ_RECV);
-    // ensure we talk to the correct socket
-    if (out->socket != socket) {
+    // ensure we talk to the correct socket, about the same queue pair
+    if (out->socket != socket || out->pair != in->pair) {
       request_sharing(&error_map, ZMQ_SEND);
       return 1; // retry wrong socket connected
     }
@@ -332,6 +601,8 @@ int share_local_memory(int socket, void *ptr, unsigned long size, int mapping_ty
   assert(size % PAGE_SIZE == 0);
   assert((mapping_type == READ) || (mapping_type == WRITE));
 
+  memset(&tq, 0, sizeof(transfer_mapping));
+  tq.params.layout = RING_LAYOUT_VERSION;
   tq.physical_addr = physical_base;
   tq.size = size;
   tq.mapping_type = mapping_type;
@@ -362,6 +633,11 @@ int recv_remote_data(int * socket, unsigned long *remote_physical, unsigned long
   if (*socket == -1) 
     *socket = get_card_self_socket_number();
 
+  // the host checks socket and pair of what it gets, the legacy handshake is pair 0
+  memset(&in, 0, sizeof(transfer_mapping));
+  memset(&map, 0, sizeof(transfer_mapping));
+  in.socket = *socket;
+
   do {
     rc = send_recv_mapping(&in, &map, *socket);
   } while (rc);
@@ -379,8 +655,17 @@ unsigned long get_local_mapping(int socket, int mapping_number ) {
     char command[MAX_COMMAND_LEN] = {0,};    
     char result[BUFSIZ] = {0,};
     unsigned long remote_base, size, local_base;
+    struct sgx5_map_req req = { .map = mapping_number };
     FILE *fp;
+    int fd;
 
+    if ((fd = sgx5_device(socket)) >= 0) {
+      if (ioctl(fd, SGX5_IOC_QUERY, &req) != 0) {
+        perror("sgx5 query");
+        return -1;
+      }
+      return req.local_phys_addr;
+    }
     
     if(get_local_platform_type() != HOST)
       socket = 0;
@@ -408,6 +693,8 @@ int setup_mtrr_mappings(unsigned long base, unsigned long size, int remote_acces
 {
         unsigned long i = PAGE_SIZE;
         char caching_type[BUFSIZ] = {0,};
+        struct sgx5_cache_req req;
+        int fd = sgx5_device(0);
 
         assert((base % PAGE_SIZE) == 0);
         assert((size % PAGE_SIZE) == 0);
@@ -424,6 +711,16 @@ int setup_mtrr_mappings(unsigned long base, unsigned long size, int remote_acces
                  strncpy(caching_type, "write-combining", BUFSIZ);
 
         printf("Calculated base=0x%lx size=0x%lx type=%s mapping for MTRR\n",base,size,caching_type);
+
+        if (fd >= 0) {
+                req.base = base;
+                req.size = size;
+                req.type = (remote_access_type == WRITE) ? SGX5_CACHE_WRITE_COMBINING : SGX5_CACHE_WRITE_THROUGH;
+                if (ioctl(fd, SGX5_IOC_SET_CACHING, &req) == 0)
+                        return 0;
+                perror("sgx5 set caching, trying /proc/mtrr");
+        }
+
         execute("echo \"base=0x%lx size=0x%lx type=%s\" > /proc/mtrr",base,size,caching_type);
         return 0;
 }
@@ -431,12 +728,22 @@ int setup_mtrr_mappings(unsigned long base, unsigned long size, int remote_acces
 
 unsigned long setup_local_mappings(int socket, int mapping_number, unsigned long base, unsigned long size)
 {
-  
+  struct sgx5_map_req req = { .map = mapping_number, .remote_phys_addr = base, .len = size };
+  int fd;
   
   assert((base % PAGE_SIZE) == 0);
   assert((size % PAGE_SIZE) == 0);
   if (socket == -1) 
     socket = get_card_self_socket_number();
+
+  if ((fd = sgx5_device(socket)) >= 0) {
+    // replaces whatever the slot held, no shell and no sysfs round trip
+    if (ioctl(fd, SGX5_IOC_MAP, &req) != 0) {
+      perror("sgx5 map");
+      return 0;
+    }
+    return req.local_phys_addr;
+  }
   
   if(get_local_platform_type() != HOST)
     socket = 0;
@@ -470,16 +777,89 @@ void*  map_phys_memory(unsigned long phys, unsigned long size) {
 
 
 
+// Mappings made through a mapper device, so unmap_remote_memory can hand them back
+struct device_mapping {
+  LIST_ENTRY(device_mapping) entry;
+  void *addr;
+  unsigned long len;
+  unsigned long phys; // in the aperture
+  int fd;
+  unsigned int map;
+};
+
+static LIST_HEAD(, device_mapping) device_mappings = LIST_HEAD_INITIALIZER(device_mappings);
+static char device_mappings_lock;
+
+// Map phys/size through a map of the open file of the mapper, straight into our address space
+static void *map_device_memory(int fd, unsigned long phys, unsigned long size, int mapping_type)
+{
+  struct sgx5_map_req req = { .map = SGX5_MAP_ANY, .remote_phys_addr = phys, .len = size };
+  struct device_mapping *m;
+  void *ptr;
+
+  // the producer only writes the remote ring, everything else is read back
+  req.cache = (mapping_type == WRITE) ? SGX5_CACHE_WRITE_COMBINING : SGX5_CACHE_WRITE_THROUGH;
+  if (ioctl(fd, SGX5_IOC_MAP, &req) != 0)
+    return NULL;
+
+  ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, req.mmap_offset);
+  m = malloc(sizeof(*m));
+  if (ptr == MAP_FAILED || m == NULL) {
+    if (ptr != MAP_FAILED)
+      munmap(ptr, size);
+    free(m);
+    ioctl(fd, SGX5_IOC_UNMAP, &req);
+    return NULL;
+  }
+
+  m->addr = ptr;
+  m->len = size;
+  m->phys = req.local_phys_addr;
+  m->fd = fd;
+  m->map = req.map;
+  while (__atomic_test_and_set(&device_mappings_lock, __ATOMIC_ACQUIRE));
+  LIST_INSERT_HEAD(&device_mappings, m, entry);
+  __atomic_clear(&device_mappings_lock, __ATOMIC_RELEASE);
+
+  return ptr;
+}
+
+int unmap_remote_memory(void *ptr)
+{
+  struct sgx5_map_req req = { 0 };
+  struct device_mapping *m;
+  unsigned long page = (unsigned long)ptr & ~(PAGE_SIZE - 1UL);
+
+  while (__atomic_test_and_set(&device_mappings_lock, __ATOMIC_ACQUIRE));
+  LIST_FOREACH(m, &device_mappings, entry)
+    if ((unsigned long)m->addr == page)
+      break;
+  if (m != NULL)
+    LIST_REMOVE(m, entry);
+  __atomic_clear(&device_mappings_lock, __ATOMIC_RELEASE);
+
+  if (m == NULL)
+    return GENERAL_ERROR;
+
+  // the aperture window stays until both the map and the user mapping are gone
+  munmap(m->addr, m->len);
+  req.map = m->map;
+  ioctl(m->fd, SGX5_IOC_UNMAP, &req);
+  free(m);
+  return 0;
+}
+
 void* map_remote_memory(transfer_mapping * map, int socket, unsigned long request_size, int mapping_number) 
 {
   unsigned long local_physical, local_size, page_offset;
+  void *ptr;
+  int fd;
   
   if (get_local_platform_type() != HOST) //Workaround for bug in detectig CARD 
     socket = -1;
   
   assert(map->size % PAGE_SIZE == 0);
   assert(map->size == request_size);
-  assert(mapping_number < MAX_MAPPINGS_PER_VCA_SOCKET);
   assert((map->mapping_type == READ) || (map->mapping_type == WRITE));
   
   page_offset = map->physical_addr & 0xFFF;
@@ -489,6 +869,17 @@ void* map_remote_memory(transfer_mapping * map, int socket, unsigned long reques
   } else {
     local_size = map->size;
   }	
+
+  // a map of our own instead of the fixed slot, mapped without going through /dev/mem
+  if ((fd = sgx5_device(socket)) >= 0
+      && (ptr = map_device_memory(fd, map->physical_addr, local_size, map->mapping_type)) != NULL)
+    return (void *)((unsigned long)ptr + page_offset);
+
+  // the fixed slots only hold the queues of the first pair
+  if (mapping_number >= MAX_MAPPINGS_PER_VCA_SOCKET) {
+    printf("No map slot %d for socket %d, more queue pairs need the sgx5 mapper device\n", mapping_number, socket);
+    return NULL;
+  }
   
   local_physical = setup_local_mappings(socket,mapping_number, map->physical_addr, local_size);
 
@@ -498,386 +889,2742 @@ void* map_remote_memory(transfer_mapping * map, int socket, unsigned long reques
 }
 
 
-int allocate_ring(void ** addr_ptr, void * (*alloc) (), int size, transfer_mapping * map, int socket, int rem_prod) {
-  int i = 0;
-  
-  *addr_ptr = alloc();
-  
-  for (i=0; i< MAX_CHANNELS_PER_VCA_SOCKET; i++) {
-    ((unsigned long *)*addr_ptr)[rem_prod + 2*i] = (i * MAX_ITEMS);
-    ((unsigned long *)*addr_ptr)[rem_prod + (2*i) + 1] = i * MAX_ITEMS;
-  }
-
-  map->physical_addr = (unsigned long)virt_to_phys_user((unsigned long) *addr_ptr);
-  map->size = size;
-  map->mapping_type = REMOTE_WILL_WRITE;
-  map->socket = socket;
-
-  assert(map->physical_addr != 0);
-  assert(map->size % PAGE_SIZE == 0);
-  assert(map->mapping_type == READ || map->mapping_type == WRITE);
-
-  return 0;
-}
+// Memory of the loopback transport: our own memfd, kept open for the peer to map, or memory of the peer (fd -1)
+struct loopback_mapping {
+  LIST_ENTRY(loopback_mapping) entry;
+  void *addr;
+  unsigned long len;
+  int fd;
+};
 
-queue_object *init_dequeue(int socket) {
-  int i = 0, rc = 0;
-  transfer_mapping in, out;
-  
-  if(c == NULL) {
-    printf("No connection, initialize system first\n");
-    exit(1);
-  }
-  
-  if (get_local_platform_type() == HOST) {
-    printf("Local Platform is HOST\n");
-    assert(socket < VCA_SOCKETS);
-  } else {
-    printf("Local Platform is CARD\n");
-    socket = get_card_self_socket_number();
-  }
+static LIST_HEAD(, loopback_mapping) loopback_mappings = LIST_HEAD_INITIALIZER(loopback_mappings);
+static char loopback_mappings_lock;
 
-  assert(socket >= 0 && host_vca_ip_array[!get_local_platform_type()][socket] != NULL);
-  
-  queue_object *q = malloc(sizeof(queue_object));
-  assert(q != NULL);
+static void *loopback_mmap(int fd, unsigned long size, int owned)
+{
+  struct loopback_mapping *m = malloc(sizeof(*m));
+  void *ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
 
-  if (allocate_ring(&q->ring_2mb, get_contiguous__2MB, _2MB, &in, socket, REMOTE_PRODUCER)) {
-    free(q);
+  if (ptr == MAP_FAILED || m == NULL) {
+    if (ptr != MAP_FAILED)
+      munmap(ptr, size);
+    free(m);
     return NULL;
   }
-  
-  do {
-    rc = send_recv_mapping(&in, &out, socket);
-  } while(rc);
-  
-  q->ring_4kb = map_remote_memory(&out, socket, PAGE_SIZE, DEQUEUE_MAP_NUMBER);
-  q->queue_type = DEQUEUE_MAP_NUMBER;
-  q->socket = socket;
 
-  return q;
+  m->addr = ptr;
+  m->len = size;
+  m->fd = owned ? fd : -1;
+  while (__atomic_test_and_set(&loopback_mappings_lock, __ATOMIC_ACQUIRE));
+  LIST_INSERT_HEAD(&loopback_mappings, m, entry);
+  __atomic_clear(&loopback_mappings_lock, __ATOMIC_RELEASE);
+
+  return ptr;
 }
 
-queue_object * init_enqueue(int socket) {
-  int i = 0, rc = 0;
-  transfer_mapping in, out;
+static struct loopback_mapping *loopback_find(void *ptr, int remove)
+{
+  struct loopback_mapping *m;
 
-  if(c == NULL) {
-    printf("No connection, initialize system first\n");
-    exit(1);
-  }
-  
-  if (get_local_platform_type() == HOST) {
-    printf("Local Platform is HOST\n");
-    assert(socket < VCA_SOCKETS);
-  } else {
-    printf("Local Platform is CARD\n");
-    socket = get_card_self_socket_number();
-  }
-  
-  queue_object *q = malloc(sizeof(queue_object));
-  assert(q != NULL);
+  while (__atomic_test_and_set(&loopback_mappings_lock, __ATOMIC_ACQUIRE));
+  LIST_FOREACH(m, &loopback_mappings, entry)
+    if (m->addr == ptr)
+      break;
+  if (m != NULL && remove)
+    LIST_REMOVE(m, entry);
+  __atomic_clear(&loopback_mappings_lock, __ATOMIC_RELEASE);
 
-  if (allocate_ring(&q->ring_4kb, get_contiguous__4KB, PAGE_SIZE, &in, socket, 0)) {
-    free(q);
-    return NULL;
-  }
-  
-  do { 
-    rc = send_recv_mapping(&in, &out, socket);
-  } while (rc);
-    
-  q->ring_2mb = map_remote_memory(&out,socket, _2MB, ENQUEUE_MAP_NUMBER);
-  q->queue_type = ENQUEUE_MAP_NUMBER;
-  q->socket = socket;
-  
-  printf("Init split enqueue done : _2MB pointer %p 4KB pointer %p \n",q->ring_2mb,
-	 q->ring_4kb);
-  
-  return q;
+  return m;
 }
 
-void free_queue(queue_object *q)
+static void *loopback_alloc(int socket, unsigned long size)
 {
-	assert(q != NULL);
-	if (q->queue_type == DEQUEUE_MAP_NUMBER) {
-		assert(q->ring_2mb != NULL);
-		free(q->ring_2mb);
-	} else if (q->queue_type == ENQUEUE_MAP_NUMBER) {
-		assert(q->ring_4kb != NULL);
-		free(q->ring_4kb);
-	}
+  const unsigned int flags[2] = { MFD_CLOEXEC | MFD_HUGETLB, MFD_CLOEXEC };
+  void *ptr = NULL;
+  int i, fd;
+
+  // huge pages when the ring takes whole ones and enough are reserved, ordinary shared memory
+  // otherwise; a memfd starts out zeroed
+  for (i = (size % _2MB) ? 1 : 0; i < 2 && ptr == NULL; i++) {
+    if ((fd = memfd_create("vca_ring", flags[i])) < 0)
+      continue;
+    if (ftruncate(fd, size) != 0 || (ptr = loopback_mmap(fd, size, 1)) == NULL)
+      close(fd);
+  }
 
-	free(q);
+  return ptr;
 }
 
-
-
-void *init_host_task_system(void *opq, const char * ip, const char * port, int * socket)
+static int loopback_unmap(void *ptr)
 {
-   task_queue_opaque *opaque = opq;
-   unsigned int i = 0;
-   assert(*socket < VCA_SOCKETS);
-   if (opaque == NULL) {
-   	opaque = (task_queue_opaque *) malloc(sizeof(task_queue_opaque));  
-	assert(opaque != NULL);
-	memset(opaque, 0, sizeof(task_queue_opaque));
-   	opaque->next_recv_channel = 0;
-   	opaque->next_submit_channel = 0;
-        opaque->next_recv_socket = 0;
-        opaque->next_submit_socket = 0;
-	opaque->total_sockets = 0;
-	for(i = 0; i < VCA_SOCKETS; i++)
-	  opaque->active_sockets[i] = -1;
-   } 
+  struct loopback_mapping *m = loopback_find(ptr, 1);
 
-   initialize_system(ip, port, socket); // may update the socket, depending on who connects
-   opaque->active_sockets[opaque->total_sockets++] = *socket;
-   printf("\nInitializing communication with worker on socket %d\n",*socket);
-   opaque->tx_q_objs[*socket] = init_enqueue(*socket);
-   assert(opaque->tx_q_objs[*socket] != NULL);
-   opaque->rx_q_objs[*socket] = init_dequeue(*socket);
-   assert(opaque->rx_q_objs[*socket] != NULL);
-   return opaque;
-}
+  if (m == NULL)
+    return GENERAL_ERROR;
 
-void *init_vca_task_system(const char * ip, const char * port, int * socket)
-{
-  task_queue_opaque *opaque;
-  opaque = (task_queue_opaque *) malloc(sizeof(task_queue_opaque));
-  memset(opaque, 0, sizeof(task_queue_opaque));
-  assert(opaque != NULL);
-  initialize_system(ip, port, socket);
-  opaque->rx_q_objs[0] = init_dequeue(-1);
-  assert(opaque->rx_q_objs[0] != NULL);
-  opaque->tx_q_objs[0] = init_enqueue(-1);
-  assert(opaque->tx_q_objs[0] != NULL);
-  return opaque;
+  munmap(m->addr, m->len);
+  if (m->fd >= 0)
+    close(m->fd);
+  free(m);
+  return 0;
 }
 
-
-void deinit_vca_task_system(void *opq)
+static void loopback_release(void *ptr)
 {
- int i = 0;  
- task_queue_opaque *opaque = opq;
- assert(opaque != NULL);
- 
- printf("\nTearing down communication with workers\n");
- for (i = 0; i < VCA_SOCKETS; i++) {
-   if(opaque->rx_q_objs[i])
-     free_queue(opaque->rx_q_objs[i]);
-   if(opaque->tx_q_objs[i])
-     free_queue(opaque->tx_q_objs[i]);
- }
- 
- free(opaque);
-
- zmq_close(c);
- zmq_ctx_destroy(context);
+  loopback_unmap(ptr);
 }
 
-#endif //NOT ENCLAVE MODE
-
-int s_variable_multi_enqueue(queue_object *queue_obj, void *source, unsigned int total_elements, unsigned int idx)
+static int loopback_export(void *ptr, transfer_mapping *map)
 {
+  struct loopback_mapping *m = loopback_find(ptr, 0);
 
-  unsigned long *ring = queue_obj->ring_2mb;
-  unsigned long *prod_cons_array = queue_obj->ring_4kb;
-  unsigned int real_idx = idx << 1;
-  unsigned int LP_VAL = (unsigned int) prod_cons_array[real_idx + LOCAL_PRODUCER];
-  unsigned int RC_VAL = prod_cons_array[real_idx + REMOTE_CONSUMER];
-  unsigned int LOWER_BOUND = idx << MAX_ITEMS_ORDER;
-  unsigned int UPPER_BOUND = LOWER_BOUND + MAX_ITEMS;
-  unsigned int max_dist, num_elements, remaining_elements, new_bound_val;
-  
-  max_dist = (RC_VAL-(LP_VAL+1)) % MAX_ITEMS;
-  num_elements = MIN(UPPER_BOUND-LP_VAL, total_elements);
-  remaining_elements = total_elements - num_elements;
-  new_bound_val = (unlikely(remaining_elements != 0))
-    ? LOWER_BOUND + remaining_elements
-    : LP_VAL + num_elements;
-  
-  if (likely(total_elements <= max_dist)) {
-    memcpy( (void *)(ring + LP_VAL), (void *)source, num_elements << 3);
-    asm volatile ("mfence" ::: "memory");
-    if (unlikely(remaining_elements != 0)) {
-      memcpy( (void *)(ring + LOWER_BOUND), (void *)((unsigned long)source + (num_elements << 3)), remaining_elements << 3);
-      asm volatile ("mfence" ::: "memory");
-      ring[real_idx + REMOTE_PRODUCER] = prod_cons_array[real_idx + LOCAL_PRODUCER] = LOWER_BOUND + remaining_elements;
-    } else {
-      ring[real_idx + REMOTE_PRODUCER] = prod_cons_array[real_idx + LOCAL_PRODUCER] = LP_VAL + num_elements;
-    }
-    
-    return total_elements;
-  }
-  
+  if (m == NULL || m->fd < 0)
+    return GENERAL_ERROR;
+
+  map->owner_pid = getpid();
+  map->owner_fd = m->fd;
   return 0;
 }
 
-int s_variable_multi_dequeue(queue_object *queue_obj, void *source, unsigned int max_requested, unsigned int idx)
+static void *loopback_map(transfer_mapping *map, int socket, unsigned long request_size, int mapping_number)
 {
+  char path[64];
+  void *ptr;
+  int fd;
 
- unsigned long *ring = queue_obj->ring_2mb;
- unsigned long *prod_cons_array = queue_obj->ring_4kb;
- unsigned int real_idx = idx << 1; //2x the idx value
- unsigned int LC_VAL = (unsigned int)ring[real_idx + LOCAL_CONSUMER];
- unsigned int RP_VAL = ring[real_idx + REMOTE_PRODUCER];
- unsigned int LOWER_BOUND = idx << MAX_ITEMS_ORDER;
- unsigned int UPPER_BOUND = LOWER_BOUND + MAX_ITEMS;
- unsigned int max_available, num_elements, remaining_elements, i = 0;
+  assert(map->size == request_size);
 
-#ifdef HOST_MODE
-        asm volatile ("mfence" ::: "memory");
+  // a fresh open of the peer's memfd; the mapping keeps the memory after the close
+  snprintf(path, sizeof(path), "/proc/%d/fd/%d", map->owner_pid, map->owner_fd);
+  if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+    perror(path);
+    return NULL;
+  }
+  ptr = loopback_mmap(fd, map->size, 0);
+  close(fd);
+
+  return ptr;
+}
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#define _1GB 0x40000000UL
+
+// Rings of the PCIe transport have to be physically contiguous, which THP only delivers while memory is not
+// fragmented. Huge pages reserved through vm.nr_hugepages (2MB, then 1GB ones) and DMA buffers of the sgx5
+// driver always are, THP is the last resort. Rings of freed queues wait in a pool for the next queue of the
+// same size and node instead of going back to the system
+#define RING_SOURCE_HUGETLB 0
+#define RING_SOURCE_DMA 1
+#define RING_SOURCE_THP 2
+#define RING_POOL_MAX 8
+#define DMA_COPY_MIN (64 * 1024) // smaller copies are done sooner by the CPU than by the ioctl
+
+struct pcie_ring {
+  LIST_ENTRY(pcie_ring) entry;
+  void *addr;
+  unsigned long size; // as asked for
+  unsigned long len; // as mapped
+  unsigned long phys;
+  int node;
+  int source;
+  int fd; // mapper device and map of a DMA buffer
+  unsigned int map;
+};
+
+static LIST_HEAD(, pcie_ring) pcie_rings = LIST_HEAD_INITIALIZER(pcie_rings);
+static LIST_HEAD(, pcie_ring) pcie_ring_pool = LIST_HEAD_INITIALIZER(pcie_ring_pool);
+static unsigned int pcie_ring_pool_size, pcie_ring_pool_max = RING_POOL_MAX;
+static char pcie_rings_lock;
+
+static void *hugetlb_alloc(unsigned long size, unsigned long page, int node, struct pcie_ring *r)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | ((page == _1GB) ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+  unsigned long len = (size + page - 1) & ~(page - 1), off;
+  phys_extent extent;
+  void *ptr;
+
+  // fails right away without enough pages reserved, private mappings reserve theirs up front
+  ptr = mmap(0, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+
+  bind_to_node(ptr, len, node);
+  for (off = 0; off < len; off += page)
+    ((volatile char *)ptr)[off] = 0;
+
+  // a single page always is contiguous, neighbouring ones only by chance
+  if (virt_to_phys_range(NULL, (uintptr_t)ptr, len, &extent, 1) != 1) {
+    munmap(ptr, len);
+    return NULL;
+  }
+
+  r->len = len;
+  r->phys = extent.phys;
+  r->source = RING_SOURCE_HUGETLB;
+  return ptr;
+}
+
+static void *dma_alloc(int socket, unsigned long size, struct pcie_ring *r)
+{
+  struct sgx5_dma_req req = { .len = size };
+  struct sgx5_map_req unmap = { 0 };
+  void *ptr;
+  int fd;
+
+  if ((fd = sgx5_device(socket)) < 0 || ioctl(fd, SGX5_IOC_DMA_ALLOC, &req) != 0)
+    return NULL;
+
+  ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, req.mmap_offset);
+  if (ptr == MAP_FAILED) {
+    unmap.map = req.map;
+    ioctl(fd, SGX5_IOC_UNMAP, &unmap);
+    return NULL;
+  }
+
+  r->len = size;
+  r->phys = req.dma_addr;
+  r->source = RING_SOURCE_DMA;
+  r->fd = fd;
+  r->map = req.map;
+  return ptr;
+}
+
+static void pcie_ring_free(struct pcie_ring *r)
+{
+  struct sgx5_map_req req = { 0 };
+
+  if (r->source == RING_SOURCE_HUGETLB) {
+    munmap(r->addr, r->len);
+  } else if (r->source == RING_SOURCE_DMA) {
+    // the buffer goes with the map and the user mapping both
+    munmap(r->addr, r->len);
+    req.map = r->map;
+    ioctl(r->fd, SGX5_IOC_UNMAP, &req);
+  } else {
+    munlock(r->addr, r->len);
+    free(r->addr);
+  }
+  free(r);
+}
+
+static void *pcie_ring_alloc(int socket, unsigned long size, int node)
+{
+  struct pcie_ring *r;
+  void *ptr = NULL;
+
+  while (__atomic_test_and_set(&pcie_rings_lock, __ATOMIC_ACQUIRE));
+  LIST_FOREACH(r, &pcie_ring_pool, entry)
+    if (r->size == size && r->node == node)
+      break;
+  if (r != NULL) {
+    LIST_REMOVE(r, entry);
+    pcie_ring_pool_size--;
+    LIST_INSERT_HEAD(&pcie_rings, r, entry);
+  }
+  __atomic_clear(&pcie_rings_lock, __ATOMIC_RELEASE);
+
+  if (r != NULL) {
+    memset(r->addr, 0, r->size);
+    return r->addr;
+  }
+
+  r = malloc(sizeof(*r));
+  assert(r != NULL);
+  memset(r, 0, sizeof(*r));
+
+  ptr = hugetlb_alloc(size, _2MB, node, r);
+  if (ptr == NULL && size > _2MB && size <= _1GB)
+    ptr = hugetlb_alloc(size, _1GB, node, r);
+  if (ptr == NULL)
+    ptr = dma_alloc(socket, size, r);
+  if (ptr == NULL && (ptr = get_contiguous_hugepages_node(size, node)) != NULL) {
+    r->len = (size + _2MB - 1) & ~((unsigned long)_2MB - 1);
+    r->phys = virt_to_phys_user((uintptr_t)ptr);
+    r->source = RING_SOURCE_THP;
+  }
+  if (ptr == NULL) {
+    free(r);
+    return NULL;
+  }
+
+  r->addr = ptr;
+  r->size = size;
+  r->node = node;
+  while (__atomic_test_and_set(&pcie_rings_lock, __ATOMIC_ACQUIRE));
+  LIST_INSERT_HEAD(&pcie_rings, r, entry);
+  __atomic_clear(&pcie_rings_lock, __ATOMIC_RELEASE);
+
+  return ptr;
+}
+
+static struct pcie_ring *pcie_ring_find(void *ptr)
+{
+  struct pcie_ring *r;
+
+  while (__atomic_test_and_set(&pcie_rings_lock, __ATOMIC_ACQUIRE));
+  LIST_FOREACH(r, &pcie_rings, entry)
+    if (r->addr == ptr)
+      break;
+  __atomic_clear(&pcie_rings_lock, __ATOMIC_RELEASE);
+
+  return r;
+}
+
+// Copy from a ring of ours into an aperture window with the DMA engine of the PLX device the window
+// goes through, so the CPU stays off the data. Fails if either side is something else, the copy is
+// too small to pay for the ioctl, or the driver has no DMA channel
+static int pcie_dma_broken;
+
+static int pcie_dma_copy(void *dst, const void *src, unsigned long len)
+{
+  struct sgx5_copy_req req = { .len = len };
+  struct device_mapping *m;
+  struct pcie_ring *r;
+  int fd = -1;
+
+  if (len < DMA_COPY_MIN || pcie_dma_broken)
+    return GENERAL_ERROR;
+
+  while (__atomic_test_and_set(&device_mappings_lock, __ATOMIC_ACQUIRE));
+  LIST_FOREACH(m, &device_mappings, entry)
+    if ((char *)dst >= (char *)m->addr && (char *)dst + len <= (char *)m->addr + m->len) {
+      req.dst = m->phys + ((char *)dst - (char *)m->addr);
+      fd = m->fd;
+      break;
+    }
+  __atomic_clear(&device_mappings_lock, __ATOMIC_RELEASE);
+
+  while (__atomic_test_and_set(&pcie_rings_lock, __ATOMIC_ACQUIRE));
+  LIST_FOREACH(r, &pcie_rings, entry)
+    if ((const char *)src >= (char *)r->addr && (const char *)src + len <= (char *)r->addr + r->size) {
+      if (r->phys != 0)
+        req.src = r->phys + ((const char *)src - (char *)r->addr);
+      break;
+    }
+  __atomic_clear(&pcie_rings_lock, __ATOMIC_RELEASE);
+
+  if (fd < 0 || req.src == 0)
+    return GENERAL_ERROR;
+
+  if (ioctl(fd, SGX5_IOC_DMA_COPY, &req) != 0) {
+    // an older driver or a PLX without DMA channel, don't ask again
+    if (errno == ENOTTY || errno == ENODEV || errno == EPERM)
+      pcie_dma_broken = 1;
+    return GENERAL_ERROR;
+  }
+  return 0;
+}
+
+// memory next to the PLX device, which writes into it and whose neighbours read it
+static void *pcie_alloc(int socket, unsigned long size)
+{
+  int node = vca_socket_numa_node(socket);
+  void *ptr;
+
+  if (size != PAGE_SIZE)
+    return pcie_ring_alloc(socket, size, node);
+
+  // a single page can still move, its physical address is only taken by export
+  ptr = get_contiguous__4KB();
+  bind_to_node(ptr, PAGE_SIZE, node);
+  return ptr;
+}
+
+static void pcie_release(void *ptr)
+{
+  struct pcie_ring *r;
+  int pooled = 0;
+
+  while (__atomic_test_and_set(&pcie_rings_lock, __ATOMIC_ACQUIRE));
+  LIST_FOREACH(r, &pcie_rings, entry)
+    if (r->addr == ptr)
+      break;
+  if (r != NULL) {
+    LIST_REMOVE(r, entry);
+    if (pcie_ring_pool_size < pcie_ring_pool_max) {
+      LIST_INSERT_HEAD(&pcie_ring_pool, r, entry);
+      pcie_ring_pool_size++;
+      pooled = 1;
+    }
+  }
+  __atomic_clear(&pcie_rings_lock, __ATOMIC_RELEASE);
+
+  if (r == NULL)
+    free(ptr); // an index page
+  else if (!pooled)
+    pcie_ring_free(r);
+}
+
+static int pcie_export(void *ptr, transfer_mapping *map)
+{
+  struct pcie_ring *r = pcie_ring_find(ptr);
+
+  // a DMA buffer goes by the address the device sees, which need not be the physical one
+  map->physical_addr = r ? r->phys : (unsigned long)virt_to_phys_user((unsigned long)ptr);
+  return (map->physical_addr != 0 && map->physical_addr != (unsigned long)-1) ? 0 : GENERAL_ERROR;
+}
+
+void vca_mem_drain_ring_pool(void)
+{
+  struct pcie_ring *r;
+
+  do {
+    while (__atomic_test_and_set(&pcie_rings_lock, __ATOMIC_ACQUIRE));
+    if ((r = LIST_FIRST(&pcie_ring_pool)) != NULL) {
+      LIST_REMOVE(r, entry);
+      pcie_ring_pool_size--;
+    }
+    __atomic_clear(&pcie_rings_lock, __ATOMIC_RELEASE);
+    if (r != NULL)
+      pcie_ring_free(r);
+  } while (r != NULL);
+}
+
+// How the memory of the rings gets to the other side. alloc hands out zeroed memory for socket that the peer
+// can map once export has described it in the transfer_mapping of the handshake
+typedef struct vca_transport {
+  unsigned int id;
+  void *(*alloc)(int socket, unsigned long size);
+  void (*release)(void *ptr);
+  int (*export)(void *ptr, transfer_mapping *map);
+  void *(*map)(transfer_mapping *map, int socket, unsigned long request_size, int mapping_number);
+  int (*unmap)(void *ptr);
+} vca_transport;
+
+static const vca_transport transports[] = {
+  [VCA_TRANSPORT_PCIE] = { VCA_TRANSPORT_PCIE, pcie_alloc, pcie_release, pcie_export, map_remote_memory, unmap_remote_memory },
+  [VCA_TRANSPORT_LOOPBACK] = { VCA_TRANSPORT_LOOPBACK, loopback_alloc, loopback_release, loopback_export,
+			       loopback_map, loopback_unmap },
+};
+
+static const vca_transport *get_transport(void)
+{
+  const char *env;
+
+  if (likely(transport != NULL))
+    return transport;
+
+  transport = &transports[VCA_TRANSPORT_PCIE];
+  if ((env = getenv("VCA_TRANSPORT")) != NULL && strncmp(env, "loopback", 8) == 0) {
+    transport = &transports[VCA_TRANSPORT_LOOPBACK];
+    loopback_card_socket = (env[8] == ':') ? atoi(env + 9) : 0;
+    assert(loopback_card_socket >= 0 && loopback_card_socket < VCA_SOCKETS);
+  }
+
+  return transport;
+}
+
+static int loopback_transport(void)
+{
+  return get_transport()->id == VCA_TRANSPORT_LOOPBACK;
+}
+
+int vca_mem_set_transport(int id, int card_socket)
+{
+  if (c != NULL || id < VCA_TRANSPORT_PCIE || id > VCA_TRANSPORT_LOOPBACK
+      || card_socket < 0 || card_socket >= VCA_SOCKETS)
+    return GENERAL_ERROR;
+
+  transport = &transports[id];
+  loopback_card_socket = card_socket;
+  return 0;
+}
+
+// Map the peer's half of the queue, which has to come over the same transport
+static void *transport_map(queue_object *q, transfer_mapping *out, int socket, unsigned long size, int mapping_number)
+{
+  if (out->transport != q->transport->id) {
+    printf("Transport mismatch with socket %d: %u here, %u there\n", socket, q->transport->id, out->transport);
+    return NULL;
+  }
+
+  return q->transport->map(out, socket, size, mapping_number);
+}
+
+static int copy_kernel_supported(int kernel)
+{
+  __builtin_cpu_init();
+  if (kernel == COPY_KERNEL_AVX512)
+    return __builtin_cpu_supports("avx512f");
+  if (kernel == COPY_KERNEL_AVX2)
+    return __builtin_cpu_supports("avx2");
+  return kernel == COPY_KERNEL_MEMCPY;
+}
+
+// Non-temporal stores only pay off where the other side cannot read the payload out of our cache anyway
+int queue_set_copy_kernel(queue_object *queue_obj, int kernel)
+{
+  static const char *names[] = { [COPY_KERNEL_MEMCPY] = "memcpy", [COPY_KERNEL_AVX2] = "avx2", [COPY_KERNEL_AVX512] = "avx512" };
+  const char *env;
+  int i;
+
+  if (kernel == COPY_KERNEL_AUTO) {
+    kernel = COPY_KERNEL_MEMCPY;
+    if (queue_obj->transport != NULL && queue_obj->transport->id == VCA_TRANSPORT_PCIE)
+      kernel = copy_kernel_supported(COPY_KERNEL_AVX512) ? COPY_KERNEL_AVX512
+	: copy_kernel_supported(COPY_KERNEL_AVX2) ? COPY_KERNEL_AVX2 : COPY_KERNEL_MEMCPY;
+    if ((env = getenv("VCA_COPY_KERNEL")) != NULL)
+      for (i = COPY_KERNEL_MEMCPY; i <= COPY_KERNEL_AVX512; i++)
+	if (strcmp(env, names[i]) == 0 && copy_kernel_supported(i))
+	  kernel = i;
+  }
+
+  if (!copy_kernel_supported(kernel))
+    return GENERAL_ERROR;
+
+  queue_obj->copy_kernel = kernel;
+  return 0;
+}
+
+// validate params and derive the ring layout of q from them
+static int set_queue_params(queue_object *q, const queue_params *params)
+{
+  unsigned long data_size;
+  unsigned int layout = params->layout ? params->layout : RING_LAYOUT_VERSION;
+
+  if (layout < RING_LAYOUT_PACKED || layout > RING_LAYOUT_VERSION)
+    return GENERAL_ERROR;
+  if (params->channels == 0 || params->channels > MAX_QUEUE_CHANNELS)
+    return GENERAL_ERROR;
+  if (params->slot_size < sizeof(unsigned long) || params->slot_size > BUFF_SIZE_BOUNDARY
+      || (params->slot_size & (params->slot_size - 1)))
+    return GENERAL_ERROR;
+  // a channel has to hold at least a task header and one burst
+  if (params->slots < 2 * (BUFF_SIZE_BOUNDARY / params->slot_size) || (params->slots & (params->slots - 1)))
+    return GENERAL_ERROR;
+  if ((unsigned long)params->channels * params->slots > UINT_MAX)
+    return GENERAL_ERROR;
+  if (params->framing > FRAMING_COMPACT)
+    return GENERAL_ERROR;
+
+  data_size = (unsigned long)params->channels * params->slots * params->slot_size;
+
+  q->channels = params->channels;
+  q->slots = params->slots;
+  q->slots_order = __builtin_ctz(params->slots);
+  q->slot_order = __builtin_ctz(params->slot_size);
+  q->layout = layout;
+  q->framing = params->framing;
+  if (layout == RING_LAYOUT_PACKED) {
+    q->index_shift = 1;
+    q->consumer_word = 1;
+  } else {
+    // one line for the producer and one for the consumer index of each channel
+    q->index_shift = __builtin_ctz((2 * CACHE_LINE_SIZE) / sizeof(unsigned long));
+    q->consumer_word = CACHE_LINE_SIZE / sizeof(unsigned long);
+  }
+  // the ready flags take whole cache lines behind the channel indices
+  q->ready_offset = (layout >= RING_LAYOUT_READY) ? ((unsigned long)params->channels << q->index_shift) : 0;
+  q->index_size = (((unsigned long)params->channels << q->index_shift) * sizeof(unsigned long)
+		   + (q->ready_offset ? ((params->channels + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1)) : 0)
+		   + PAGE_SIZE - 1) & ~((unsigned long)PAGE_SIZE - 1);
+  q->index_offset = data_size / sizeof(unsigned long);
+  q->ring_size = (data_size + q->index_size + _2MB - 1) & ~((unsigned long)_2MB - 1);
+
+  return 0;
+}
+
+// index region of the most channels under the newest layout, what any peer geometry fits in
+static unsigned long max_index_size(void)
+{
+  queue_params largest = DEFAULT_QUEUE_PARAMS;
+  queue_object q;
+
+  largest.channels = MAX_QUEUE_CHANNELS;
+  largest.layout = RING_LAYOUT_VERSION;
+  if (set_queue_params(&q, &largest))
+    return PAGE_SIZE;
+  return q.index_size;
+}
+
+int vca_mem_reserve_rings(int socket, const queue_params *params, unsigned int count)
+{
+  queue_params defaults = DEFAULT_QUEUE_PARAMS;
+  queue_object q;
+  void **rings;
+  unsigned int i, n;
+
+  memset(&q, 0, sizeof(q));
+  if (get_transport()->id != VCA_TRANSPORT_PCIE || set_queue_params(&q, params ? params : &defaults))
+    return GENERAL_ERROR;
+
+  rings = malloc(count * sizeof(void *));
+  assert(rings != NULL || count == 0);
+
+  // all of them first, a ring released early would only be handed out again
+  for (n = 0; n < count; n++)
+    if ((rings[n] = pcie_alloc(socket, q.ring_size)) == NULL)
+      break;
+
+  while (__atomic_test_and_set(&pcie_rings_lock, __ATOMIC_ACQUIRE));
+  pcie_ring_pool_max += n;
+  __atomic_clear(&pcie_rings_lock, __ATOMIC_RELEASE);
+
+  for (i = 0; i < n; i++)
+    pcie_release(rings[i]);
+  free(rings);
+
+  return n;
+}
+
+// every channel starts empty at the first slot of its own range
+static void init_ring_indices(unsigned long *index_page, queue_object *q)
+{
+  unsigned int i;
+
+  for (i = 0; i < q->channels; i++) {
+    index_page[i << q->index_shift] = (unsigned long)i * q->slots;
+    index_page[(i << q->index_shift) + q->consumer_word] = (unsigned long)i * q->slots;
+  }
+  if (q->ready_offset)
+    memset(index_page + q->ready_offset, 0, q->channels);
+}
+
+int allocate_ring(void * addr, unsigned long size, transfer_mapping * map, int socket, queue_object * q) {
+  int rc;
+  
+  memset(map, 0, sizeof(transfer_mapping));
+  rc = q->transport->export(addr, map);
+  map->transport = q->transport->id;
+  map->size = size;
+  map->mapping_type = REMOTE_WILL_WRITE;
+  map->socket = socket;
+  map->params.channels = q->channels;
+  map->params.slots = q->slots;
+  map->params.slot_size = 1U << q->slot_order;
+  map->params.layout = q->layout ? q->layout : RING_LAYOUT_VERSION;
+  map->params.framing = q->framing;
+  map->pair = q->pair;
+
+  assert(rc == 0);
+  assert(map->size % PAGE_SIZE == 0);
+  assert(map->mapping_type == READ || map->mapping_type == WRITE);
+
+  return 0;
+}
+
+queue_object *init_dequeue(int socket) {
+  return init_dequeue_params(socket, NULL);
+}
+
+static queue_object *init_dequeue_pair(int socket, unsigned int pair, const queue_params *params);
+static queue_object *init_enqueue_pair(int socket, unsigned int pair, const queue_params *params);
+
+// map slot of the remote half of q, past the fixed ones for all but the first pair
+static int queue_map_number(queue_object *q, int map_number)
+{
+  return q->pair ? MAX_MAPPINGS_PER_VCA_SOCKET + 2 * (q->pair - 1) + map_number : map_number;
+}
+
+// Last round of the handshake of q: each end tells the other whether its half is set up (the size it
+// mapped, zero if not), so that a failure on either end tears down both
+static int confirm_queue(queue_object *q, int socket, unsigned long mapped)
+{
+  transfer_mapping in, out;
+  int rc;
+
+  memset(&in, 0, sizeof(transfer_mapping));
+  memset(&out, 0, sizeof(transfer_mapping));
+  in.size = mapped;
+  in.socket = socket;
+  in.pair = q->pair;
+  do {
+    rc = send_recv_mapping(&in, &out, socket);
+  } while (rc);
+
+  if (mapped && !out.size)
+    printf("Socket %d could not set up its half of queue pair %u\n", socket, q->pair);
+  return (mapped && out.size) ? 0 : GENERAL_ERROR;
+}
+
+queue_object *init_dequeue_params(int socket, const queue_params *params) {
+  return init_dequeue_pair(socket, 0, params);
+}
+
+static queue_object *init_dequeue_pair(int socket, unsigned int pair, const queue_params *params) {
+  int rc = 0;
+  transfer_mapping in, out;
+  queue_params defaults = DEFAULT_QUEUE_PARAMS;
+  
+  if(c == NULL) {
+    printf("No connection, initialize system first\n");
+    exit(1);
+  }
+  
+  if (get_local_platform_type() == HOST) {
+    printf("Local Platform is HOST\n");
+    assert(socket < VCA_SOCKETS);
+  } else {
+    printf("Local Platform is CARD\n");
+    socket = get_card_self_socket_number();
+  }
+
+  assert(socket >= 0 && host_vca_ip_array[!get_local_platform_type()][socket] != NULL);
+  
+  queue_object *q = malloc(sizeof(queue_object));
+  assert(q != NULL);
+  memset(q, 0, sizeof(queue_object));
+
+  if (set_queue_params(q, params ? params : &defaults)) {
+    printf("Invalid queue geometry\n");
+    free(q);
+    return NULL;
+  }
+
+  q->pair = pair;
+  q->transport = get_transport();
+  q->ring_2mb = q->transport->alloc(socket, q->ring_size);
+  if (q->ring_2mb == NULL) {
+    printf("Failed to get 0x%lx bytes of contiguous memory for the ring\n", q->ring_size);
+    free(q);
+    return NULL;
+  }
+  init_ring_indices((unsigned long *)q->ring_2mb + q->index_offset, q);
+
+  allocate_ring(q->ring_2mb, q->ring_size, &in, socket, q);
+  
+  do {
+    rc = send_recv_mapping(&in, &out, socket);
+  } while(rc);
+
+  if (out.size < q->index_size)
+    printf("Index page of socket %d too small for %u channels in layout %u\n", socket, q->channels, q->layout);
+  else
+    q->ring_4kb = transport_map(q, &out, socket, out.size, queue_map_number(q, DEQUEUE_MAP_NUMBER));
+  if (confirm_queue(q, socket, q->ring_4kb ? out.size : 0)) {
+    if (q->ring_4kb)
+      q->transport->unmap(q->ring_4kb);
+    q->transport->release(q->ring_2mb);
+    free(q);
+    return NULL;
+  }
+  q->queue_type = DEQUEUE_MAP_NUMBER;
+  q->socket = socket;
+  queue_set_wait_policy(q, NULL);
+  queue_set_copy_kernel(q, COPY_KERNEL_AUTO);
+  queue_init_stats(q);
+
+  return q;
+}
+
+queue_object * init_enqueue(int socket) {
+  return init_enqueue_params(socket, NULL);
+}
+
+queue_object * init_enqueue_params(int socket, const queue_params *params) {
+  return init_enqueue_pair(socket, 0, params);
+}
+
+static queue_object *init_enqueue_pair(int socket, unsigned int pair, const queue_params *params) {
+  int rc = 0;
+  transfer_mapping in, out;
+  queue_params remote_params;
+  unsigned long index_size;
+
+  if(c == NULL) {
+    printf("No connection, initialize system first\n");
+    exit(1);
+  }
+  
+  if (get_local_platform_type() == HOST) {
+    printf("Local Platform is HOST\n");
+    assert(socket < VCA_SOCKETS);
+  } else {
+    printf("Local Platform is CARD\n");
+    socket = get_card_self_socket_number();
+  }
+  
+  queue_object *q = malloc(sizeof(queue_object));
+  assert(q != NULL);
+  memset(q, 0, sizeof(queue_object));
+
+  if (params && set_queue_params(q, params)) {
+    printf("Invalid queue geometry\n");
+    free(q);
+    return NULL;
+  }
+
+  // without params the geometry is only known after the handshake, room for the largest one it can bring
+  index_size = params ? q->index_size : max_index_size();
+  q->pair = pair;
+  q->transport = get_transport();
+  q->ring_4kb = q->transport->alloc(socket, index_size);
+  assert(q->ring_4kb != NULL);
+  allocate_ring(q->ring_4kb, index_size, &in, socket, q);
+  
+  do { 
+    rc = send_recv_mapping(&in, &out, socket);
+  } while (rc);
+
+  // the dequeue side owns the ring and decides on its geometry and index layout
+  remote_params = out.params;
+  if ((params && (params->channels != remote_params.channels || params->slots != remote_params.slots
+		  || params->slot_size != remote_params.slot_size || params->framing != remote_params.framing
+		  || (params->layout && params->layout != remote_params.layout)))
+      || set_queue_params(q, &remote_params) || out.size != q->ring_size || q->index_size > index_size) {
+    printf("Queue geometry mismatch with socket %d: %u channels %u slots %u bytes layout %u framing %u\n",
+	   socket, remote_params.channels, remote_params.slots, remote_params.slot_size, remote_params.layout,
+	   remote_params.framing);
+  } else {
+    init_ring_indices(q->ring_4kb, q);
+    q->ring_2mb = transport_map(q, &out, socket, q->ring_size, queue_map_number(q, ENQUEUE_MAP_NUMBER));
+  }
+  // the dequeue side has mapped the index region by now, it only goes once both sides know
+  if (confirm_queue(q, socket, q->ring_2mb ? q->ring_size : 0)) {
+    if (q->ring_2mb)
+      q->transport->unmap(q->ring_2mb);
+    q->transport->release(q->ring_4kb);
+    free(q);
+    return NULL;
+  }
+  q->queue_type = ENQUEUE_MAP_NUMBER;
+  q->socket = socket;
+  queue_set_wait_policy(q, NULL);
+  queue_set_copy_kernel(q, COPY_KERNEL_AUTO);
+  queue_init_stats(q);
+  
+  printf("Init split enqueue done : _2MB pointer %p 4KB pointer %p \n",q->ring_2mb,
+	 q->ring_4kb);
+  
+  return q;
+}
+
+queue_object *init_local_queue(const queue_params *params)
+{
+  queue_params defaults = DEFAULT_QUEUE_PARAMS;
+  queue_object *q = malloc(sizeof(queue_object));
+
+  assert(q != NULL);
+  memset(q, 0, sizeof(queue_object));
+
+  if (set_queue_params(q, params ? params : &defaults)) {
+    printf("Invalid queue geometry\n");
+    free(q);
+    return NULL;
+  }
+
+  q->ring_2mb = memalign(_2MB, q->ring_size);
+  q->ring_4kb = memalign(PAGE_SIZE, q->index_size);
+  assert(q->ring_2mb != NULL && q->ring_4kb != NULL);
+  madvise(q->ring_2mb, q->ring_size, MADV_HUGEPAGE);
+  memset(q->ring_2mb, 0, q->ring_size);
+  memset(q->ring_4kb, 0, q->index_size);
+  init_ring_indices((unsigned long *)q->ring_2mb + q->index_offset, q);
+  init_ring_indices(q->ring_4kb, q);
+
+  q->queue_type = LOCAL_QUEUE_TYPE;
+  q->socket = -1;
+  queue_set_wait_policy(q, NULL);
+  queue_set_copy_kernel(q, COPY_KERNEL_AUTO);
+  queue_init_stats(q);
+
+  return q;
+}
+
+int queue_set_multi_producer(queue_object *queue_obj, unsigned int idx, int enable)
+{
+  unsigned long *prod_cons_array = queue_obj->ring_4kb;
+
+  if (queue_obj->queue_type == DEQUEUE_MAP_NUMBER || idx >= queue_obj->channels) {
+    printf("Multi producer mode needs a channel of an enqueue queue\n");
+    return GENERAL_ERROR;
+  }
+
+  if (queue_obj->mpsc == NULL) {
+    queue_obj->mpsc = memalign(CACHE_LINE_SIZE, queue_obj->channels * sizeof(mpsc_channel));
+    if (queue_obj->mpsc == NULL)
+      return GENERAL_ERROR;
+    memset(queue_obj->mpsc, 0, queue_obj->channels * sizeof(mpsc_channel));
+  }
+
+  queue_obj->mpsc[idx].published = prod_cons_array[(idx << queue_obj->index_shift) + LOCAL_PRODUCER];
+  queue_obj->mpsc[idx].enabled = enable;
+  return 0;
+}
+
+void set_task_multi_producer(void *opq, int enable)
+{
+  task_queue_opaque *opaque = opq;
+  unsigned int i, ch;
+  int ret;
+
+  for (i = 0; i < VCA_SOCKETS; i++)
+    if (opaque->tx_q_objs[i])
+      for (ch = 0; ch < opaque->tx_q_objs[i]->channels; ch++) {
+        ret = queue_set_multi_producer(opaque->tx_q_objs[i], ch, enable);
+        assert(ret == 0);
+      }
+}
+
+void free_queue(queue_object *q)
+{
+	assert(q != NULL);
+	if (q->queue_type == DEQUEUE_MAP_NUMBER) {
+		assert(q->ring_2mb != NULL);
+		q->transport->release(q->ring_2mb);
+		if (q->ring_4kb)
+			q->transport->unmap(q->ring_4kb);
+	} else if (q->queue_type == ENQUEUE_MAP_NUMBER) {
+		assert(q->ring_4kb != NULL);
+		q->transport->release(q->ring_4kb);
+		if (q->ring_2mb)
+			q->transport->unmap(q->ring_2mb);
+	} else if (q->queue_type == LOCAL_QUEUE_TYPE) {
+		free(q->ring_2mb);
+		free(q->ring_4kb);
+	}
+
+	while (q->stats) {
+		stats_block *b = q->stats;
+
+		q->stats = b->next;
+		free(b);
+	}
+	free(q->mpsc);
+	free(q);
+}
+
+
+
+// task systems and queue pairs sharing the connection, which goes with the last of them
+static unsigned int task_systems;
+
+static task_queue_opaque *alloc_task_opaque(void)
+{
+  task_queue_opaque *opaque = malloc(sizeof(task_queue_opaque));
+  unsigned int i;
+
+  assert(opaque != NULL);
+  memset(opaque, 0, sizeof(task_queue_opaque));
+  for (i = 0; i < VCA_SOCKETS; i++)
+    opaque->active_sockets[i] = -1;
+  __atomic_add_fetch(&task_systems, 1, __ATOMIC_RELAXED);
+
+  return opaque;
+}
+
+void *init_host_task_system(void *opq, const char * ip, const char * port, int * socket)
+{
+  return init_host_task_system_params(opq, ip, port, socket, NULL);
+}
+
+void *init_host_task_system_params(void *opq, const char * ip, const char * port, int * socket, const queue_params *params)
+{
+   task_queue_opaque *opaque = opq;
+   assert(*socket < VCA_SOCKETS);
+   if (opaque == NULL)
+     opaque = alloc_task_opaque();
+
+   initialize_system(ip, port, socket); // may update the socket, depending on who connects
+   opaque->active_sockets[opaque->total_sockets++] = *socket;
+   printf("\nInitializing communication with worker on socket %d\n",*socket);
+   opaque->tx_q_objs[*socket] = init_enqueue(*socket);
+   assert(opaque->tx_q_objs[*socket] != NULL);
+   opaque->rx_q_objs[*socket] = init_dequeue_params(*socket, params);
+   assert(opaque->rx_q_objs[*socket] != NULL);
+   return opaque;
+}
+
+void *init_vca_task_system(const char * ip, const char * port, int * socket)
+{
+  return init_vca_task_system_params(ip, port, socket, NULL);
+}
+
+void *init_vca_task_system_params(const char * ip, const char * port, int * socket, const queue_params *params)
+{
+  task_queue_opaque *opaque = alloc_task_opaque();
+
+  initialize_system(ip, port, socket);
+  opaque->rx_q_objs[0] = init_dequeue_params(-1, params);
+  assert(opaque->rx_q_objs[0] != NULL);
+  opaque->tx_q_objs[0] = init_enqueue(-1);
+  assert(opaque->tx_q_objs[0] != NULL);
+  return opaque;
+}
+
+// same handshakes in the same order as the task systems, with the pair number checked on the way
+void *init_host_task_pair(int socket, unsigned int pair, const queue_params *params)
+{
+  task_queue_opaque *opaque;
+
+  if (pair == 0 || pair >= MAX_QUEUE_PAIRS || socket < 0 || socket >= VCA_SOCKETS)
+    return NULL;
+
+  opaque = alloc_task_opaque();
+  opaque->active_sockets[opaque->total_sockets++] = socket;
+  printf("\nInitializing queue pair %u with worker on socket %d\n", pair, socket);
+  opaque->tx_q_objs[socket] = init_enqueue_pair(socket, pair, NULL);
+  if (opaque->tx_q_objs[socket] != NULL)
+    opaque->rx_q_objs[socket] = init_dequeue_pair(socket, pair, params);
+  if (opaque->rx_q_objs[socket] == NULL) {
+    deinit_vca_task_system(opaque);
+    return NULL;
+  }
+
+  return opaque;
+}
+
+void *init_vca_task_pair(unsigned int pair, const queue_params *params)
+{
+  task_queue_opaque *opaque;
+
+  if (pair == 0 || pair >= MAX_QUEUE_PAIRS)
+    return NULL;
+
+  opaque = alloc_task_opaque();
+  opaque->rx_q_objs[0] = init_dequeue_pair(-1, pair, params);
+  if (opaque->rx_q_objs[0] != NULL)
+    opaque->tx_q_objs[0] = init_enqueue_pair(-1, pair, NULL);
+  if (opaque->tx_q_objs[0] == NULL) {
+    deinit_vca_task_system(opaque);
+    return NULL;
+  }
+
+  return opaque;
+}
+
+
+// CPUs of the threads started by the library, see vca_mem_set_thread_affinity
+static struct {
+  int enable;
+  int socket;
+} thread_affinity;
+
+void vca_mem_set_thread_affinity(int enable, int socket)
+{
+  thread_affinity.socket = socket;
+  thread_affinity.enable = enable;
+}
+
+// Periodic telemetry dumps of one task system
+static struct {
+  pthread_t thread;
+  void *opq;
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path) + 5];
+  unsigned int interval_ms;
+  int running;
+} stats_exporter;
+
+static void stats_print_histogram(FILE *f, const char *name, const unsigned long *histogram)
+{
+  int i;
+
+  fprintf(f, " %s", name);
+  for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    if (histogram[i])
+      fprintf(f, " %d:%lu", i, histogram[i]);
+}
+
+static void stats_print(void *opq, FILE *f)
+{
+  task_queue_opaque *opaque = opq;
+  channel_stats st;
+  wait_stats ws;
+  queue_object *q;
+  unsigned int ch;
+  int socket, rx;
+
+  fprintf(f, "# vca_mem stats %ld\n", (long)time(NULL));
+  for (socket = 0; socket < VCA_SOCKETS; socket++) {
+    for (rx = 0; rx < 2; rx++) {
+      q = rx ? opaque->rx_q_objs[socket] : opaque->tx_q_objs[socket];
+      if (q == NULL)
+	continue;
+      if (rx) {
+	queue_get_wait_stats(q, &ws);
+	fprintf(f, "socket %d rx wait spins %lu pauses %lu sleeps %lu wakeups %lu\n", socket,
+		ws.spins, ws.pauses, ws.sleeps, ws.wakeups);
+      }
+      for (ch = 0; ch < q->channels; ch++) {
+	queue_get_stats(q, ch, &st);
+	fprintf(f, "socket %d %s channel %u tasks_out %lu bytes_out %lu full_retries %lu tasks_in %lu bytes_in %lu"
+		" empty_polls %lu max_occupancy %lu/%u", socket, rx ? "rx" : "tx", ch, st.tasks_out, st.bytes_out,
+		st.full_retries, st.tasks_in, st.bytes_in, st.empty_polls, st.max_occupancy, q->slots);
+	if (stats_flags & STATS_LATENCY) {
+	  stats_print_histogram(f, "submit_ns_log2", st.submit_ns);
+	  stats_print_histogram(f, "recv_ns_log2", st.recv_ns);
+	}
+	fprintf(f, "\n");
+      }
+    }
+  }
+}
+
+// the whole dump in one buffer, so it goes out with a single write
+static char *stats_format(void *opq, size_t *len)
+{
+  char *buf = NULL;
+  FILE *f = open_memstream(&buf, len);
+
+  if (f == NULL)
+    return NULL;
+  stats_print(opq, f);
+  fclose(f);
+  return buf;
+}
+
+void vca_mem_dump_stats(void *opq, int fd)
+{
+  size_t len, done;
+  ssize_t n;
+  char *buf = stats_format(opq, &len);
+
+  if (buf == NULL)
+    return;
+  for (done = 0; done < len; done += n)
+    if ((n = write(fd, buf + done, len - done)) <= 0)
+      break;
+  free(buf);
+}
+
+static int stats_export(const char *path, const char *buf, size_t len, int *sock)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  char tmp[sizeof(stats_exporter.path) + 8];
+  size_t path_len;
+  FILE *f;
+
+  if (strncmp(path, "unix:", 5) == 0) {
+    if (*sock < 0) {
+      // checked by vca_mem_start_stats_exporter, addr keeps the terminating zero
+      path_len = strlen(path + 5);
+      if (path_len >= sizeof(addr.sun_path))
+	return GENERAL_ERROR;
+      memcpy(addr.sun_path, path + 5, path_len);
+      *sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (*sock >= 0 && connect(*sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+	close(*sock);
+	*sock = -1;
+      }
+      if (*sock < 0)
+	return GENERAL_ERROR;
+    }
+    // the reader may go away at any time, reconnect on the next round
+    if (send(*sock, buf, len, MSG_NOSIGNAL) != (ssize_t)len) {
+      close(*sock);
+      *sock = -1;
+      return GENERAL_ERROR;
+    }
+    return 0;
+  }
+
+  // readers of the file always see a complete dump
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((f = fopen(tmp, "w")) == NULL)
+    return GENERAL_ERROR;
+  fwrite(buf, 1, len, f);
+  if (fclose(f) != 0 || rename(tmp, path) != 0)
+    return GENERAL_ERROR;
+  return 0;
+}
+
+static void *stats_exporter_main(void *arg)
+{
+  struct timespec ts = { stats_exporter.interval_ms / 1000, (stats_exporter.interval_ms % 1000) * 1000000L };
+  int sock = -1;
+  size_t len;
+  char *buf;
+
+  if (thread_affinity.enable)
+    vca_pin_thread(thread_affinity.socket, -1);
+
+  while (__atomic_load_n(&stats_exporter.running, __ATOMIC_ACQUIRE)) {
+    if ((buf = stats_format(stats_exporter.opq, &len)) != NULL) {
+      stats_export(stats_exporter.path, buf, len, &sock);
+      free(buf);
+    }
+    nanosleep(&ts, NULL);
+  }
+
+  if (sock >= 0)
+    close(sock);
+  return NULL;
+}
+
+int vca_mem_start_stats_exporter(void *opq, const char *path, unsigned int interval_ms)
+{
+  if (!opq || !path || interval_ms == 0 || strlen(path) >= sizeof(stats_exporter.path)
+      || (strncmp(path, "unix:", 5) == 0 && strlen(path + 5) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+      || __atomic_load_n(&stats_exporter.running, __ATOMIC_ACQUIRE))
+    return GENERAL_ERROR;
+
+  stats_exporter.opq = opq;
+  strcpy(stats_exporter.path, path);
+  stats_exporter.interval_ms = interval_ms;
+  stats_exporter.running = 1;
+  if (pthread_create(&stats_exporter.thread, NULL, stats_exporter_main, NULL) != 0) {
+    stats_exporter.running = 0;
+    stats_exporter.opq = NULL;
+    return GENERAL_ERROR;
+  }
+  return 0;
+}
+
+void vca_mem_stop_stats_exporter(void)
+{
+  if (!__atomic_load_n(&stats_exporter.running, __ATOMIC_ACQUIRE))
+    return;
+
+  __atomic_store_n(&stats_exporter.running, 0, __ATOMIC_RELEASE);
+  pthread_join(stats_exporter.thread, NULL);
+  stats_exporter.opq = NULL;
+}
+
+void deinit_vca_task_system(void *opq)
+{
+ int i = 0;  
+ task_queue_opaque *opaque = opq;
+ assert(opaque != NULL);
+ 
+ if (stats_exporter.opq == opq)
+   vca_mem_stop_stats_exporter();
+
+ printf("\nTearing down communication with workers\n");
+ for (i = 0; i < VCA_SOCKETS; i++) {
+   if(opaque->rx_q_objs[i])
+     free_queue(opaque->rx_q_objs[i]);
+   if(opaque->tx_q_objs[i])
+     free_queue(opaque->tx_q_objs[i]);
+ }
+ 
+ free(opaque);
+
+ if (__atomic_sub_fetch(&task_systems, 1, __ATOMIC_RELAXED) == 0) {
+   zmq_close(c);
+   zmq_ctx_destroy(context);
+   c = NULL;
+   context = NULL;
+ }
+}
+
+#endif //NOT ENCLAVE MODE
+
+// fill w with up to two spans covering n slots starting at index value pos of channel idx
+static inline int ring_window_setup(queue_object *queue_obj, ring_window *w, unsigned int idx, unsigned int pos, unsigned int n)
+{
+  char *ring = queue_obj->ring_2mb;
+  unsigned int LOWER_BOUND = idx << queue_obj->slots_order;
+  unsigned int UPPER_BOUND = LOWER_BOUND + queue_obj->slots;
+  unsigned int num_elements, remaining_elements;
+
+  pos = LOWER_BOUND + ((pos - LOWER_BOUND) & (queue_obj->slots - 1)); // index may sit on UPPER_BOUND
+  num_elements = MIN(UPPER_BOUND - pos, n);
+  remaining_elements = n - num_elements;
+
+  w->idx = idx;
+  w->pos = pos;
+  w->total_items = n;
+  w->span[0].addr = (void *)(ring + ((unsigned long)pos << queue_obj->slot_order));
+  w->span[0].items = num_elements;
+  w->span[1].addr = (void *)(ring + ((unsigned long)LOWER_BOUND << queue_obj->slot_order));
+  w->span[1].items = remaining_elements;
+  w->next = (unlikely(remaining_elements != 0))
+    ? LOWER_BOUND + remaining_elements
+    : pos + num_elements;
+
+  return (remaining_elements != 0) ? 2 : 1;
+}
+
+static inline int multi_producer(queue_object *queue_obj, unsigned int idx)
+{
+  return unlikely(queue_obj->mpsc != NULL) && queue_obj->mpsc[idx].enabled;
+}
+
+// reservation on a multi-producer channel: CAS the window onto the local producer index.
+// Fails while a stream holds the channel unless called by the stream owner
+static int ring_reserve_shared(queue_object *queue_obj, unsigned int idx, unsigned int n_items, ring_window *w, int owner)
+{
+  unsigned long *prod_cons_array = queue_obj->ring_4kb;
+  unsigned int real_idx = idx << queue_obj->index_shift;
+  unsigned long *lp = &prod_cons_array[real_idx + LOCAL_PRODUCER];
+  unsigned long old = __atomic_load_n(lp, __ATOMIC_RELAXED);
+  unsigned int RC_VAL, max_dist;
+
+  do {
+    if ((old & RING_STREAM_LOCK) && !owner)
+      return 0;
+
+    RC_VAL = __atomic_load_n(&prod_cons_array[real_idx + queue_obj->consumer_word], __ATOMIC_RELAXED);
+    max_dist = (RC_VAL-((unsigned int)old+1)) & (queue_obj->slots - 1);
+
+    if (unlikely(n_items == 0 || n_items > max_dist))
+      return 0;
+
+    ring_window_setup(queue_obj, w, idx, (unsigned int)old, n_items);
+  } while (!__atomic_compare_exchange_n(lp, &old, w->next | (old & RING_STREAM_LOCK), 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+  return (w->span[1].items != 0) ? 2 : 1;
+}
+
+static int ring_stream_lock(queue_object *queue_obj, unsigned int idx)
+{
+  unsigned long *lp = (unsigned long *)queue_obj->ring_4kb + (idx << queue_obj->index_shift) + LOCAL_PRODUCER;
+  unsigned long old = __atomic_load_n(lp, __ATOMIC_RELAXED);
+
+  return !(old & RING_STREAM_LOCK) &&
+    __atomic_compare_exchange_n(lp, &old, old | RING_STREAM_LOCK, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void ring_stream_unlock(queue_object *queue_obj, unsigned int idx)
+{
+  unsigned long *lp = (unsigned long *)queue_obj->ring_4kb + (idx << queue_obj->index_shift) + LOCAL_PRODUCER;
+
+  __atomic_fetch_and(lp, ~RING_STREAM_LOCK, __ATOMIC_RELEASE);
+}
+
+// tell the consumer that channel idx has data; its producer index has to be written before
+static inline void ring_set_ready(queue_object *queue_obj, unsigned int idx)
+{
+  unsigned long *ring = (unsigned long *)queue_obj->ring_2mb + queue_obj->index_offset;
+
+  if (queue_obj->ready_offset) {
+    asm volatile ("sfence" ::: "memory"); // both may sit in the same write combining buffer
+    ((volatile unsigned char *)(ring + queue_obj->ready_offset))[idx] = 1;
+  }
+}
+
+// wait until every window reserved before w is published, then publish w
+static void ring_publish_ordered(queue_object *queue_obj, ring_window *w)
+{
+  unsigned long *ring = (unsigned long *)queue_obj->ring_2mb + queue_obj->index_offset;
+  mpsc_channel *m = &queue_obj->mpsc[w->idx];
+
+  while ((((unsigned int)__atomic_load_n(&m->published, __ATOMIC_ACQUIRE)) - w->pos) & (queue_obj->slots - 1))
+    asm volatile ("pause" ::: "memory");
+
+  asm volatile ("sfence" ::: "memory"); // payload stores, non-temporal ones too, before the index
+  ring[(w->idx << queue_obj->index_shift) + REMOTE_PRODUCER] = w->next;
+  ring_set_ready(queue_obj, w->idx);
+  asm volatile ("sfence" ::: "memory"); // the remote index may be write combined
+  __atomic_store_n(&m->published, w->next, __ATOMIC_RELEASE);
+
+  if (unlikely(queue_obj->wait.doorbell_ring != NULL))
+    queue_obj->wait.doorbell_ring(queue_obj->wait.doorbell_arg);
+}
+
+// Copy kernels of queue_set_copy_kernel. The ring behind the PCIe aperture is write combined: whole, aligned 64 byte
+// lines leave as single posted writes, so the producer streams full lines with non-temporal stores and only does the
+// ragged ends with memcpy. The fence of ring_commit orders them before the producer index
+__attribute__((target("avx2")))
+static void copy_to_ring_avx2(void *dst, const void *src, unsigned long len)
+{
+  char *d = dst;
+  const char *s = src;
+  unsigned long head = MIN(len, (-(uintptr_t)d) & 31);
+
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  len -= head;
+  for (; len >= 64; len -= 64, d += 64, s += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)s);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+
+    _mm256_stream_si256((__m256i *)d, a);
+    _mm256_stream_si256((__m256i *)(d + 32), b);
+  }
+  if (len >= 32) {
+    _mm256_stream_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+    d += 32;
+    s += 32;
+    len -= 32;
+  }
+  memcpy(d, s, len);
+}
+
+__attribute__((target("avx512f")))
+static void copy_to_ring_avx512(void *dst, const void *src, unsigned long len)
+{
+  char *d = dst;
+  const char *s = src;
+  unsigned long head = MIN(len, (-(uintptr_t)d) & 63);
+
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  len -= head;
+  for (; len >= 64; len -= 64, d += 64, s += 64)
+    _mm512_stream_si512((__m512i *)d, _mm512_loadu_si512((const void *)s));
+  memcpy(d, s, len);
+}
+
+// the consumer reads its own ring, which the device wrote into memory or the last level cache, a few lines ahead
+__attribute__((target("avx2")))
+static void copy_from_ring_avx2(void *dst, const void *src, unsigned long len)
+{
+  char *d = dst;
+  const char *s = src;
+
+  for (; len >= 64; len -= 64, d += 64, s += 64) {
+    _mm_prefetch(s + 256, _MM_HINT_T0);
+    _mm256_storeu_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+    _mm256_storeu_si256((__m256i *)(d + 32), _mm256_loadu_si256((const __m256i *)(s + 32)));
+  }
+  memcpy(d, s, len);
+}
+
+__attribute__((target("avx512f")))
+static void copy_from_ring_avx512(void *dst, const void *src, unsigned long len)
+{
+  char *d = dst;
+  const char *s = src;
+
+  for (; len >= 64; len -= 64, d += 64, s += 64) {
+    _mm_prefetch(s + 256, _MM_HINT_T0);
+    _mm512_storeu_si512((void *)d, _mm512_loadu_si512((const void *)s));
+  }
+  memcpy(d, s, len);
+}
+
+static inline void ring_copy_in(queue_object *queue_obj, void *dst, const void *src, unsigned long len)
+{
+  if (queue_obj->copy_kernel == COPY_KERNEL_AVX512)
+    copy_to_ring_avx512(dst, src, len);
+  else if (queue_obj->copy_kernel == COPY_KERNEL_AVX2)
+    copy_to_ring_avx2(dst, src, len);
+  else
+    memcpy(dst, src, len);
+}
+
+static inline void ring_copy_out(queue_object *queue_obj, void *dst, const void *src, unsigned long len)
+{
+  if (queue_obj->copy_kernel == COPY_KERNEL_AVX512)
+    copy_from_ring_avx512(dst, src, len);
+  else if (queue_obj->copy_kernel == COPY_KERNEL_AVX2)
+    copy_from_ring_avx2(dst, src, len);
+  else
+    memcpy(dst, src, len);
+}
+
+// copy len bytes from src into w, starting offset bytes into the window
+static inline void ring_window_copy(queue_object *queue_obj, ring_window *w, unsigned long offset, const void *src, unsigned long len)
+{
+  unsigned long span_bytes = (unsigned long)w->span[0].items << queue_obj->slot_order;
+  unsigned long first;
+
+  if (offset < span_bytes) {
+    first = MIN(len, span_bytes - offset);
+    ring_copy_in(queue_obj, (char *)w->span[0].addr + offset, src, first);
+    src = (const char *)src + first;
+    len -= first;
+    offset = 0;
+  } else {
+    offset -= span_bytes;
+  }
+
+  if (len != 0)
+    ring_copy_in(queue_obj, (char *)w->span[1].addr + offset, src, len);
+}
+
+// ring_window_copy from the start of w, span by span through the DMA engine where it reaches both sides
+static void ring_window_copy_dma(queue_object *queue_obj, ring_window *w, const void *src, unsigned long len)
+{
+  unsigned long first = MIN(len, (unsigned long)w->span[0].items << queue_obj->slot_order);
+
+#ifndef ENCLAVE
+  if (pcie_dma_copy(w->span[0].addr, src, first) != 0)
+#endif
+    ring_copy_in(queue_obj, w->span[0].addr, src, first);
+  if (len == first)
+    return;
+#ifndef ENCLAVE
+  if (pcie_dma_copy(w->span[1].addr, (const char *)src + first, len - first) != 0)
+#endif
+    ring_copy_in(queue_obj, w->span[1].addr, (const char *)src + first, len - first);
+}
+
+// copy len bytes out of w, starting offset bytes into the window
+static inline void ring_window_read(queue_object *queue_obj, ring_window *w, unsigned long offset, void *dst, unsigned long len)
+{
+  unsigned long span_bytes = (unsigned long)w->span[0].items << queue_obj->slot_order;
+  unsigned long first;
+
+  if (offset < span_bytes) {
+    first = MIN(len, span_bytes - offset);
+    ring_copy_out(queue_obj, dst, (char *)w->span[0].addr + offset, first);
+    dst = (char *)dst + first;
+    len -= first;
+    offset = 0;
+  } else {
+    offset -= span_bytes;
+  }
+
+  if (len != 0)
+    ring_copy_out(queue_obj, dst, (char *)w->span[1].addr + offset, len);
+}
+
+// position in a caller's iovec array, advanced by ring_window_copyv/ring_window_readv
+typedef struct {
+  const struct iovec *iov;
+  int iovcnt;
+  unsigned long offset;
+} iov_cursor;
+
+static inline unsigned long iov_length(const struct iovec *iov, int iovcnt)
+{
+  unsigned long len = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  return len;
+}
+
+// copy the next len bytes of c into w, starting offset bytes into the window
+static void ring_window_copyv(queue_object *queue_obj, ring_window *w, unsigned long offset, iov_cursor *c, unsigned long len)
+{
+  unsigned long n;
+
+  while (len != 0) {
+    assert(c->iovcnt > 0);
+    n = MIN(len, c->iov->iov_len - c->offset);
+    ring_window_copy(queue_obj, w, offset, (const char *)c->iov->iov_base + c->offset, n);
+    offset += n;
+    len -= n;
+    c->offset += n;
+    if (c->offset == c->iov->iov_len) {
+      c->iov++;
+      c->iovcnt--;
+      c->offset = 0;
+    }
+  }
+}
+
+// copy len bytes out of w into the next segments of c; what does not fit in c is dropped
+static void ring_window_readv(queue_object *queue_obj, ring_window *w, unsigned long offset, iov_cursor *c, unsigned long len)
+{
+  unsigned long n;
+
+  while (len != 0 && c->iovcnt > 0) {
+    n = MIN(len, c->iov->iov_len - c->offset);
+    ring_window_read(queue_obj, w, offset, (char *)c->iov->iov_base + c->offset, n);
+    offset += n;
+    len -= n;
+    c->offset += n;
+    if (c->offset == c->iov->iov_len) {
+      c->iov++;
+      c->iovcnt--;
+      c->offset = 0;
+    }
+  }
+}
+
+int ring_reserve(queue_object *queue_obj, unsigned int idx, unsigned int n_items, ring_window *w)
+{
+  unsigned long *prod_cons_array = queue_obj->ring_4kb;
+  unsigned int real_idx = idx << queue_obj->index_shift;
+  unsigned int LP_VAL = (unsigned int) prod_cons_array[real_idx + LOCAL_PRODUCER];
+  unsigned int RC_VAL = prod_cons_array[real_idx + queue_obj->consumer_word];
+  unsigned int max_dist;
+
+  if (multi_producer(queue_obj, idx))
+    return ring_reserve_shared(queue_obj, idx, n_items, w, 0);
+
+  max_dist = (RC_VAL-(LP_VAL+1)) & (queue_obj->slots - 1);
+
+  if (unlikely(n_items == 0 || n_items > max_dist))
+    return 0;
+
+  return ring_window_setup(queue_obj, w, idx, LP_VAL, n_items);
+}
+
+void ring_commit(queue_object *queue_obj, ring_window *w)
+{
+  unsigned long *ring = (unsigned long *)queue_obj->ring_2mb + queue_obj->index_offset;
+  unsigned long *prod_cons_array = queue_obj->ring_4kb;
+  unsigned int real_idx = w->idx << queue_obj->index_shift;
+
+  if (multi_producer(queue_obj, w->idx)) {
+    ring_publish_ordered(queue_obj, w);
+    return;
+  }
+
+  asm volatile ("sfence" ::: "memory"); // payload stores, non-temporal ones too, before the index
+  ring[real_idx + REMOTE_PRODUCER] = prod_cons_array[real_idx + LOCAL_PRODUCER] = w->next;
+  ring_set_ready(queue_obj, w->idx);
+
+  if (unlikely(queue_obj->wait.doorbell_ring != NULL))
+    queue_obj->wait.doorbell_ring(queue_obj->wait.doorbell_arg);
+}
+
+void ring_commit_batch(queue_object *queue_obj, ring_window *w)
+{
+  unsigned long *prod_cons_array = queue_obj->ring_4kb;
+  unsigned int real_idx = w->idx << queue_obj->index_shift;
+
+  if (multi_producer(queue_obj, w->idx)) {
+    ring_publish_ordered(queue_obj, w); // a later flush could publish a stale index of another producer
+    return;
+  }
+
+  prod_cons_array[real_idx + LOCAL_PRODUCER] = w->next;
+}
+
+void ring_flush(queue_object *queue_obj, unsigned int idx)
+{
+  unsigned long *ring = (unsigned long *)queue_obj->ring_2mb + queue_obj->index_offset;
+  unsigned long *prod_cons_array = queue_obj->ring_4kb;
+  unsigned int real_idx = idx << queue_obj->index_shift;
+
+  if (multi_producer(queue_obj, idx))
+    return; // already published by ring_commit_batch
+
+  asm volatile ("sfence" ::: "memory");
+  ring[real_idx + REMOTE_PRODUCER] = prod_cons_array[real_idx + LOCAL_PRODUCER];
+  ring_set_ready(queue_obj, idx);
+
+  if (unlikely(queue_obj->wait.doorbell_ring != NULL))
+    queue_obj->wait.doorbell_ring(queue_obj->wait.doorbell_arg);
+}
+
+int ring_peek(queue_object *queue_obj, unsigned int idx, unsigned int n_items, ring_window *w)
+{
+  unsigned long *ring = (unsigned long *)queue_obj->ring_2mb + queue_obj->index_offset;
+  unsigned int real_idx = idx << queue_obj->index_shift;
+  unsigned int LC_VAL = (unsigned int)ring[real_idx + queue_obj->consumer_word];
+  unsigned int RP_VAL = ring[real_idx + REMOTE_PRODUCER];
+  unsigned int max_available;
+
+#ifdef HOST_MODE
+  asm volatile ("mfence" ::: "memory");
+#endif
+  max_available = (RP_VAL-LC_VAL) & (queue_obj->slots - 1);
+
+  if (n_items == 0)
+    n_items = max_available;
+
+  if (unlikely(n_items == 0 || n_items > max_available))
+    return 0;
+
+  return ring_window_setup(queue_obj, w, idx, LC_VAL, n_items);
+}
+
+void ring_release(queue_object *queue_obj, ring_window *w)
+{
+  unsigned long *ring = (unsigned long *)queue_obj->ring_2mb + queue_obj->index_offset;
+  unsigned long *prod_cons_array = queue_obj->ring_4kb;
+  unsigned int real_idx = w->idx << queue_obj->index_shift;
+
+  prod_cons_array[real_idx + queue_obj->consumer_word] = ring[real_idx + queue_obj->consumer_word] = w->next;
+}
+
+static inline int ring_has_data(queue_object *queue_obj, unsigned long *ring, unsigned int idx)
+{
+  unsigned int real_idx = idx << queue_obj->index_shift;
+
+  return (((unsigned int)ring[real_idx + REMOTE_PRODUCER] - (unsigned int)ring[real_idx + queue_obj->consumer_word])
+	  & (queue_obj->slots - 1)) != 0;
+}
+
+int queue_poll_ready(queue_object *queue_obj, unsigned int start)
+{
+  unsigned long *ring = (unsigned long *)queue_obj->ring_2mb + queue_obj->index_offset;
+  volatile unsigned char *ready = (unsigned char *)(ring + queue_obj->ready_offset);
+  unsigned int i, idx, words = (queue_obj->channels + sizeof(unsigned long) - 1) / sizeof(unsigned long);
+
+  if (queue_obj->ready_offset) {
+    // nothing to do unless a producer flagged a channel, usually a single line to look at
+    for (i = 0; i < words; i++)
+      if (((volatile unsigned long *)ready)[i] != 0)
+	break;
+    if (i == words)
+      return -1;
+  }
+
+  for (i = 0, idx = start % queue_obj->channels; i < queue_obj->channels; i++, idx = (idx + 1) % queue_obj->channels) {
+    if (queue_obj->ready_offset && !ready[idx])
+      continue;
+    if (ring_has_data(queue_obj, ring, idx))
+      return idx;
+    if (queue_obj->ready_offset) {
+      // clear first and look again, so a producer publishing in between is never missed
+      ready[idx] = 0;
+      asm volatile ("mfence" ::: "memory");
+      if (ring_has_data(queue_obj, ring, idx)) {
+	ready[idx] = 1;
+	return idx;
+      }
+    }
+  }
+
+  return -1;
+}
+
+int s_variable_multi_enqueue(queue_object *queue_obj, void *source, unsigned int total_elements, unsigned int idx)
+{
+  ring_window w;
+
+  if (likely(ring_reserve(queue_obj, idx, total_elements, &w))) {
+    ring_copy_in(queue_obj, w.span[0].addr, source, w.span[0].items << queue_obj->slot_order);
+    if (unlikely(w.span[1].items != 0))
+      ring_copy_in(queue_obj, w.span[1].addr, (void *)((unsigned long)source + (w.span[0].items << queue_obj->slot_order)), w.span[1].items << queue_obj->slot_order);
+    ring_commit(queue_obj, &w);
+
+    return total_elements;
+  }
+
+  return 0;
+}
+
+int s_variable_multi_enqueue_batch(queue_object *queue_obj, void *source, unsigned int total_elements, unsigned int idx)
+{
+  ring_window w;
+
+  if (likely(ring_reserve(queue_obj, idx, total_elements, &w))) {
+    ring_copy_in(queue_obj, w.span[0].addr, source, w.span[0].items << queue_obj->slot_order);
+    if (unlikely(w.span[1].items != 0))
+      ring_copy_in(queue_obj, w.span[1].addr, (void *)((unsigned long)source + (w.span[0].items << queue_obj->slot_order)), w.span[1].items << queue_obj->slot_order);
+    ring_commit_batch(queue_obj, &w);
+
+    return total_elements;
+  }
+
+  return 0;
+}
+
+int s_variable_multi_dequeue(queue_object *queue_obj, void *source, unsigned int max_requested, unsigned int idx)
+{
+  ring_window w;
+
+  if (likely(max_requested != 0 && ring_peek(queue_obj, idx, max_requested, &w))) {
+    ring_copy_out(queue_obj, source, w.span[0].addr, w.span[0].items << queue_obj->slot_order);
+    if (unlikely(w.span[1].items != 0))
+      ring_copy_out(queue_obj, (void *)((unsigned long)source + (w.span[0].items << queue_obj->slot_order)), w.span[1].addr, w.span[1].items << queue_obj->slot_order);
+    ring_release(queue_obj, &w);
+
+    return max_requested;
+  }
+
+  return 0;
+}
+
+
+
+void queue_set_wait_policy(queue_object *queue_obj, const wait_policy *policy)
+{
+  wait_policy spin = WAIT_POLICY_SPIN;
+
+  queue_obj->wait = policy ? *policy : spin;
+}
+
+void queue_get_wait_stats(queue_object *queue_obj, wait_stats *stats)
+{
+  stats->spins = __atomic_load_n(&queue_obj->wait_stats.spins, __ATOMIC_RELAXED);
+  stats->pauses = __atomic_load_n(&queue_obj->wait_stats.pauses, __ATOMIC_RELAXED);
+  stats->sleeps = __atomic_load_n(&queue_obj->wait_stats.sleeps, __ATOMIC_RELAXED);
+  stats->wakeups = __atomic_load_n(&queue_obj->wait_stats.wakeups, __ATOMIC_RELAXED);
+}
+
+// progress of one waiting call, folded into the queue counters by queue_wait_done
+typedef struct {
+  unsigned long polls;
+  unsigned long pauses;
+  unsigned long sleeps;
+  unsigned long sleep_ns;
+} wait_state;
+
+// called after every empty poll
+static void queue_wait(queue_object *queue_obj, wait_state *ws)
+{
+  wait_policy *p = &queue_obj->wait;
+
+  ws->polls++;
+  if (likely(p->spin_polls == ~0UL || ws->polls <= p->spin_polls))
+    return;
+
+  if (ws->polls <= p->spin_polls + p->pause_polls) {
+    asm volatile ("pause" ::: "memory");
+    ws->pauses++;
+    return;
+  }
+
+  ws->sleep_ns = (ws->sleep_ns == 0) ? p->min_sleep_ns : MIN(ws->sleep_ns << 1, p->max_sleep_ns);
+  ws->sleeps++;
+
+  if (p->doorbell_wait) {
+    p->doorbell_wait(p->doorbell_arg, ws->sleep_ns);
+  } else {
+#ifndef ENCLAVE
+    struct timespec ts = { ws->sleep_ns / 1000000000UL, ws->sleep_ns % 1000000000UL };
+    nanosleep(&ts, NULL);
+#else
+    asm volatile ("pause" ::: "memory"); // no syscalls inside the enclave
+#endif
+  }
+}
+
+static void queue_wait_done(queue_object *queue_obj, wait_state *ws)
+{
+  if (likely(ws->polls == 0))
+    return;
+
+  __atomic_add_fetch(&queue_obj->wait_stats.spins, ws->polls - ws->pauses - ws->sleeps, __ATOMIC_RELAXED);
+  if (ws->pauses)
+    __atomic_add_fetch(&queue_obj->wait_stats.pauses, ws->pauses, __ATOMIC_RELAXED);
+  if (ws->sleeps) {
+    __atomic_add_fetch(&queue_obj->wait_stats.sleeps, ws->sleeps, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&queue_obj->wait_stats.wakeups, 1, __ATOMIC_RELAXED);
+  }
+}
+
+int s_variable_multi_dequeue_wait(queue_object *queue_obj, void *source, unsigned int max_requested, unsigned int idx)
+{
+  wait_state ws = { 0, };
+  int ret;
+
+  while ((ret = s_variable_multi_dequeue(queue_obj, source, max_requested, idx)) == 0 && max_requested != 0)
+    queue_wait(queue_obj, &ws);
+  queue_wait_done(queue_obj, &ws);
+
+  return ret;
+}
+
+void set_task_recv_weight(void *opq, int socket, unsigned int weight)
+{
+  task_queue_opaque *opaque = opq;
+
+  assert(opaque && socket >= 0 && socket < VCA_SOCKETS);
+  opaque->recv_weight[socket] = weight;
+  opaque->recv_credit[socket] = 0;
+}
+
+void set_task_wait_policy(void *opq, const wait_policy *policy)
+{
+  task_queue_opaque *opaque = opq;
+  int i;
+
+  // receive queues wait by the policy, submit queues ring its doorbell when they publish
+  for (i = 0; i < VCA_SOCKETS; i++) {
+    if (opaque->rx_q_objs[i])
+      queue_set_wait_policy(opaque->rx_q_objs[i], policy);
+    if (opaque->tx_q_objs[i])
+      queue_set_wait_policy(opaque->tx_q_objs[i], policy);
+  }
+}
+
+#ifndef ENCLAVE
+// only the queue set up calls, which the enclave build leaves out
+static void queue_init_stats(queue_object *queue_obj)
+{
+  queue_obj->stats = NULL;
+  queue_obj->stats_id = __atomic_fetch_add(&stats_next_id, 1, __ATOMIC_RELAXED);
+}
+#endif
+
+static channel_stats *stats_get(queue_object *queue_obj, unsigned int idx)
+{
+  unsigned int slot = queue_obj->stats_id % STATS_CACHE_SIZE;
+  stats_block *b;
+
+  if (likely(stats_cache[slot].id == queue_obj->stats_id))
+    return &stats_cache[slot].block->channel[idx];
+
+  for (b = __atomic_load_n(&queue_obj->stats, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+    if (b->owner == (void *)stats_cache)
+      break;
+
+  if (b == NULL) {
+    b = memalign(CACHE_LINE_SIZE, sizeof(stats_block) + queue_obj->channels * sizeof(channel_stats));
+    assert(b != NULL);
+    memset(b, 0, sizeof(stats_block) + queue_obj->channels * sizeof(channel_stats));
+    b->owner = (void *)stats_cache;
+    b->next = __atomic_load_n(&queue_obj->stats, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&queue_obj->stats, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+
+  stats_cache[slot].id = queue_obj->stats_id;
+  stats_cache[slot].block = b;
+  return &b->channel[idx];
+}
+
+static inline unsigned long stats_clock(void)
+{
+#ifndef ENCLAVE
+  struct timespec ts;
+
+  if (unlikely(stats_flags & STATS_LATENCY)) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+  }
 #endif
-        max_available = (RP_VAL-LC_VAL) % MAX_ITEMS;
-    
-        if (likely(max_requested <= max_available)) {
-                num_elements = MIN(UPPER_BOUND-LC_VAL, max_requested);
-                remaining_elements = max_requested - num_elements;
-                memcpy( (void *) source, (void *)(ring + LC_VAL), num_elements << 3);
-                if (unlikely(remaining_elements != 0)) {
-                        memcpy((void *)((unsigned long)source + (num_elements << 3)), (void *)(ring + LOWER_BOUND), remaining_elements << 3);
-                        prod_cons_array[real_idx + REMOTE_CONSUMER] = ring[real_idx + LOCAL_CONSUMER] = LOWER_BOUND + remaining_elements;
-                } else {
-                        prod_cons_array[real_idx + REMOTE_CONSUMER] = ring[real_idx + LOCAL_CONSUMER] = LC_VAL + num_elements;
-                }
-
-                return max_requested;
-        }
+  return 0;
+}
 
-        return 0;
+static inline void stats_histogram(unsigned long *histogram, unsigned long start)
+{
+  unsigned long ns;
+
+  if (start == 0)
+    return;
+  ns = stats_clock() - start;
+  histogram[MIN(ns ? 63 - __builtin_clzl(ns) : 0, STATS_HISTOGRAM_BUCKETS - 1)]++;
 }
 
+static void stats_submitted(queue_object *queue_obj, unsigned int idx, unsigned long bytes, unsigned long start)
+{
+  unsigned long *prod_cons_array = queue_obj->ring_4kb;
+  unsigned int real_idx = idx << queue_obj->index_shift;
+  channel_stats *st = stats_get(queue_obj, idx);
+  unsigned long used;
+
+  st->tasks_out++;
+  st->bytes_out += bytes;
+  used = ((unsigned int)prod_cons_array[real_idx + LOCAL_PRODUCER] - (unsigned int)prod_cons_array[real_idx + queue_obj->consumer_word])
+    & (queue_obj->slots - 1);
+  if (used > st->max_occupancy)
+    st->max_occupancy = used;
+  stats_histogram(st->submit_ns, start);
+}
 
+// a reservation on channel idx found the ring full
+static void ring_full(queue_object *queue_obj, unsigned int idx)
+{
+  if (stats_flags & STATS_COUNTERS)
+    stats_get(queue_obj, idx)->full_retries++;
+  asm volatile ("pause" ::: "memory");
+}
 
-long common_submit_task(void *opq, long task_length, void *task_buffer, int channel, int socket)
+void queue_get_stats(queue_object *queue_obj, unsigned int idx, channel_stats *stats)
+{
+  stats_block *b;
+  channel_stats *st;
+  int i;
+
+  memset(stats, 0, sizeof(*stats));
+  for (b = __atomic_load_n(&queue_obj->stats, __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+    st = &b->channel[idx];
+    stats->tasks_out += st->tasks_out;
+    stats->bytes_out += st->bytes_out;
+    stats->full_retries += st->full_retries;
+    stats->tasks_in += st->tasks_in;
+    stats->bytes_in += st->bytes_in;
+    stats->empty_polls += st->empty_polls;
+    stats->max_occupancy = MAX(stats->max_occupancy, st->max_occupancy);
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+      stats->submit_ns[i] += st->submit_ns[i];
+      stats->recv_ns[i] += st->recv_ns[i];
+    }
+  }
+}
+
+void vca_mem_set_stats(unsigned int flags)
+{
+  stats_flags = flags;
+}
+
+int vca_mem_get_stats(void *opq, int socket, unsigned int channel, channel_stats *tx, channel_stats *rx)
 {
   task_queue_opaque *opaque = opq;
-  long ret;
-  int burst_num, retries = 0;
+
+  if (!opaque || socket < 0 || socket >= VCA_SOCKETS)
+    return GENERAL_ERROR;
+  if (tx) {
+    if (!opaque->tx_q_objs[socket] || channel >= opaque->tx_q_objs[socket]->channels)
+      return GENERAL_ERROR;
+    queue_get_stats(opaque->tx_q_objs[socket], channel, tx);
+  }
+  if (rx) {
+    if (!opaque->rx_q_objs[socket] || channel >= opaque->rx_q_objs[socket]->channels)
+      return GENERAL_ERROR;
+    queue_get_stats(opaque->rx_q_objs[socket], channel, rx);
+  }
+  return 0;
+}
+
+// ring items taken by len bytes
+static inline unsigned long bytes_to_items(queue_object *q, unsigned long len)
+{
+  return (len + (1UL << q->slot_order) - 1) >> q->slot_order;
+}
+
+unsigned long task_footprint(queue_object *queue_obj, long task_length)
+{
+  if (queue_obj->framing == FRAMING_COMPACT)
+    return (bytes_to_items(queue_obj, sizeof(compact_header)) + bytes_to_items(queue_obj, task_length)) << queue_obj->slot_order;
+
+  return (((task_length - 1) / BUFF_SIZE_BOUNDARY) + 2) * BUFF_SIZE_BOUNDARY;
+}
+
+static inline int reserve_as(queue_object *q, unsigned int idx, unsigned int n_items, ring_window *w, int stream_owner)
+{
+  return stream_owner ? ring_reserve_shared(q, idx, n_items, w, 1) : ring_reserve(q, idx, n_items, w);
+}
+
+// common_submit_task for FRAMING_COMPACT: a small header and the payload rounded up to whole slots
+static long compact_submit_task(queue_object *q, long task_length, iov_cursor *c, int channel)
+{
+  compact_header ch = { COMPACT_MAGIC, 0, task_length };
+  unsigned int hdr_items = bytes_to_items(q, sizeof(ch));
+  unsigned long items = hdr_items + bytes_to_items(q, task_length);
+  unsigned long done, chunk;
+  unsigned int n;
+  int shared = multi_producer(q, channel), pending;
+  ring_window w;
+
+  // Whole task in one window: one fence and one remote index write per task
+  if (items < q->slots) {
+    while (!ring_reserve(q, channel, items, &w))
+      ring_full(q, channel);
+    ring_window_copy(q, &w, 0, &ch, sizeof(ch));
+    ring_window_copyv(q, &w, (unsigned long)hdr_items << q->slot_order, c, task_length);
+    ring_commit(q, &w);
+    return task_length;
+  }
+
+  // Otherwise stream it through the channel, publishing only when the ring fills up
+  if (shared)
+    while (!ring_stream_lock(q, channel))
+      asm volatile ("pause" ::: "memory");
+
+  while (!reserve_as(q, channel, hdr_items, &w, shared))
+    ring_full(q, channel);
+  ring_window_copy(q, &w, 0, &ch, sizeof(ch));
+  ring_commit_batch(q, &w);
+  pending = 1;
+
+  for (done = 0; done < task_length; done += chunk) {
+    n = MIN(bytes_to_items(q, task_length - done), q->slots - 1);
+    while (!reserve_as(q, channel, n, &w, shared)) {
+      if (pending) {
+        ring_flush(q, channel);
+        pending = 0;
+      }
+      n = (n + 1) >> 1;
+      ring_full(q, channel);
+    }
+    chunk = MIN((unsigned long)n << q->slot_order, task_length - done);
+    ring_window_copyv(q, &w, 0, c, chunk);
+    ring_commit_batch(q, &w);
+    pending = 1;
+  }
+
+  ring_flush(q, channel);
+  if (shared)
+    ring_stream_unlock(q, channel);
+  return task_length;
+}
+
+static long compact_recv_task(queue_object *q, long *task_length, iov_cursor *c, int channel)
+{
+  unsigned int hdr_items = bytes_to_items(q, sizeof(compact_header));
+  unsigned long done, chunk, n;
+  compact_header ch;
+  ring_window w;
+
+  if (!ring_peek(q, channel, hdr_items, &w))
+    return -1;
+  ring_window_read(q, &w, 0, &ch, sizeof(ch));
+  ring_release(q, &w);
+
+  assert((ch.magic == COMPACT_MAGIC) && (ch.payload_size != 0));
+
+  *task_length = ch.payload_size;
+
+  for (done = 0; done < ch.payload_size; done += chunk) {
+    while (!ring_peek(q, channel, 0, &w));
+    n = bytes_to_items(q, ch.payload_size - done);
+    if (w.total_items > n)
+      ring_peek(q, channel, n, &w);
+    chunk = MIN((unsigned long)w.total_items << q->slot_order, ch.payload_size - done);
+    ring_window_readv(q, &w, 0, c, chunk);
+    ring_release(q, &w);
+  }
+
+  return 0;
+}
+
+// common_submit_task on a multi-producer channel
+static long shared_submit_task(queue_object *q, task_header *th, long task_length, iov_cursor *c, int channel)
+{
+  unsigned int burst_items = BUFF_SIZE_BOUNDARY >> q->slot_order;
+  unsigned long items = (th->total_bursts + 1) * burst_items;
+  int burst_num, bursts;
+  ring_window w;
+
+  // A task that fits the ring takes one reservation and can interleave with other producers
+  if (items < q->slots) {
+    while (!ring_reserve(q, channel, items, &w))
+      ring_full(q, channel);
+    ring_window_copy(q, &w, 0, th, BUFF_SIZE_BOUNDARY);
+    ring_window_copyv(q, &w, BUFF_SIZE_BOUNDARY, c, task_length);
+    ring_commit(q, &w);
+    return task_length;
+  }
+
+  // A larger one locks the channel and streams through it like common_submit_task
+  while (!ring_stream_lock(q, channel))
+    asm volatile ("pause" ::: "memory");
+
+  while (!ring_reserve_shared(q, channel, burst_items, &w, 1))
+    ring_full(q, channel);
+  ring_window_copy(q, &w, 0, th, BUFF_SIZE_BOUNDARY);
+  ring_commit(q, &w);
+
+  for (burst_num = 0; burst_num < th->total_bursts ; burst_num += bursts) {
+    bursts = MIN(th->total_bursts - burst_num, (q->slots / burst_items) - 1);
+    while (!ring_reserve_shared(q, channel, bursts * burst_items, &w, 1)) {
+      bursts = (bursts + 1) >> 1;
+      ring_full(q, channel);
+    }
+    ring_window_copyv(q, &w, 0, c, MIN((unsigned long)bursts * BUFF_SIZE_BOUNDARY, task_length - (unsigned long)burst_num * BUFF_SIZE_BOUNDARY));
+    ring_commit(q, &w);
+  }
+
+  ring_stream_unlock(q, channel);
+  return task_length;
+}
+
+static long submit_taskv(queue_object *q, const struct iovec *iov, int iovcnt, int channel)
+{
+  unsigned int burst_items = BUFF_SIZE_BOUNDARY >> q->slot_order;
+  unsigned long task_length = iov_length(iov, iovcnt);
+  iov_cursor c = { iov, iovcnt, 0 };
+  int burst_num, bursts, pending = 0;
   task_header th;
+  ring_window w;
   //  printf("submit task len %d, channel %d socket %d\n", task_length, channel, socket);
 
+  assert(task_length != 0);
+
+  if (q->framing == FRAMING_COMPACT)
+    return compact_submit_task(q, task_length, &c, channel);
+
   th.total_bursts = ((task_length - 1) / BUFF_SIZE_BOUNDARY) + 1;
   th.payload_size = task_length; 
   th.magic = MAGIC;
-  
-  do {
-    ret = s_variable_multi_enqueue(opaque->tx_q_objs[socket], &th, NUM_ITEMS, channel);
-    } while (ret != NUM_ITEMS); //&& (++retries <= MAX_RETRY));
-
-  // Start enqueing 
-  for (burst_num = 0; burst_num < th.total_bursts ; burst_num++) {
-    do {
-        ret = s_variable_multi_enqueue(opaque->tx_q_objs[socket], task_buffer + (burst_num * BUFF_SIZE_BOUNDARY), NUM_ITEMS, channel);
-    } while (ret != NUM_ITEMS); //&& (++retries <= MAX_RETRY));
 
+  if (multi_producer(q, channel))
+    return shared_submit_task(q, &th, task_length, &c, channel);
+  
+  // Copy header and bursts without publishing; the producer index is only
+  // written back to the consumer when the ring fills up and once at the end
+  while (!ring_reserve(q, channel, burst_items, &w))
+    ring_full(q, channel);
+  ring_window_copy(q, &w, 0, &th, BUFF_SIZE_BOUNDARY);
+  ring_commit_batch(q, &w);
+  pending = 1;
+
+  // Start enqueing as many bursts per copy as the ring takes, straight from the caller's segments
+  for (burst_num = 0; burst_num < th.total_bursts ; burst_num += bursts) {
+    bursts = MIN(th.total_bursts - burst_num, (q->slots / burst_items) - 1);
+    while (!ring_reserve(q, channel, bursts * burst_items, &w)) {
+      if (pending) {
+        ring_flush(q, channel); // let the consumer drain what is already copied
+        pending = 0;
+      }
+      bursts = (bursts + 1) >> 1;
+      ring_full(q, channel);
+    }
+    ring_window_copyv(q, &w, 0, &c, MIN((unsigned long)bursts * BUFF_SIZE_BOUNDARY, task_length - (unsigned long)burst_num * BUFF_SIZE_BOUNDARY));
+    ring_commit_batch(q, &w);
+    pending = 1;
   }
+
+  ring_flush(q, channel);
   return task_length;
 }
 
-long common_recv_task(void *opq, long *task_length, void *task_buffer, int channel, int socket)
+// The queue of socket for a task call, NULL if there is none or it has no such channel
+static queue_object *task_queue(queue_object **q_objs, int channel, int socket)
+{
+  if ((socket < 0) || (socket >= VCA_SOCKETS) || !q_objs[socket])
+    return NULL;
+  if ((channel < 0) || ((unsigned int)channel >= q_objs[socket]->channels))
+    return NULL;
+  return q_objs[socket];
+}
+
+long common_submit_taskv(void *opq, const struct iovec *iov, int iovcnt, int channel, int socket)
 {
   task_queue_opaque *opaque = opq;
-  int burst_num=0; //Later use round robin to find from which channel data needs to be acquired
+  queue_object *q;
+  unsigned long start = stats_clock();
   long ret;
-  task_header th;
 
-  assert(opaque && task_buffer);
+  assert(opaque && iov);
 
-  //  printf("submit task len %d, channel %d socket %d\n", task_length, channel, socket);
-  
-  ret = s_variable_multi_dequeue(opaque->rx_q_objs[socket], &th, NUM_ITEMS, channel);
+  q = task_queue(opaque->tx_q_objs, channel, socket);
+  if (!q)
+    return -1;
+  ret = submit_taskv(q, iov, iovcnt, channel);
+
+  if (stats_flags & STATS_COUNTERS)
+    stats_submitted(q, channel, ret, start);
+  return ret;
+}
+
+long common_submit_task(void *opq, long task_length, void *task_buffer, int channel, int socket)
+{
+  struct iovec iov = { task_buffer, task_length };
+
+  return common_submit_taskv(opq, &iov, 1, channel, socket);
+}
+
+static long recv_taskv(queue_object *q, long *task_length, const struct iovec *iov, int iovcnt, int channel)
+{
+  int burst_num=0; //Later use round robin to find from which channel data needs to be acquired
+  unsigned int burst_items;
+  iov_cursor c = { iov, iovcnt, 0 };
+  task_header th;
+  ring_window w;
 
-   if (ret != NUM_ITEMS)
+  if (q->framing == FRAMING_COMPACT)
+    return compact_recv_task(q, task_length, &c, channel);
+  
+  burst_items = BUFF_SIZE_BOUNDARY >> q->slot_order;
+  if (!ring_peek(q, channel, burst_items, &w))
         return -1;
+  ring_window_read(q, &w, 0, &th, BUFF_SIZE_BOUNDARY);
+  ring_release(q, &w);
 
   assert ((th.total_bursts != 0) && (th.payload_size != 0) && (th.magic == MAGIC));
 
   *task_length = th.payload_size;
 
-  // Start dequeing 
+  // Start dequeing, only the payload bytes of the last burst go to the caller
   for (burst_num = 0; burst_num < th.total_bursts ; burst_num++) {
-    do {
-        ret = s_variable_multi_dequeue(opaque->rx_q_objs[socket], task_buffer + (burst_num * BUFF_SIZE_BOUNDARY), NUM_ITEMS, channel);
-    } while (ret != NUM_ITEMS);
+    while (!ring_peek(q, channel, burst_items, &w));
+    ring_window_readv(q, &w, 0, &c, MIN(BUFF_SIZE_BOUNDARY, th.payload_size - (unsigned long)burst_num * BUFF_SIZE_BOUNDARY));
+    ring_release(q, &w);
+  }
+
+  return 0;
+}
+
+long common_recv_taskv(void *opq, long *task_length, const struct iovec *iov, int iovcnt, int channel, int socket)
+{
+  task_queue_opaque *opaque = opq;
+  queue_object *q;
+  unsigned long start = stats_clock();
+  channel_stats *st;
+  long ret;
+
+  assert(opaque && iov);
+
+  q = task_queue(opaque->rx_q_objs, channel, socket);
+  if (!q)
+    return -1;
+  ret = recv_taskv(q, task_length, iov, iovcnt, channel);
+
+  if (stats_flags & STATS_COUNTERS) {
+    st = stats_get(q, channel);
+    if (ret != 0) {
+      st->empty_polls++;
+    } else {
+      st->tasks_in++;
+      st->bytes_in += *task_length;
+      stats_histogram(st->recv_ns, start);
+    }
+  }
+  return ret;
+}
+
+long common_recv_task(void *opq, long *task_length, void *task_buffer, int channel, int socket)
+{
+  // the caller guarantees room for the task, rounded up to BUFF_SIZE_BOUNDARY
+  struct iovec iov = { task_buffer, LONG_MAX };
+
+  assert(task_buffer);
+  return common_recv_taskv(opq, task_length, &iov, 1, channel, socket);
+}
+
+
+// ring items of a stream payload of len bytes, trailing burst padding included
+static unsigned long stream_items(queue_object *q, unsigned long len)
+{
+  if (q->framing == FRAMING_COMPACT)
+    return bytes_to_items(q, len);
+
+  return (((len - 1) / BUFF_SIZE_BOUNDARY) + 1) * (BUFF_SIZE_BOUNDARY >> q->slot_order);
+}
+
+// copy bytes (whole slots) from src into the channel of s, or only reserve them if src is NULL.
+// Blocks while the ring is full: the slots released by the receiver are the credits of the sender
+static void stream_put(task_stream *s, const void *src, unsigned long bytes)
+{
+  queue_object *q = s->q;
+  unsigned long done, chunk;
+  unsigned int n;
+  int pending = 0;
+  ring_window w;
+
+  for (done = 0; done < bytes; done += chunk) {
+    n = MIN(bytes_to_items(q, bytes - done), q->slots - 1);
+    while (!reserve_as(q, s->channel, n, &w, s->stream_owner)) {
+      if (pending) {
+        ring_flush(q, s->channel); // hand over what is copied before waiting for credits
+        pending = 0;
+      }
+      n = (n + 1) >> 1;
+      ring_full(q, s->channel);
+    }
+    chunk = (unsigned long)n << q->slot_order;
+    if (src && s->dma)
+      ring_window_copy_dma(q, &w, (const char *)src + done, chunk);
+    else if (src)
+      ring_window_copy(q, &w, 0, (const char *)src + done, chunk);
+    ring_commit_batch(q, &w);
+    pending = 1;
+  }
+  s->items -= bytes >> q->slot_order;
+  if (src && (stats_flags & STATS_COUNTERS))
+    stats_get(q, s->channel)->bytes_out += bytes;
+}
+
+long submit_stream_begin(void *opq, task_stream *s, long task_length, int channel, int socket)
+{
+  task_queue_opaque *opaque = opq;
+  queue_object *q;
+  unsigned int hdr_items;
+  task_header th;
+  compact_header ch = { COMPACT_MAGIC, 0, task_length };
+  ring_window w;
+
+  assert(opaque && s && task_length > 0);
+
+  q = task_queue(opaque->tx_q_objs, channel, socket);
+  if (!q)
+    return -1;
+  s->q = q;
+  s->channel = channel;
+  s->remaining = task_length;
+  s->items = stream_items(q, task_length);
+  s->offset = 0;
+  s->dma = 0;
+
+  // nothing else may go into the channel until submit_stream_end
+  s->stream_owner = multi_producer(q, channel);
+  if (s->stream_owner)
+    while (!ring_stream_lock(q, channel))
+      asm volatile ("pause" ::: "memory");
+
+  hdr_items = bytes_to_items(q, (q->framing == FRAMING_COMPACT) ? sizeof(ch) : BUFF_SIZE_BOUNDARY);
+  while (!reserve_as(q, channel, hdr_items, &w, s->stream_owner))
+    ring_full(q, channel);
+  if (q->framing == FRAMING_COMPACT) {
+    ring_window_copy(q, &w, 0, &ch, sizeof(ch));
+  } else {
+    th.total_bursts = ((task_length - 1) / BUFF_SIZE_BOUNDARY) + 1;
+    th.payload_size = task_length;
+    th.magic = MAGIC;
+    ring_window_copy(q, &w, 0, &th, BUFF_SIZE_BOUNDARY);
+  }
+  ring_commit_batch(q, &w);
+
+  return 0;
+}
+
+long submit_stream_write(task_stream *s, const void *buffer, long length)
+{
+  unsigned long slot_size = 1UL << s->q->slot_order;
+  const char *src = buffer;
+  unsigned long len = length, n;
+
+  assert(s && (buffer || length == 0) && len <= s->remaining);
+
+  s->remaining -= len;
+
+  // complete the slot a previous write left partial
+  if (s->offset != 0) {
+    n = MIN(len, slot_size - s->offset);
+    memcpy(s->slot + s->offset, src, n);
+    s->offset += n;
+    src += n;
+    len -= n;
+    if (s->offset == slot_size) {
+      stream_put(s, s->slot, slot_size);
+      s->offset = 0;
+    }
+  }
+
+  n = len & ~(slot_size - 1);
+  stream_put(s, src, n);
+
+  s->offset += len - n;
+  memcpy(s->slot, src + n, len - n);
+
+  // make every write visible, the receiver can start while we read the next chunk
+  ring_flush(s->q, s->channel);
+  return length;
+}
+
+long submit_stream_end(task_stream *s)
+{
+  unsigned long slot_size = 1UL << s->q->slot_order;
+
+  assert(s);
+  if (s->remaining != 0)
+    return GENERAL_ERROR;
+
+  if (s->offset != 0) {
+    memset(s->slot + s->offset, 0, slot_size - s->offset);
+    stream_put(s, s->slot, slot_size);
+    s->offset = 0;
+  }
+  stream_put(s, NULL, s->items << s->q->slot_order);
+
+  ring_flush(s->q, s->channel);
+  if (s->stream_owner)
+    ring_stream_unlock(s->q, s->channel);
+  if (stats_flags & STATS_COUNTERS)
+    stats_get(s->q, s->channel)->tasks_out++;
+  return 0;
+}
+
+long recv_stream_begin(void *opq, task_stream *s, long *task_length, int channel, int socket)
+{
+  task_queue_opaque *opaque = opq;
+  queue_object *q;
+  unsigned int hdr_items;
+  task_header th;
+  compact_header ch;
+  ring_window w;
+
+  assert(opaque && s && task_length);
+
+  q = task_queue(opaque->rx_q_objs, channel, socket);
+  if (!q)
+    return -1;
+  hdr_items = bytes_to_items(q, (q->framing == FRAMING_COMPACT) ? sizeof(ch) : BUFF_SIZE_BOUNDARY);
+  if (!ring_peek(q, channel, hdr_items, &w))
+    return -1;
+
+  if (q->framing == FRAMING_COMPACT) {
+    ring_window_read(q, &w, 0, &ch, sizeof(ch));
+    assert((ch.magic == COMPACT_MAGIC) && (ch.payload_size != 0));
+    *task_length = ch.payload_size;
+  } else {
+    ring_window_read(q, &w, 0, &th, BUFF_SIZE_BOUNDARY);
+    assert((th.total_bursts != 0) && (th.payload_size != 0) && (th.magic == MAGIC));
+    *task_length = th.payload_size;
+  }
+  ring_release(q, &w);
+
+  s->q = q;
+  s->channel = channel;
+  s->stream_owner = 0;
+  s->remaining = *task_length;
+  s->items = stream_items(q, *task_length);
+  s->offset = 0;
+  s->dma = 0;
+  return 0;
+}
+
+// hand what is available of the task of s, up to length bytes, to put as it sits in the ring, and give
+// back the credits of every slot gone through completely. Blocks for at least one byte, 0 at the end
+static long stream_take(task_stream *s, long length, void (*put)(void *arg, const void *src, unsigned long len), void *arg)
+{
+  queue_object *q = s->q;
+  unsigned long slot_mask = (1UL << q->slot_order) - 1;
+  unsigned long len, consumed, span_bytes, first;
+  wait_state ws = { 0, };
+  ring_window w;
+
+  if (s->remaining == 0 || length == 0)
+    return 0;
+
+  while (!ring_peek(q, s->channel, 0, &w))
+    queue_wait(q, &ws);
+  queue_wait_done(q, &ws);
+
+  // everything available of this task, up to length
+  len = ((unsigned long)MIN(w.total_items, s->items) << q->slot_order) - s->offset;
+  len = MIN(len, MIN((unsigned long)length, s->remaining));
+  span_bytes = (unsigned long)w.span[0].items << q->slot_order;
+  if (s->offset < span_bytes) {
+    first = MIN(len, span_bytes - s->offset);
+    put(arg, (char *)w.span[0].addr + s->offset, first);
+    if (len > first)
+      put(arg, w.span[1].addr, len - first);
+  } else {
+    put(arg, (char *)w.span[1].addr + (s->offset - span_bytes), len);
+  }
+  if (stats_flags & STATS_COUNTERS) {
+    stats_get(q, s->channel)->bytes_in += len;
+    stats_get(q, s->channel)->tasks_in += (len == s->remaining);
+  }
+
+  // hand back the credits of every slot read completely
+  s->remaining -= len;
+  consumed = s->offset + len;
+  if (s->remaining == 0)
+    consumed = (consumed + slot_mask) & ~slot_mask;
+  s->offset = consumed & slot_mask;
+  if ((consumed >> q->slot_order) != 0) {
+    ring_peek(q, s->channel, consumed >> q->slot_order, &w);
+    ring_release(q, &w);
+    s->items -= consumed >> q->slot_order;
+  }
+
+  return len;
+}
+
+typedef struct {
+  queue_object *q;
+  char *dst;
+} stream_reader;
+
+static void stream_read_put(void *arg, const void *src, unsigned long len)
+{
+  stream_reader *r = arg;
+
+  ring_copy_out(r->q, r->dst, src, len);
+  r->dst += len;
+}
+
+long recv_stream_read(task_stream *s, void *buffer, long length)
+{
+  stream_reader r = { s->q, buffer };
+
+  assert(s && buffer && length >= 0);
+
+  return stream_take(s, length, stream_read_put, &r);
+}
+
+static void stream_splice_put(void *arg, const void *src, unsigned long len)
+{
+  submit_stream_write(arg, src, len);
+}
+
+long stream_splice(task_stream *out, task_stream *in, long length)
+{
+  long done = 0, n;
+
+  assert(out && in && length >= 0 && (unsigned long)length <= out->remaining);
 
+  out->dma = 1;
+  while (done < length && (n = stream_take(in, length - done, stream_splice_put, out)) > 0)
+    done += n;
+  out->dma = 0;
+
+  return done;
+}
+
+long recv_stream_end(task_stream *s)
+{
+  ring_window w;
+
+  assert(s);
+
+  // skip whatever the caller did not read, and the burst padding
+  while (s->items != 0) {
+    while (!ring_peek(s->q, s->channel, 0, &w))
+      asm volatile ("pause" ::: "memory");
+    ring_peek(s->q, s->channel, MIN(w.total_items, s->items), &w);
+    ring_release(s->q, &w);
+    s->items -= w.total_items;
   }
 
+  s->remaining = 0;
+  s->offset = 0;
   return 0;
 }
 
 
+// socket and channel of task_id, or the next of the round robin for task_id < 0; -1 without a queue to submit to
+static int host_submit_target(task_queue_opaque *opaque, int task_id, int *channel, int *socket)
+{
+  unsigned long ticket;
+
+  if (task_id < 0) {
+    // one atomic ticket per task keeps the round robin consistent across submitting threads
+    ticket = __atomic_fetch_add(&opaque->next_submit, 1, __ATOMIC_RELAXED);
+    *socket = opaque->active_sockets[ticket % opaque->total_sockets];
+    if (!opaque->tx_q_objs[*socket])
+      return -1;
+    *channel = (ticket / opaque->total_sockets) % opaque->tx_q_objs[*socket]->channels;
+  } else {
+    *channel = TASK_ID_CHANNEL(task_id);
+    *socket = TASK_ID_SOCKET(task_id);
+  }
+  return 0;
+}
 
- long host_submit_task(void *opq, long task_length, void *task_buffer, int task_id) 
+ long host_submit_taskv(void *opq, const struct iovec *iov, int iovcnt, int task_id) 
 {
   task_queue_opaque *opaque = opq;
   int channel;
   int socket;
 
-  assert(opaque && task_buffer && task_length);                              
+  assert(opaque && iov && iovcnt > 0);                              
 
-  channel = task_id < 0 ? (opaque->next_submit_channel++) % MAX_CHANNELS : task_id % 10;
+  if (host_submit_target(opaque, task_id, &channel, &socket) < 0)
+    return -1;
+  return common_submit_taskv(opq,iov,iovcnt,channel,socket);  
+}
 
-  if (channel == 0) 
-    opaque->next_submit_socket++;
+long host_submit_stream_begin(void *opq, task_stream *s, long task_length, int task_id)
+{
+  int channel;
+  int socket;
 
-  socket = task_id < 0 ? opaque->active_sockets[opaque->next_submit_socket % opaque->total_sockets] : task_id / 10; 
+  assert(opq && s);
 
-  assert((channel < MAX_CHANNELS) && (socket < VCA_SOCKETS));                              
-  
-  return common_submit_task(opq,task_length,task_buffer,channel,socket);  
+  if (host_submit_target(opq, task_id, &channel, &socket) < 0)
+    return -1;
+  return submit_stream_begin(opq, s, task_length, channel, socket);
 }
 
+long host_submit_task(void *opq, long task_length, void *task_buffer, int task_id) 
+{
+  struct iovec iov = { task_buffer, task_length };
 
-long host_recv_task(void *opq, long *task_length, void *task_buffer, int *task_id)
+  assert(task_buffer && task_length);
+  return host_submit_taskv(opq, &iov, 1, task_id);
+}
+
+
+// smooth weighted round robin over the sockets that have a ready channel; -1 after waiting once if none has
+static int host_recv_select(task_queue_opaque *opaque, int *channel_out, wait_state *ws)
 {
-  task_queue_opaque *opaque = opq;
-  int channel,socket;
-  int got_data;
+  int channel[VCA_SOCKETS];
+  int i, best = -1, socket;
+  long total = 0;
+
+  for (i = 0; i < opaque->total_sockets; i++) {
+    socket = opaque->active_sockets[i];
+    channel[i] = queue_poll_ready(opaque->rx_q_objs[socket], opaque->recv_channel[socket]);
+    if (channel[i] < 0)
+      continue;
+    opaque->recv_credit[socket] += opaque->recv_weight[socket] ? opaque->recv_weight[socket] : 1;
+    total += opaque->recv_weight[socket] ? opaque->recv_weight[socket] : 1;
+    if (best < 0 || opaque->recv_credit[socket] > opaque->recv_credit[opaque->active_sockets[best]])
+      best = i;
+  }
 
-  assert(opaque && task_buffer && task_length && task_id);
+  // back off while no channel of any socket has data, waiting on each socket in turn
+  if (best < 0) {
+    queue_wait(opaque->rx_q_objs[opaque->active_sockets[ws->polls % opaque->total_sockets]], ws);
+    return -1;
+  }
 
-  do {
-  	channel = (opaque->next_recv_channel++) % MAX_CHANNELS;
+  socket = opaque->active_sockets[best];
+  opaque->recv_credit[socket] -= total;
+  opaque->recv_channel[socket] = channel[best] + 1;
 
-        if (channel == 0) 
-    		opaque->next_recv_socket++;
+  assert(((unsigned int)channel[best] < opaque->rx_q_objs[socket]->channels) && (socket < VCA_SOCKETS));
+  *channel_out = channel[best];
+  return socket;
+}
 
-	socket = opaque->active_sockets[opaque->next_recv_socket % opaque->total_sockets];     
+long host_recv_taskv(void *opq, long *task_length, const struct iovec *iov, int iovcnt, int *task_id)
+{
+  task_queue_opaque *opaque = opq;
+  int channel = 0, socket;
+  int got_data = -1;
+  wait_state ws = { 0, };
 
-  	assert((channel < MAX_CHANNELS) && (socket < VCA_SOCKETS));                                        
+  assert(opaque && iov && task_length && task_id);
 
-  	*task_id = (socket * 10) + (channel);
-  	got_data  = common_recv_task(opq,task_length,task_buffer,channel,socket); 
+  do {
+    if ((socket = host_recv_select(opaque, &channel, &ws)) < 0)
+      continue;
+    *task_id = TASK_ID(socket, channel);
+    got_data = common_recv_taskv(opq, task_length, iov, iovcnt, channel, socket);
   } while (got_data != 0);
 
+  queue_wait_done(opaque->rx_q_objs[socket], &ws);
   return got_data;
-  
 }
 
-long  vca_submit_task(void *opq, long task_length, void *task_buffer, int channel)
+long host_recv_stream_begin(void *opq, task_stream *s, long *task_length, int *task_id)
+{
+  task_queue_opaque *opaque = opq;
+  int channel = 0, socket;
+  wait_state ws = { 0, };
+
+  assert(opaque && s && task_length && task_id);
+
+  for (;;) {
+    if ((socket = host_recv_select(opaque, &channel, &ws)) < 0)
+      continue;
+    if (recv_stream_begin(opq, s, task_length, channel, socket) == 0)
+      break;
+  }
+  *task_id = TASK_ID(socket, channel);
+
+  queue_wait_done(opaque->rx_q_objs[socket], &ws);
+  return 0;
+}
+
+long host_recv_task(void *opq, long *task_length, void *task_buffer, int *task_id)
+{
+  struct iovec iov = { task_buffer, LONG_MAX };
+
+  assert(task_buffer);
+  return host_recv_taskv(opq, task_length, &iov, 1, task_id);
+}
+
+long  vca_submit_taskv(void *opq, const struct iovec *iov, int iovcnt, int channel)
 {
   task_queue_opaque *opaque = opq;
 
-  assert(opaque && task_buffer && task_length && (channel < MAX_CHANNELS));
+  assert(opaque && iov && iovcnt > 0);
 
-  return common_submit_task(opq,task_length,task_buffer,channel,0);
+  return common_submit_taskv(opq,iov,iovcnt,channel,0);
 }
 
+long  vca_submit_task(void *opq, long task_length, void *task_buffer, int channel)
+{
+  struct iovec iov = { task_buffer, task_length };
 
-long  vca_recv_task(void *opq, long *task_length, void *task_buffer, int channel)
+  assert(task_buffer && task_length);
+  return vca_submit_taskv(opq, &iov, 1, channel);
+}
+
+
+long  vca_recv_taskv(void *opq, long *task_length, const struct iovec *iov, int iovcnt, int channel)
 {
   task_queue_opaque *opaque = opq;
   int got_data = 0;
+  wait_state ws = { 0, };
+
+  assert(opaque && iov && task_length);
 
-  assert(opaque && task_buffer && task_length && (channel < MAX_CHANNELS));
+  // waiting on a channel the queue does not have would never end
+  if (!task_queue(opaque->rx_q_objs, channel, 0))
+    return -1;
 
   do {
-    got_data = common_recv_task(opq,task_length,task_buffer,channel,0);
+    got_data = common_recv_taskv(opq,task_length,iov,iovcnt,channel,0);
+    if (got_data != 0)
+      queue_wait(opaque->rx_q_objs[0], &ws);
   } while (got_data != 0);
   
+  queue_wait_done(opaque->rx_q_objs[0], &ws);
   return got_data;
 }
 
+long vca_recv_stream_begin(void *opq, task_stream *s, long *task_length, int channel)
+{
+  task_queue_opaque *opaque = opq;
+  wait_state ws = { 0, };
+
+  assert(opaque && s && task_length);
+
+  if (!task_queue(opaque->rx_q_objs, channel, 0))
+    return -1;
+
+  while (recv_stream_begin(opq, s, task_length, channel, 0) != 0)
+    queue_wait(opaque->rx_q_objs[0], &ws);
+
+  queue_wait_done(opaque->rx_q_objs[0], &ws);
+  return 0;
+}
+
+long  vca_recv_task(void *opq, long *task_length, void *task_buffer, int channel)
+{
+  struct iovec iov = { task_buffer, LONG_MAX };
 
+  assert(task_buffer);
+  return vca_recv_taskv(opq, task_length, &iov, 1, channel);
+}
@@ -24,6 +24,8 @@ extern "C" {
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include <sched.h>
 
 #define VCA_SOCKETS 6
 #define MAX_MAPPINGS_PER_VCA_SOCKET 3 
@@ -49,22 +51,55 @@ extern "C" {
 
 #define ENQUEUE_MAP_NUMBER 0
 #define DEQUEUE_MAP_NUMBER 1
+#define LOCAL_QUEUE_TYPE 2 // queue_type of init_local_queue, producer and consumer in this process
 #define SHMEM_MAP_NUMBER_0 0
 #define SHMEM_MAP_NUMBER_1 1
 #define SHMEM_MAP_NUMBER_2 2
 
+// Transport carrying the rings between the two sides of a socket, see vca_mem_set_transport
+#define VCA_TRANSPORT_PCIE 0 // card memory through the PLX aperture (default)
+#define VCA_TRANSPORT_LOOPBACK 1 // two processes of one machine sharing memfd memory, on hugetlbfs when huge pages are reserved
+
 
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
 
-#define MAX_ITEMS 8192 // For now its fixed number of items per channel;
+// Default ring geometry; init_enqueue_params/init_dequeue_params take channels, slots and slot size at runtime
+#define MAX_ITEMS 8192 // Default number of slots per channel
 #define MAX_ITEMS_ORDER 13 // 2^13 is 8192 
 #define MAX_CHANNELS_PER_VCA_SOCKET 8
-#define REMOTE_PRODUCER 65536 //MAX_ITEMS * MAX_CHANNELS_PER_VCA_SOCKET 
-#define LOCAL_CONSUMER 65537 //(MAX_ITEMS * MAX_CHANNELS_PER_VCA_SOCKET + 1) //8193 local consumer
-
+#define MAX_QUEUE_PAIRS 16 // queue pairs per socket, see init_host_task_pair
+#define DEFAULT_SLOT_SIZE 8 // Default slot size is one unsigned long
+// Index page at the end of the ring (queue_object index_offset, 65536 for the default geometry)
+#define REMOTE_PRODUCER 0
+#define LOCAL_CONSUMER 1 // RING_LAYOUT_PACKED only, see queue_object consumer_word
+#define MAX_QUEUE_CHANNELS (PAGE_SIZE / (2 * sizeof(unsigned long))) // as many as fit one index page in the packed layout
+
+// Index page held by the producer (ring_4kb)
 #define LOCAL_PRODUCER 0
-#define REMOTE_CONSUMER 1
+#define REMOTE_CONSUMER 1 // RING_LAYOUT_PACKED only, see queue_object consumer_word
+
+// On-wire layout of the index pages, agreed on in the transfer_mapping handshake
+#define CACHE_LINE_SIZE 64
+#define RING_LAYOUT_PACKED 1 // producer and consumer index of all channels in adjacent words
+#define RING_LAYOUT_CACHELINE 2 // producer and consumer index of every channel on a cache line of its own
+#define RING_LAYOUT_READY 3 // RING_LAYOUT_CACHELINE plus a ready flag byte per channel, set by producers after publishing
+#define RING_LAYOUT_VERSION RING_LAYOUT_READY // newest layout supported by this library
+
+// Set in the local producer index of a multi-producer channel while one task streams through it exclusively
+#define RING_STREAM_LOCK (1UL << 63)
+
+// How common_submit_task lays out a task in the ring, chosen by the dequeue side of a queue
+#define FRAMING_BURST 0 // task_header plus the payload in BUFF_SIZE_BOUNDARY bursts
+#define FRAMING_COMPACT 1 // compact_header plus the payload rounded up to the slot size
+#define COMPACT_MAGIC 0xcafef00d
+
+// How payload is copied into (enqueue) or out of (dequeue) the ring, see queue_set_copy_kernel
+#define COPY_KERNEL_AUTO -1
+#define COPY_KERNEL_MEMCPY 0
+#define COPY_KERNEL_AVX2 1 // 32 byte non-temporal stores into the ring, 32 byte loads out of it
+#define COPY_KERNEL_AVX512 2 // the same with 64 bytes, a whole write combining line per store
+
 #define HOST_CNT 2
 #define NODE_CNT 3
 #define HOST_ARR 4
@@ -87,24 +122,141 @@ typedef struct {
     unsigned int present : 1;
 } PagemapEntry;
 
+#define PAGEMAP_PFN_MASK (((unsigned long)1 << 54) - 1)
+#define PAGEMAP_PRESENT ((unsigned long)1 << 63)
+#define PAGEMAP_BATCH 512 // pagemap entries read per pread
+
+// Open /proc/self/pagemap kept around for translating many pages
+typedef struct {
+    int pagemap_fd;
+    long page_size;
+} phys_translator;
+
+// Physically contiguous piece of a virtual range
+typedef struct {
+    uintptr_t vaddr;
+    unsigned long phys;
+    unsigned long size;
+} phys_extent;
+
+// Ring geometry of a queue. slots and slot_size must be powers of two, slot_size between 8 and BUFF_SIZE_BOUNDARY
+typedef struct {
+    unsigned int channels;
+    unsigned int slots; // per channel
+    unsigned int slot_size; // in bytes
+    unsigned int layout; // RING_LAYOUT_*, 0 for the newest one
+    unsigned int framing; // FRAMING_*
+} queue_params;
+
+#define DEFAULT_QUEUE_PARAMS { MAX_CHANNELS_PER_VCA_SOCKET, MAX_ITEMS, DEFAULT_SLOT_SIZE, RING_LAYOUT_VERSION, FRAMING_BURST }
+
+// How a consumer waits on an empty channel: busy poll, then poll with a pause in between,
+// then sleep with exponential backoff (or wait for a doorbell if one is provided)
+typedef struct {
+    unsigned long spin_polls; // polls before backing off, ~0UL polls forever
+    unsigned long pause_polls; // polls separated by a pause instruction after that
+    unsigned long min_sleep_ns; // first sleep, doubled on every further empty poll
+    unsigned long max_sleep_ns;
+    int (*doorbell_wait)(void *arg, unsigned long timeout_ns); // optional, replaces the sleep
+    void (*doorbell_ring)(void *arg); // optional, called by the producer whenever it publishes
+    void *doorbell_arg;
+} wait_policy;
+
+#define WAIT_POLICY_SPIN { ~0UL, 0, 0, 0, NULL, NULL, NULL }
+#define WAIT_POLICY_ADAPTIVE { 4096, 4096, 1000, 1000000, NULL, NULL, NULL }
+
 typedef struct {
-    void *ring_2mb;
+    unsigned long spins;
+    unsigned long pauses;
+    unsigned long sleeps;
+    unsigned long wakeups; // waits that ended with data after sleeping
+} wait_stats;
+
+// Telemetry kept by the task calls, see vca_mem_set_stats
+#define STATS_COUNTERS 1 // tasks, bytes, full ring retries, empty polls and occupancy (default)
+#define STATS_LATENCY 2 // submit and receive latency histograms, one clock read per call; not in the enclave
+#define STATS_HISTOGRAM_BUCKETS 32 // bucket i counts calls that took 2^i to 2^(i+1)-1 ns
+
+typedef struct {
+    unsigned long tasks_out;
+    unsigned long bytes_out;
+    unsigned long full_retries; // reservations that found the ring full
+    unsigned long tasks_in;
+    unsigned long bytes_in;
+    unsigned long empty_polls; // receive calls that found no task
+    unsigned long max_occupancy; // most slots in use right after a submit
+    unsigned long submit_ns[STATS_HISTOGRAM_BUCKETS]; // common_submit_task, waiting for room included
+    unsigned long recv_ns[STATS_HISTOGRAM_BUCKETS]; // common_recv_task calls that got a task
+} __attribute__((aligned(CACHE_LINE_SIZE))) channel_stats;
+
+// Counters of one thread for all channels of a queue
+typedef struct stats_block {
+    struct stats_block *next;
+    void *owner;
+    channel_stats channel[];
+} stats_block;
+
+// Producers of a multi-producer channel reserve slots with a CAS on the local
+// producer index and publish in reservation order; published is the index the
+// consumer has been told about so far
+typedef struct mpsc_channel {
+    unsigned long published;
+    int enabled;
+} __attribute__((aligned(CACHE_LINE_SIZE))) mpsc_channel;
+
+typedef struct {
+    void *ring_2mb; // data slots of all channels followed by the index page; may span several 2MB pages
     void *ring_4kb;
     int queue_type; 
     int socket; 
+    unsigned int channels;
+    unsigned int slots;
+    unsigned int slots_order; // log2(slots)
+    unsigned int slot_order; // log2(slot_size)
+    unsigned long index_offset; // offset of the index page in ring_2mb in unsigned longs
+    unsigned long ring_size; // bytes mapped for ring_2mb
+    unsigned int layout; // RING_LAYOUT_*
+    unsigned int index_shift; // log2 of index words per channel
+    unsigned int consumer_word; // offset of the consumer index from the producer index of a channel
+    unsigned long index_size; // bytes of the index page(s) on either side
+    unsigned long ready_offset; // offset of the ready flags from the index page in unsigned longs, 0 without them
+    unsigned int framing; // FRAMING_*
+    wait_policy wait;
+    wait_stats wait_stats;
+    struct mpsc_channel *mpsc; // per channel multi-producer state, NULL while every channel has a single producer
+    stats_block *stats; // one block per counting thread
+    unsigned long stats_id;
+    const struct vca_transport *transport; // how ring_2mb and ring_4kb are shared, NULL for local queues
+    unsigned int pair; // queue pair of the socket the queue belongs to, 0 for the one of the task system
+    int copy_kernel; // COPY_KERNEL_*
 } queue_object;
 
 typedef struct {
   int active_sockets[VCA_SOCKETS];
-  int next_recv_channel;
-  int next_submit_channel;
-  int next_recv_socket;
-  int next_submit_socket;
+  unsigned int recv_channel[VCA_SOCKETS]; // channel host_recv_task looks at first on each socket
+  unsigned int recv_weight[VCA_SOCKETS]; // share of host_recv_task of each socket, 0 counts as 1
+  long recv_credit[VCA_SOCKETS]; // smooth weighted round robin state of host_recv_task
+  unsigned long next_submit; // round robin ticket of host_submit_task, taken atomically
   int total_sockets;
   queue_object *tx_q_objs[VCA_SOCKETS];
   queue_object *rx_q_objs[VCA_SOCKETS];
 } task_queue_opaque;
 
+// Piece of ring memory handed out by ring_reserve/ring_peek. A request that
+// wraps around the end of a channel is returned as two spans.
+typedef struct {
+  void *addr;
+  unsigned int items;
+} ring_span;
+
+typedef struct {
+  ring_span span[2];
+  unsigned int total_items;
+  unsigned int idx;
+  unsigned int pos; // index value of the first item
+  unsigned int next; // index value published by ring_commit/ring_release
+} ring_window;
+
 typedef struct __attribute__((__packed__)) {
  unsigned long total_bursts;
  unsigned long payload_size;
@@ -112,12 +264,35 @@ typedef struct __attribute__((__packed__)) {
  unsigned long padding[29];
  } task_header;
 
+typedef struct __attribute__((__packed__)) {
+ unsigned int magic;
+ unsigned int reserved;
+ unsigned long payload_size;
+ } compact_header;
+
+// One task streamed through a channel by the *_stream_* calls
+typedef struct {
+  queue_object *q;
+  unsigned int channel;
+  int stream_owner; // holds the stream lock of a multi-producer channel
+  unsigned long remaining; // payload bytes still to be written or read
+  unsigned long items; // ring items of the task still to be reserved or released
+  unsigned long offset; // bytes of the current slot already written or read
+  int dma; // the writer may copy whole slots with the DMA engine, see stream_splice
+  unsigned char slot[BUFF_SIZE_BOUNDARY]; // partial slot of the writer
+} task_stream;
+
 
 typedef struct __attribute__((__packed__)) transfer_mapping {
   unsigned long physical_addr;
   unsigned long size;
   int mapping_type;
   int socket;
+  queue_params params; // ring geometry proposed by the side that owns the ring, zero for plain shared memory
+  unsigned int transport; // VCA_TRANSPORT_* of the sender
+  int owner_pid; // loopback: the memory is the memfd owner_fd of process owner_pid
+  int owner_fd;
+  unsigned int pair; // queue pair of the ring, both sides have to agree on it
 } transfer_mapping;  
 
 // To get pointer to the page map entry in /proc/self/pagemap
@@ -127,15 +302,57 @@ int get_entry(PagemapEntry *entry, int pagemap_fd, uintptr_t vaddr);
 // To get pointer to physical address corresponding to a virtual address. Virtual address need not be page aligned
 unsigned long  virt_to_phys_user(uintptr_t vaddr);
 
+// Open and close a translation context for virt_to_phys_range
+int phys_translator_open(phys_translator *t);
+void phys_translator_close(phys_translator *t);
+
+// Translate [vaddr, vaddr + size) into physically contiguous extents, reading the pagemap in batches. t NULL uses
+// a pagemap fd shared by the whole process. Returns the number of extents, -1 if a page is not present, the
+// physical addresses are not visible (needs CAP_SYS_ADMIN) or more than max_extents are needed
+int virt_to_phys_range(phys_translator *t, uintptr_t vaddr, unsigned long size, phys_extent *extents, int max_extents);
+
 // To get contigious 2MB physical pages; works nicely on systems with transperant hugepages enabled 
 void* get_contiguous__2MB(void);
 
+// Same as above for size bytes (rounded up to 2MB) backed by physically contiguous 2MB pages
+void* get_contiguous_hugepages(unsigned long size);
+
+// Same as get_contiguous_hugepages with the pages taken from NUMA node node if it has them (-1 for any)
+void* get_contiguous_hugepages_node(unsigned long size, int node);
+
+// Rings of the PCIe transport come from reserved huge pages (2MB, then 1GB ones), a DMA buffer of the sgx5 driver
+// or THP, in that order, and go to a pool for the next queue when their queue is freed. Set aside count rings of
+// geometry params (NULL for the default) for socket while memory is still in one piece. Returns how many it got
+int vca_mem_reserve_rings(int socket, const queue_params *params, unsigned int count);
+
+// Hand the rings waiting in the pool back to the system
+void vca_mem_drain_ring_pool(void);
+
+// Choose the transport of everything set up afterwards; call it before initialize_system. In loopback
+// the process that connects (socket -1) plays the card of card_socket and the one that binds the host.
+// Both have to run as the same user, the rings are mapped through /proc/<pid>/fd. Without a call the
+// VCA_TRANSPORT environment variable decides: "pcie", "loopback" or "loopback:<card socket>"
+int vca_mem_set_transport(int transport, int card_socket);
+
 // Check whether platform is card or host
 int get_local_platform_type(void);
 
 // if card then what is the socket number
 int get_card_self_socket_number(void);
 
+// NUMA node of the PLX device of socket (-1 on a card for its own), -1 if unknown. The rings of the
+// socket are allocated on that node
+int vca_socket_numa_node(int socket);
+
+// CPUs next to socket: those of its NUMA node, or every CPU if the node is unknown. Returns how many
+int vca_socket_cpuset(int socket, cpu_set_t *cpus);
+
+// Pin the calling thread to the n-th CPU of vca_socket_cpuset(socket), counting around, or to all of them for n < 0
+int vca_pin_thread(int socket, int n);
+
+// Pin the threads the library starts itself (the stats exporter) to the CPUs of socket; enable 0, the default, leaves them alone
+void vca_mem_set_thread_affinity(int enable, int socket);
+
 // Execute something on the local platform. This API also used to execute something on remote using SSH/SSL
 void execute(const char *fmt, ...);
 
@@ -151,10 +368,10 @@ int request_sharing(transfer_mapping * map, int (*send_recv)(void *, void *, siz
 // API to share local memory with remote socket ; is also used by library to setup async queues
 int recv_remote_data(int * socket, unsigned long *remote_physical, unsigned long *size, int *mapping_type); 
 
-// API to get local side physical address from /sys/kernel/sgx_mapper_N/map[0-n]
+// API to get local side physical address from /dev/sgx5_mapper_N, or /sys/kernel/sgx5_mapper_N/map[0-n] without the device
 unsigned long get_local_mapping(int socket, int mapping_number ); 
 	
-// Program base address, size and type in /proc/mtrr. Address and size alignments are adjustments are taken care inside the API
+// Program base address, size and type through /dev/sgx5_mapper_N or /proc/mtrr. Address and size alignments are adjustments are taken care inside the API
 int setup_mtrr_mappings(unsigned long base, unsigned long size, int remote_access_type);
 
 //Given a remote  physical address, size and socket number, programs the DMA controller 
@@ -165,6 +382,9 @@ void*  map_phys_memory(unsigned long phys, unsigned long size);
 
 // Given remote socket and local mapping index number, returns the virtual address mapped into apps address space. request size will deprecated in future
 void* map_remote_memory(transfer_mapping * map, int socket, unsigned long request_size, int mapping_number); 
+
+// Releases a mapping of map_remote_memory made through the mapper device; GENERAL_ERROR for /dev/mem mappings, which stay
+int unmap_remote_memory(void *ptr);
 	
 // Initialize and setup a queue with the remote socket for dequeuing data ; each queue with a socket provides 8 channels; Only one socket per queue supported but can be easily extended to any number of queues per socket  	
 queue_object *init_dequeue(int socket);
@@ -173,32 +393,168 @@ queue_object *init_dequeue(int socket);
 // Initialize and setup a queue with the remote socket for enqueuing data ; each queue with a socket provides 8 channels; Only one socket per queue supported but can be easily extended to any number of queues per socket	
 queue_object *init_enqueue(int socket);
 
+// Same as init_dequeue with the ring geometry given by params (NULL for the defaults). The dequeue side owns the ring, so its geometry is sent to the peer in the transfer_mapping handshake
+queue_object *init_dequeue_params(int socket, const queue_params *params);
+
+// Same as init_enqueue; with params NULL the geometry announced by the dequeue side is adopted, otherwise both sides have to agree
+queue_object *init_enqueue_params(int socket, const queue_params *params);
+
+// Queue with producer and consumer in this process (params NULL for the defaults); no remote socket involved
+queue_object *init_local_queue(const queue_params *params);
+
+// Bytes of ring a task of task_length bytes takes in the framing of the queue
+unsigned long task_footprint(queue_object *queue_obj, long task_length);
+
 void incr_prodcons(unsigned long * prod_cons_array, int real_idx);
 
 // Producer Side of the application will call this to push data into queue into a certain channel idx.
 int s_variable_multi_enqueue(queue_object *queue_obj, void *source, unsigned int total_elements, unsigned int idx); 
 
+// Same as s_variable_multi_enqueue but the items only become visible to the consumer after ring_flush. Used to copy many bursts and pay for one fence and one remote index write
+int s_variable_multi_enqueue_batch(queue_object *queue_obj, void *source, unsigned int total_elements, unsigned int idx);
+
 // Consumer side of the application will call this to take out  data from queue a certain channel idx
 int s_variable_multi_dequeue(queue_object *queue_obj, void *source, unsigned int max_requested, unsigned int idx);
 
+// Zero copy producer side: reserve n_items in channel idx and get pointers straight into the ring. Returns number of spans (1 or 2) or 0 if the ring is too full
+int ring_reserve(queue_object *queue_obj, unsigned int idx, unsigned int n_items, ring_window *w);
+
+// Publish the items of a window obtained from ring_reserve to the consumer
+void ring_commit(queue_object *queue_obj, ring_window *w);
+
+// Advance the local producer index past the window but do not publish it to the consumer yet; see ring_flush
+void ring_commit_batch(queue_object *queue_obj, ring_window *w);
+
+// Publish everything committed with ring_commit_batch/s_variable_multi_enqueue_batch on channel idx with a single fence and remote index write
+void ring_flush(queue_object *queue_obj, unsigned int idx);
+
+// Zero copy consumer side: look at n_items (0 means all available) of channel idx in place. Returns number of spans (1 or 2) or 0 if not enough data
+int ring_peek(queue_object *queue_obj, unsigned int idx, unsigned int n_items, ring_window *w);
+
+// Hand the items of a window obtained from ring_peek back to the producer
+void ring_release(queue_object *queue_obj, ring_window *w);
+
+// First channel at or after start (cyclically) with data waiting, -1 if there is none. With RING_LAYOUT_READY
+// only the ready flags and the channels flagged by them are looked at; flags of empty channels are cleared
+int queue_poll_ready(queue_object *queue_obj, unsigned int start);
+
+// Same as s_variable_multi_dequeue but waits for the items following the wait policy of the queue
+int s_variable_multi_dequeue_wait(queue_object *queue_obj, void *source, unsigned int max_requested, unsigned int idx);
+
+// Change how consumers of the queue wait for data; the default is WAIT_POLICY_SPIN
+void queue_set_wait_policy(queue_object *queue_obj, const wait_policy *policy);
+
+// Choose the copy kernel of the queue; COPY_KERNEL_AUTO takes the widest the CPU has for rings shared over PCIe and
+// memcpy for the others, unless VCA_COPY_KERNEL says "memcpy", "avx2" or "avx512". Fails if the CPU lacks the kernel
+int queue_set_copy_kernel(queue_object *queue_obj, int kernel);
+
+// Snapshot of the wait counters of the queue
+void queue_get_wait_stats(queue_object *queue_obj, wait_stats *stats);
+
+// Let several threads enqueue into channel idx of an enqueue queue at the same time (enable 1) or go
+// back to a single producer (enable 0). Must not race with producers of that channel. On a
+// multi-producer channel every commit is published in order, ring_commit_batch behaves like
+// ring_commit and ring_flush does nothing
+int queue_set_multi_producer(queue_object *queue_obj, unsigned int idx, int enable);
+
 // Free up queue object if no longer required
 void free_queue(queue_object *q);
 
 void *init_host_task_system(void *opq, const char * ip, const char * port, int * socket);
 void *init_vca_task_system(const char * ip, const char * port, int * socket);
 
+// Same as above with the geometry and framing of the receive queue; the submit queue takes whatever the peer chose for its own receive queue
+void *init_host_task_system_params(void *opq, const char * ip, const char * port, int * socket, const queue_params *params);
+void *init_vca_task_system_params(const char * ip, const char * port, int * socket, const queue_params *params);
+
+// One more queue pair to socket over the connection of a task system set up before: a task system of its own with
+// its own channels, rings and producers, for services that should not share channels with each other. pair counts
+// from 1 (0 is the pair of init_*_task_system) and both sides have to open their pairs in the same order. Pairs
+// past the first need the sgx5 mapper device, the fixed map slots only hold one
+void *init_host_task_pair(int socket, unsigned int pair, const queue_params *params);
+void *init_vca_task_pair(unsigned int pair, const queue_params *params);
+
+// Free the queues of opq; the connection goes with the last task system or queue pair
 void deinit_vca_task_system(void *opq);
 
 long common_submit_task(void *opq, long task_length, void *task_buffer, int channel, int socket);
 
 long common_recv_task(void *opq, long *task_length, void *task_buffer, int channel, int socket);
 
+// The host task calls address a channel of a socket by task_id, submitting round robin for task_id < 0.
+// Each socket has room for MAX_QUEUE_CHANNELS channels, whatever the channels of its queues
+#define TASK_ID(socket, channel) ((socket) * (int)MAX_QUEUE_CHANNELS + (channel))
+#define TASK_ID_SOCKET(task_id) ((task_id) / (int)MAX_QUEUE_CHANNELS)
+#define TASK_ID_CHANNEL(task_id) ((task_id) % (int)MAX_QUEUE_CHANNELS)
+
 long host_submit_task(void *opq, long task_length, void *task_buffer, int task_id);
 long host_recv_task(void *opq, long *task_length, void *task_buffer, int *task_id);
 
+// Scatter-gather versions of the task calls: a task is submitted from the concatenation of iov and
+// received into its segments in order, copied straight between the segments and the ring.
+// The *_recv_taskv calls set task_length to the full task size; bytes beyond the segments are dropped.
+// All task calls return -1 for a socket without queue or a channel past the channels of its queue
+long common_submit_taskv(void *opq, const struct iovec *iov, int iovcnt, int channel, int socket);
+long common_recv_taskv(void *opq, long *task_length, const struct iovec *iov, int iovcnt, int channel, int socket);
+long host_submit_taskv(void *opq, const struct iovec *iov, int iovcnt, int task_id);
+long host_recv_taskv(void *opq, long *task_length, const struct iovec *iov, int iovcnt, int *task_id);
+long vca_submit_taskv(void *opq, const struct iovec *iov, int iovcnt, int channel);
+long vca_recv_taskv(void *opq, long *task_length, const struct iovec *iov, int iovcnt, int channel);
+
+// Switch all channels of all submit queues of the task system to multi-producer mode, so that
+// host_submit_task/vca_submit_task can be called from several threads
+void set_task_multi_producer(void *opq, int enable);
+
+// Set the wait policy of all queues of the task system: host_recv_task/vca_recv_task wait by it on
+// the receive queues, and the submit queues ring its doorbell whenever they publish a task
+void set_task_wait_policy(void *opq, const wait_policy *policy);
+
+// host_recv_task serves sockets with a ready channel in proportion to their weight (default 1 each)
+void set_task_recv_weight(void *opq, int socket, unsigned int weight);
+
+// Choose the telemetry to keep (STATS_* flags, 0 for none), and read it back summed over all threads.
+// vca_mem_get_stats fills tx and/or rx with the counters of channel of the queues to and from socket
+void vca_mem_set_stats(unsigned int flags);
+void queue_get_stats(queue_object *queue_obj, unsigned int idx, channel_stats *stats);
+int vca_mem_get_stats(void *opq, int socket, unsigned int channel, channel_stats *tx, channel_stats *rx);
+
+// Write the telemetry of all queues of the task system as text to fd, one line per queue and channel
+void vca_mem_dump_stats(void *opq, int fd);
+
+// Dump the telemetry every interval_ms from a thread of its own, to a file (replaced atomically)
+// or to a UNIX stream socket given as "unix:<path>". Only one exporter runs at a time
+int vca_mem_start_stats_exporter(void *opq, const char *path, unsigned int interval_ms);
+void vca_mem_stop_stats_exporter(void);
+
 long vca_submit_task(void *opq, long task_length, void *task_buffer, int channel);
 long vca_recv_task(void *opq, long *task_length, void *task_buffer, int channel);
 
+// Streaming of tasks too large to stage in memory. The sender announces the task length in
+// submit_stream_begin, writes exactly that many bytes in chunks of any size and calls
+// submit_stream_end; other producers of a multi-producer channel wait until then. Every write
+// is published, and a write blocks while the ring is full: the receiver grants credits by
+// releasing slots as it reads. recv_stream_begin returns -1 if no task is waiting, recv_stream_read
+// returns what is available of the task up to length (blocking for at least one byte, 0 at the end)
+// and recv_stream_end skips whatever was not read
+long submit_stream_begin(void *opq, task_stream *s, long task_length, int channel, int socket);
+long submit_stream_write(task_stream *s, const void *buffer, long length);
+long submit_stream_end(task_stream *s);
+long recv_stream_begin(void *opq, task_stream *s, long *task_length, int channel, int socket);
+long recv_stream_read(task_stream *s, void *buffer, long length);
+long recv_stream_end(task_stream *s);
+
+// recv_stream_begin waiting for a task like host_recv_task and vca_recv_task, the host on the socket it would take one from
+long host_recv_stream_begin(void *opq, task_stream *s, long *task_length, int *task_id);
+long vca_recv_stream_begin(void *opq, task_stream *s, long *task_length, int channel);
+
+// submit_stream_begin on the socket and channel host_submit_task would use for task_id
+long host_submit_stream_begin(void *opq, task_stream *s, long task_length, int task_id);
+
+// Move length bytes of the task of in into the task of out straight from ring to ring, for forwarding
+// between sockets. Where the sgx5 driver can, large spans from a ring of the host to an aperture
+// window go through the DMA engine of the PLX device instead of the CPU. Returns the bytes moved
+long stream_splice(task_stream *out, task_stream *in, long length);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,494 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <assert.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/param.h>
+#include "vca_mem.h"
+
+// Throughput and latency of the ring library, for the raw s_variable_multi_* calls and the task API.
+//
+// The driver end submits and takes the time, the responder end receives, echoes the ping-pong
+// messages and acknowledges the end of every throughput run with one raw item on channel 0.
+// With -m loopback both ends live in this process on two local queues; -m host and -m card put
+// them on either side of a card socket, both started with the same options (the card serves the
+// runs of the host and prints nothing); -L runs them over the loopback transport, as two processes of
+// one machine. One line per run goes to stdout, CSV or JSON; latency
+// runs count round trips as messages.
+
+#define MAX_LIST 16
+#define MAX_THREADS 64
+#define MAX_MSGS_PER_RUN 1000000UL
+#define WARMUP_ROUNDS 100
+
+enum { API_RAW, API_TASK, APIS };
+enum { MODE_LOOPBACK, MODE_HOST, MODE_CARD };
+
+typedef struct {
+  task_queue_opaque *opq;
+  int socket;
+} bench_end;
+
+typedef struct {
+  unsigned int n;
+  unsigned int v[MAX_LIST];
+} bench_list;
+
+// One run. A unit is what a single call moves: burst messages of payload bytes for the raw API
+// (rounded up to whole slots), one task for the task API
+typedef struct {
+  int api;
+  long payload;
+  unsigned int channels;
+  unsigned int threads;
+  unsigned int burst;
+  unsigned long units;
+} bench_run;
+
+typedef struct {
+  bench_end *end;
+  const bench_run *run;
+  unsigned int index;
+} bench_thread;
+
+static struct {
+  int mode;
+  int json;
+  unsigned int apis;
+  long min_payload, max_payload;
+  bench_list channels, threads, bursts;
+  unsigned long bytes_per_run;
+  unsigned int rounds;
+  queue_params params;
+} cfg;
+
+static unsigned long *oneway_ns; // filled by the responder in loopback mode, where both ends share the clock
+
+static unsigned long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static queue_object *tx_queue(bench_end *end)
+{
+  return end->opq->tx_q_objs[end->socket];
+}
+
+static queue_object *rx_queue(bench_end *end)
+{
+  return end->opq->rx_q_objs[end->socket];
+}
+
+static unsigned int unit_items(const bench_run *run)
+{
+  return ((run->payload + cfg.params.slot_size - 1) / cfg.params.slot_size) * run->burst;
+}
+
+static unsigned long unit_bytes(const bench_run *run)
+{
+  return run->api == API_RAW ? (unsigned long)unit_items(run) * cfg.params.slot_size : (unsigned long)run->payload;
+}
+
+static void send_unit(bench_end *end, const bench_run *run, void *buffer, unsigned int channel)
+{
+  if (run->api == API_TASK) {
+    common_submit_task(end->opq, run->payload, buffer, channel, end->socket);
+    return;
+  }
+  while (!s_variable_multi_enqueue(tx_queue(end), buffer, unit_items(run), channel))
+    asm volatile ("pause" ::: "memory");
+}
+
+static void recv_unit(bench_end *end, const bench_run *run, void *buffer, unsigned int channel)
+{
+  long len;
+
+  if (run->api == API_TASK) {
+    while (common_recv_task(end->opq, &len, buffer, channel, end->socket) != 0)
+      asm volatile ("pause" ::: "memory");
+    return;
+  }
+  while (!s_variable_multi_dequeue(rx_queue(end), buffer, unit_items(run), channel))
+    asm volatile ("pause" ::: "memory");
+}
+
+static void send_ack(bench_end *end)
+{
+  bench_run run = { API_RAW, sizeof(unsigned long), 1, 1, 1, 1 };
+  unsigned long slot[BUFF_SIZE_BOUNDARY / sizeof(unsigned long)] = { 0 };
+
+  send_unit(end, &run, slot, 0);
+}
+
+static void wait_ack(bench_end *end)
+{
+  bench_run run = { API_RAW, sizeof(unsigned long), 1, 1, 1, 1 };
+  unsigned long slot[BUFF_SIZE_BOUNDARY / sizeof(unsigned long)];
+
+  recv_unit(end, &run, slot, 0);
+}
+
+// Unit k of producer thread t is unit k * threads + t of the run and goes to channel
+// (k * threads + t) % channels, so each channel receives an even share
+static unsigned long channel_units(const bench_run *run, unsigned int channel)
+{
+  return run->units / run->channels + (channel < run->units % run->channels);
+}
+
+static void *producer(void *arg)
+{
+  bench_thread *t = arg;
+  const bench_run *run = t->run;
+  void *buffer = calloc(1, unit_bytes(run) + BUFF_SIZE_BOUNDARY);
+  unsigned long unit;
+
+  assert(buffer != NULL);
+  for (unit = t->index; unit < run->units; unit += run->threads)
+    send_unit(t->end, run, buffer, unit % run->channels);
+
+  free(buffer);
+  return NULL;
+}
+
+static void *consumer(void *arg)
+{
+  bench_thread *t = arg;
+  const bench_run *run = t->run;
+  void *buffer = malloc(unit_bytes(run) + BUFF_SIZE_BOUNDARY);
+  unsigned long unit, units = channel_units(run, t->index);
+
+  assert(buffer != NULL);
+  for (unit = 0; unit < units; unit++)
+    recv_unit(t->end, run, buffer, t->index);
+
+  free(buffer);
+  return NULL;
+}
+
+static void run_threads(bench_end *end, const bench_run *run, unsigned int n, void *(*fn)(void *))
+{
+  pthread_t thread[MAX_THREADS];
+  bench_thread arg[MAX_THREADS];
+  unsigned int i;
+
+  for (i = 0; i < n; i++) {
+    arg[i].end = end;
+    arg[i].run = run;
+    arg[i].index = i;
+    assert(pthread_create(&thread[i], NULL, fn, &arg[i]) == 0);
+  }
+  for (i = 0; i < n; i++)
+    pthread_join(thread[i], NULL);
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+  return (x > y) - (x < y);
+}
+
+static unsigned long percentile(const unsigned long *sorted, unsigned long n, double p)
+{
+  return sorted[MIN(n - 1, (unsigned long)(p * n))];
+}
+
+static void report(const char *test, const bench_run *run, unsigned long messages, double seconds,
+		   unsigned long *rtt, unsigned long *oneway, unsigned long n)
+{
+  static const char *api_name[APIS] = { "raw", "task" };
+  static const char *pct_name[] = { "p50", "p90", "p99", "p999", "max" };
+  static const double pct[] = { 0.50, 0.90, 0.99, 0.999, 1.0 };
+  unsigned long *sample[2] = { rtt, oneway };
+  const char *sample_name[2] = { "rtt", "oneway" };
+  unsigned int s, i;
+
+  if (cfg.json)
+    printf("{\"test\":\"%s\",\"api\":\"%s\",\"payload\":%ld,\"channels\":%u,\"threads\":%u,\"burst\":%u,"
+	   "\"messages\":%lu,\"seconds\":%.6f,\"msgs_per_s\":%.1f,\"mb_per_s\":%.1f", test, api_name[run->api],
+	   run->payload, run->channels, run->threads, run->burst, messages, seconds, messages / seconds,
+	   messages * run->payload / seconds / (1024 * 1024));
+  else
+    printf("%s,%s,%ld,%u,%u,%u,%lu,%.6f,%.1f,%.1f", test, api_name[run->api], run->payload, run->channels,
+	   run->threads, run->burst, messages, seconds, messages / seconds,
+	   messages * run->payload / seconds / (1024 * 1024));
+
+  for (s = 0; s < 2; s++) {
+    if (sample[s])
+      qsort(sample[s], n, sizeof(unsigned long), compare_ns);
+    for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+      if (cfg.json && sample[s])
+	printf(",\"%s_%s_ns\":%lu", sample_name[s], pct_name[i], percentile(sample[s], n, pct[i]));
+      else if (!cfg.json && sample[s])
+	printf(",%lu", percentile(sample[s], n, pct[i]));
+      else if (!cfg.json)
+	printf(",");
+    }
+  }
+  printf(cfg.json ? "}\n" : "\n");
+  fflush(stdout);
+}
+
+static void report_header(void)
+{
+  if (!cfg.json)
+    printf("test,api,payload,channels,threads,burst,messages,seconds,msgs_per_s,mb_per_s,"
+	   "rtt_p50_ns,rtt_p90_ns,rtt_p99_ns,rtt_p999_ns,rtt_max_ns,"
+	   "oneway_p50_ns,oneway_p90_ns,oneway_p99_ns,oneway_p999_ns,oneway_max_ns\n");
+}
+
+// Sustained one-way throughput: threads producers of the driver against one consumer per channel
+static void throughput(bench_end *end, int driver, const bench_run *run)
+{
+  queue_object *q = tx_queue(end);
+  unsigned long start;
+  unsigned int ch;
+  // producers have to share a channel unless every channel belongs to one of them
+  int shared = run->channels % run->threads != 0;
+
+  if (!driver) {
+    run_threads(end, run, run->channels, consumer);
+    send_ack(end);
+    return;
+  }
+
+  for (ch = 0; shared && ch < run->channels; ch++)
+    assert(queue_set_multi_producer(q, ch, 1) == 0);
+
+  start = now_ns();
+  run_threads(end, run, run->threads, producer);
+  wait_ack(end);
+  report("throughput", run, run->units * run->burst, (now_ns() - start) / 1e9, NULL, NULL, 0);
+
+  for (ch = 0; shared && ch < run->channels; ch++)
+    queue_set_multi_producer(q, ch, 0);
+}
+
+// Ping-pong of one unit on channel 0; the first 8 bytes carry the send time of the driver
+static void latency(bench_end *end, int driver, const bench_run *run)
+{
+  unsigned long rounds = cfg.rounds + WARMUP_ROUNDS, i, stamp, start = 0;
+  unsigned long *buffer = calloc(1, unit_bytes(run) + BUFF_SIZE_BOUNDARY);
+  unsigned long *rtt = driver ? malloc(cfg.rounds * sizeof(unsigned long)) : NULL;
+
+  assert(buffer != NULL && (!driver || rtt != NULL));
+
+  for (i = 0; i < rounds; i++) {
+    if (!driver) {
+      recv_unit(end, run, buffer, 0);
+      if (oneway_ns && i >= WARMUP_ROUNDS)
+	oneway_ns[i - WARMUP_ROUNDS] = now_ns() - buffer[0];
+      send_unit(end, run, buffer, 0);
+      continue;
+    }
+    if (i == WARMUP_ROUNDS)
+      start = now_ns();
+    buffer[0] = stamp = now_ns();
+    send_unit(end, run, buffer, 0);
+    recv_unit(end, run, buffer, 0);
+    if (i >= WARMUP_ROUNDS)
+      rtt[i - WARMUP_ROUNDS] = now_ns() - stamp;
+  }
+
+  if (driver)
+    report("latency", run, cfg.rounds, (now_ns() - start) / 1e9, rtt, oneway_ns, cfg.rounds);
+  free(rtt);
+  free(buffer);
+}
+
+// Both ends walk the same runs in the same order
+static void bench(bench_end *end, int driver)
+{
+  bench_run run;
+  unsigned int c, t, b;
+
+  for (run.api = 0; run.api < APIS; run.api++) {
+    if (!(cfg.apis & (1 << run.api)))
+      continue;
+    for (run.payload = cfg.min_payload; run.payload <= cfg.max_payload; run.payload <<= 1) {
+      for (b = 0; b < cfg.bursts.n; b++) {
+	// bursts only exist for the raw calls; a unit has to fit half a ring
+	run.burst = run.api == API_RAW ? cfg.bursts.v[b] : 1;
+	if ((run.api == API_TASK && b > 0) || unit_items(&run) > cfg.params.slots / 2)
+	  continue;
+
+	for (c = 0; c < cfg.channels.n; c++) {
+	  for (t = 0; t < cfg.threads.n; t++) {
+	    run.channels = cfg.channels.v[c];
+	    run.threads = cfg.threads.v[t];
+	    run.units = MIN(cfg.bytes_per_run / run.payload, MAX_MSGS_PER_RUN) / run.burst;
+	    run.units = MAX(run.units, run.threads);
+	    throughput(end, driver, &run);
+	  }
+	}
+
+	run.channels = run.threads = 1;
+	run.units = cfg.rounds;
+	latency(end, driver, &run);
+      }
+    }
+  }
+}
+
+static void *responder(void *arg)
+{
+  bench(arg, 0);
+  return NULL;
+}
+
+static int parse_list(const char *s, bench_list *list, unsigned int max)
+{
+  char *end;
+
+  for (list->n = 0; *s && list->n < MAX_LIST; s = end + (*end == ',')) {
+    list->v[list->n] = strtoul(s, &end, 0);
+    if (end == s || list->v[list->n] == 0 || list->v[list->n] > max || (*end && *end != ','))
+      return GENERAL_ERROR;
+    list->n++;
+  }
+  return list->n ? 0 : GENERAL_ERROR;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+	  "usage: %s [-m loopback|host|card] [-L] [-i ip] [-P port] [-s socket] [-a raw|task|all]\n"
+	  "          [-p min[:max]] [-c channels,..] [-t threads,..] [-b burst,..] [-S slot size]\n"
+	  "          [-q slots] [-n MB per run] [-r rounds] [-j]\n"
+	  "  -m  loopback runs both ends in this process; host and card need one instance on each side\n"
+	  "  -L  host and card over the loopback transport, card -s gives the socket it plays\n"
+	  "  -p  payload bytes per message, doubled from min up to max (64:65536)\n"
+	  "  -c  channels, -t producer threads, -b messages per raw call: every combination is run\n"
+	  "  -n  bytes moved per throughput run (64), -r ping-pong rounds per latency run (10000)\n"
+	  "  -j  JSON lines instead of CSV\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  const char *ip = NULL, *port = VCA_HOST_PORT;
+  queue_params defaults = DEFAULT_QUEUE_PARAMS;
+  task_queue_opaque local[2];
+  bench_end driver, peer;
+  pthread_t thread;
+  unsigned int i, channels = 1;
+  int opt, socket = 0, loopback = 0;
+  char *end;
+
+  cfg.apis = (1 << API_RAW) | (1 << API_TASK);
+  cfg.min_payload = 64;
+  cfg.max_payload = 64 * 1024;
+  cfg.bytes_per_run = 64UL << 20;
+  cfg.rounds = 10000;
+  cfg.params = defaults;
+  parse_list("1", &cfg.channels, 1);
+  parse_list("1", &cfg.threads, 1);
+  parse_list("1", &cfg.bursts, 1);
+
+  while ((opt = getopt(argc, argv, "m:Li:P:s:a:p:c:t:b:S:q:n:r:jh")) != -1) {
+    switch (opt) {
+    case 'm':
+      if (strcmp(optarg, "loopback") == 0)
+	cfg.mode = MODE_LOOPBACK;
+      else if (strcmp(optarg, "host") == 0)
+	cfg.mode = MODE_HOST;
+      else if (strcmp(optarg, "card") == 0)
+	cfg.mode = MODE_CARD;
+      else
+	usage(argv[0]);
+      break;
+    case 'L': loopback = 1; break;
+    case 'i': ip = optarg; break;
+    case 'P': port = optarg; break;
+    case 's': socket = atoi(optarg); break;
+    case 'a':
+      if (strcmp(optarg, "raw") == 0)
+	cfg.apis = 1 << API_RAW;
+      else if (strcmp(optarg, "task") == 0)
+	cfg.apis = 1 << API_TASK;
+      else if (strcmp(optarg, "all") != 0)
+	usage(argv[0]);
+      break;
+    case 'p':
+      cfg.min_payload = cfg.max_payload = strtol(optarg, &end, 0);
+      if (*end == ':')
+	cfg.max_payload = strtol(end + 1, &end, 0);
+      if (*end || cfg.min_payload < (long)sizeof(unsigned long) || cfg.max_payload < cfg.min_payload)
+	usage(argv[0]);
+      break;
+    case 'c':
+      if (parse_list(optarg, &cfg.channels, MAX_QUEUE_CHANNELS))
+	usage(argv[0]);
+      break;
+    case 't':
+      if (parse_list(optarg, &cfg.threads, MAX_THREADS))
+	usage(argv[0]);
+      break;
+    case 'b':
+      if (parse_list(optarg, &cfg.bursts, UINT_MAX))
+	usage(argv[0]);
+      break;
+    case 'S': cfg.params.slot_size = atoi(optarg); break;
+    case 'q': cfg.params.slots = atoi(optarg); break;
+    case 'n': cfg.bytes_per_run = strtoul(optarg, NULL, 0) << 20; break;
+    case 'r': cfg.rounds = atoi(optarg); break;
+    case 'j': cfg.json = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (cfg.rounds == 0 || cfg.bytes_per_run == 0 || socket < 0 || socket >= VCA_SOCKETS)
+    usage(argv[0]);
+  if (loopback && vca_mem_set_transport(VCA_TRANSPORT_LOOPBACK, socket) != 0)
+    return 1;
+
+  // the queues get as many channels as the largest run uses
+  for (i = 0; i < cfg.channels.n; i++)
+    channels = MAX(channels, cfg.channels.v[i]);
+  cfg.params.channels = channels;
+
+  switch (cfg.mode) {
+  case MODE_LOOPBACK:
+    memset(local, 0, sizeof(local));
+    local[0].tx_q_objs[0] = local[1].rx_q_objs[0] = init_local_queue(&cfg.params);
+    local[1].tx_q_objs[0] = local[0].rx_q_objs[0] = init_local_queue(&cfg.params);
+    if (!local[0].tx_q_objs[0] || !local[1].tx_q_objs[0])
+      return 1;
+    driver.opq = &local[0];
+    peer.opq = &local[1];
+    driver.socket = peer.socket = 0;
+    oneway_ns = malloc(cfg.rounds * sizeof(unsigned long));
+    assert(oneway_ns != NULL);
+
+    assert(pthread_create(&thread, NULL, responder, &peer) == 0);
+    report_header();
+    bench(&driver, 1);
+    pthread_join(thread, NULL);
+
+    free_queue(local[0].tx_q_objs[0]);
+    free_queue(local[1].tx_q_objs[0]);
+    free(oneway_ns);
+    break;
+  case MODE_HOST:
+    driver.opq = init_host_task_system_params(NULL, ip ? ip : "*", port, &socket, &cfg.params);
+    driver.socket = socket;
+    report_header();
+    bench(&driver, 1);
+    deinit_vca_task_system(driver.opq);
+    break;
+  case MODE_CARD:
+    socket = -1;
+    peer.opq = init_vca_task_system_params(ip, port, &socket, &cfg.params);
+    peer.socket = 0;
+    bench(&peer, 0);
+    deinit_vca_task_system(peer.opq);
+    break;
+  }
+
+  return 0;
+}
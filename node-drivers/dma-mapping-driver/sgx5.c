@@ -98,6 +98,8 @@ static void sgx5_unmap(unsigned long *paddr)
 
 }
 
+#include "sgx5_dev.h"
+
 
 static ssize_t read_map0(struct kobject *kobj, struct kobj_attribute *attr,
                       char *buf)
@@ -236,6 +238,9 @@ static int __init sgx5_init (void)
                 pr_debug("somnath: failed to create the map 2 file in /sys/kernel/sgx5_mapper \n");
         }
 
+        if (!error && sgx5_dev_register(mapper_name, SGX5_PLATFORM_CARD, (int)(((nodeid/10)*3) + (nodeid%10))))
+                printk("somnath: failed to register /dev/%s, only sysfs is available\n", mapper_name);
+
 
         return error;
 }
@@ -243,6 +248,7 @@ static int __init sgx5_init (void)
 static void __exit sgx5_exit (void)
 {
         pr_debug ("somnath: Module un initialized successfully \n");
+        sgx5_dev_unregister();
         kobject_put(sgx5_kobject);
 }
 
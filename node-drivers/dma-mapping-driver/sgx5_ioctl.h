@@ -0,0 +1,101 @@
+/*
+ * Intel VCA Software Stack (VCASS)
+ *
+ * Copyright(c) 2016-2017 Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Intel VCA sgx5 mapper character device interface, shared with user space
+ */
+#ifndef _SGX5_IOCTL_H_
+#define _SGX5_IOCTL_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* /dev/sgx5_mapper_N sits next to /sys/kernel/sgx5_mapper_N */
+#define SGX5_DEVICE_NAME "sgx5_mapper_%d"
+
+#define SGX5_PLATFORM_HOST 0
+#define SGX5_PLATFORM_CARD 1
+
+#define SGX5_CACHE_WRITE_THROUGH 0
+#define SGX5_CACHE_WRITE_COMBINING 1
+
+/*
+ * Map numbers below the maps of sgx5_platform_info are the fixed slots of
+ * /sys/kernel/sgx5_mapper_N/mapK, shared by everybody. SGX5_IOC_MAP with
+ * SGX5_MAP_ANY instead adds a mapping to the open file and returns its number,
+ * SGX5_FILE_MAP_BASE or above. Those are reference counted, can be mmap()ed at
+ * mmap_offset and go away with the last close of the file and munmap().
+ * SGX5_IOC_DMA_ALLOC adds a map of the same kind holding a DMA-coherent buffer
+ * of the PLX device instead of an aperture window; SGX5_IOC_UNMAP drops it.
+ */
+#define SGX5_MAP_ANY 0xffffffff
+#define SGX5_FILE_MAP_BASE 0x100
+#define SGX5_MMAP_SHIFT 32		/* mmap offset of a mapping is map << SGX5_MMAP_SHIFT */
+
+/* One window of the PLX aperture */
+struct sgx5_map_req {
+	__u32 map;
+	__u32 cache;			/* SGX5_CACHE_* of the user mapping, per file maps only */
+	__u64 remote_phys_addr;
+	__u64 len;
+	__u64 local_phys_addr;		/* out */
+	__u64 mmap_offset;		/* out, per file maps only */
+};
+
+/* Physically contiguous memory the peer can map through its aperture, for rings */
+struct sgx5_dma_req {
+	__u32 map;			/* out */
+	__u32 reserved;
+	__u64 len;			/* whole pages */
+	__u64 dma_addr;			/* out, the address to hand to the peer */
+	__u64 mmap_offset;		/* out */
+};
+
+/* Bus addresses, e.g. local_phys_addr of a map and dma_addr or the physical address of memory of ours */
+struct sgx5_copy_req {
+	__u64 dst;
+	__u64 src;
+	__u64 len;
+};
+
+struct sgx5_cache_req {
+	__u64 base;			/* power of two sized and aligned, as for /proc/mtrr */
+	__u64 size;
+	__u32 type;			/* SGX5_CACHE_* */
+	__s32 handle;			/* out */
+};
+
+struct sgx5_platform_info {
+	__u32 platform;			/* SGX5_PLATFORM_* */
+	__s32 socket;			/* VCA socket served by this mapper */
+	__u32 maps;			/* number of map slots */
+	__s32 numa_node;		/* NUMA node of the PLX device, -1 if unknown */
+};
+
+#define SGX5_IOC_MAGIC 0xB5
+
+/* Map remote_phys_addr/len into slot map, replacing what the slot held */
+#define SGX5_IOC_MAP		_IOWR(SGX5_IOC_MAGIC, 1, struct sgx5_map_req)
+#define SGX5_IOC_UNMAP		_IOW(SGX5_IOC_MAGIC, 2, struct sgx5_map_req)
+#define SGX5_IOC_QUERY		_IOWR(SGX5_IOC_MAGIC, 3, struct sgx5_map_req)
+/* Set the memory type of a local physical range through an MTRR */
+#define SGX5_IOC_SET_CACHING	_IOWR(SGX5_IOC_MAGIC, 4, struct sgx5_cache_req)
+#define SGX5_IOC_PLATFORM	_IOR(SGX5_IOC_MAGIC, 5, struct sgx5_platform_info)
+#define SGX5_IOC_DMA_ALLOC	_IOWR(SGX5_IOC_MAGIC, 6, struct sgx5_dma_req)
+/* Copy with the DMA engine of the PLX device and wait for it, ENODEV if it has none */
+#define SGX5_IOC_DMA_COPY	_IOW(SGX5_IOC_MAGIC, 7, struct sgx5_copy_req)
+
+#endif /* _SGX5_IOCTL_H_ */
@@ -44,14 +44,9 @@ void *enqueue(void *channel)
 	unsigned long count = 0;
 	int i = *((int *)channel);
 	int j;
-	cpu_set_t cpuset;
-	const pthread_t pid = pthread_self();
-	CPU_ZERO(&cpuset);
-	CPU_SET(i, &cpuset);
-
-	const int set_result = pthread_setaffinity_np(pid, sizeof(cpu_set_t), &cpuset);
-  	if (set_result != 0) {
-    		printf("pthread_setaffinity_np error setting on id %d\n",i);
+	// i-th CPU next to the card rather than CPU i
+  	if (vca_pin_thread(WITH_HOST, i) != 0) {
+    		printf("vca_pin_thread error setting on id %d\n",i);
   	}
 
         printf("enqueueing on channel %d\n\n",i);      